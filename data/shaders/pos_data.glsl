@@ -1,14 +1,14 @@
-varying lowp  vec2 v_pos_data;
+varying mediump vec4 v_pos_data;
 uniform highp mat4 u_model;
 uniform highp mat4 u_view;
 uniform highp mat4 u_proj;
-uniform lowp  vec2 u_tile_id;
+uniform mediump vec2 u_tile_id;
 
 #ifdef VERTEX_SHADER
 
 /************************************************************************/
 attribute highp vec3 a_pos;
-attribute lowp  vec2 a_pos_data;
+attribute mediump vec4 a_pos_data;
 
 void main()
 {
@@ -25,8 +25,8 @@ void main()
 /************************************************************************/
 void main()
 {
-    gl_FragColor.rg = u_tile_id;
-    gl_FragColor.ba = v_pos_data;
+    // The tile id and the pos data use different bits of the pixel.
+    gl_FragColor = vec4(u_tile_id, 0.0, 0.0) + v_pos_data;
 }
 /************************************************************************/
 
@@ -138,18 +138,18 @@
     "#endif\n"
     ""
 },
-{.path = "data/shaders/pos_data.glsl", .size = 788, .data =
-    "varying lowp  vec2 v_pos_data;\n"
+{.path = "data/shaders/pos_data.glsl", .size = 855, .data =
+    "varying mediump vec4 v_pos_data;\n"
     "uniform highp mat4 u_model;\n"
     "uniform highp mat4 u_view;\n"
     "uniform highp mat4 u_proj;\n"
-    "uniform lowp  vec2 u_tile_id;\n"
+    "uniform mediump vec2 u_tile_id;\n"
     "\n"
     "#ifdef VERTEX_SHADER\n"
     "\n"
     "/************************************************************************/\n"
     "attribute highp vec3 a_pos;\n"
-    "attribute lowp  vec2 a_pos_data;\n"
+    "attribute mediump vec4 a_pos_data;\n"
     "\n"
     "void main()\n"
     "{\n"
@@ -166,8 +166,8 @@
     "/************************************************************************/\n"
     "void main()\n"
     "{\n"
-    "    gl_FragColor.rg = u_tile_id;\n"
-    "    gl_FragColor.ba = v_pos_data;\n"
+    "    // The tile id and the pos data use different bits of the pixel.\n"
+    "    gl_FragColor = vec4(u_tile_id, 0.0, 0.0) + v_pos_data;\n"
     "}\n"
     "/************************************************************************/\n"
     "\n"
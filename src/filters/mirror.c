@@ -26,13 +26,10 @@ typedef struct {
 
 static void volume_mirror(volume_t *volume, int axis, const int aabb[2][3])
 {
-    int pos[3];
-    int buffer_pos[3];
-    int volume_pos[3];
     int size[3];
+    int strides[3];
     uint8_t *buffer;
-    int i;
-    size_t buffer_offset;
+    size_t offset;
 
     if (aabb[1][axis] - aabb[0][axis] == 1) {
         return;
@@ -44,46 +41,15 @@ static void volume_mirror(volume_t *volume, int axis, const int aabb[2][3])
 
     buffer = malloc(4 * size[0] * size[1] * size[2]);
 
-    for (pos[0] = 0; pos[0] < size[0]; pos[0]++) {
-        for (pos[1] = 0; pos[1] < size[1]; pos[1]++) {
-            for (pos[2] = 0; pos[2] < size[2]; pos[2]++) {
-                memcpy(buffer_pos, pos, sizeof(pos));
-                memcpy(volume_pos, pos, sizeof(pos));
-
-                for (i = 0; i < 3; i++) {
-                    volume_pos[i] += aabb[0][i];
-                }
-
-                buffer_pos[axis] = size[axis] - buffer_pos[axis] - 1;
-
-                buffer_offset = 4 * (
-                    buffer_pos[2] * size[0] * size[1] +
-                    buffer_pos[1] * size[0] + buffer_pos[0]
-                );
-
-                volume_get_at(volume, NULL, volume_pos, &buffer[buffer_offset]);
-            }
-        }
-    }
-
-    for (pos[0] = 0; pos[0] < size[0]; pos[0]++) {
-        for (pos[1] = 0; pos[1] < size[1]; pos[1]++) {
-            for (pos[2] = 0; pos[2] < size[2]; pos[2]++) {
-                memcpy(volume_pos, pos, sizeof(pos));
-
-                for (i = 0; i < 3; i++) {
-                    volume_pos[i] += aabb[0][i];
-                }
-
-                buffer_offset = 4 * (
-                    pos[2] * size[0] * size[1] +
-                    pos[1] * size[0] + pos[0]
-                );
-
-                volume_set_at(volume, NULL, volume_pos, &buffer[buffer_offset]);
-            }
-        }
-    }
+    // Read the box with a negative stride along the mirror axis, so that
+    // the buffer is already flipped.
+    strides[0] = 4;
+    strides[1] = 4 * size[0];
+    strides[2] = 4 * size[0] * size[1];
+    offset = (size[axis] - 1) * strides[axis];
+    strides[axis] = -strides[axis];
+    volume_read_region(volume, aabb, buffer + offset, strides);
+    volume_write_region(volume, aabb, buffer, NULL);
 
     free(buffer);
 }
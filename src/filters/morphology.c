@@ -0,0 +1,106 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "goxel.h"
+
+/*
+ * Filter to grow, shrink or hollow the voxels with the morphology
+ * functions of volume_utils.
+ */
+
+enum {
+    OP_DILATE,
+    OP_ERODE,
+    OP_OPEN,
+    OP_CLOSE,
+    OP_SHELL,
+};
+
+typedef struct {
+    filter_t filter;
+    int op;
+    int shape;
+    int radius;
+    bool current_only;
+} filter_morphology_t;
+
+static void apply(volume_t *volume, int op, int shape, int radius)
+{
+    switch (op) {
+    case OP_DILATE:
+        volume_dilate(volume, shape, radius);
+        break;
+    case OP_ERODE:
+        volume_erode(volume, shape, radius);
+        break;
+    case OP_OPEN:
+        volume_erode(volume, shape, radius);
+        volume_dilate(volume, shape, radius);
+        break;
+    case OP_CLOSE:
+        volume_dilate(volume, shape, radius);
+        volume_erode(volume, shape, radius);
+        break;
+    case OP_SHELL:
+        volume_shell(volume, shape, radius);
+        break;
+    }
+}
+
+static int gui(filter_t *filter)
+{
+    filter_morphology_t *morph = (void*)filter;
+    static const char *OP_NAMES[] = {
+        "Dilate", "Erode", "Open", "Close", "Shell"};
+    static const char *SHAPE_NAMES[] = {"Cube", "Sphere", "Cross"};
+    layer_t *layer;
+
+    if (morph->radius == 0) morph->radius = 1;
+
+    gui_group_begin(NULL);
+    gui_text("Operation");
+    gui_combo("##operation", &morph->op, OP_NAMES, ARRAY_SIZE(OP_NAMES));
+    gui_text("Shape");
+    gui_combo("##shape", &morph->shape, SHAPE_NAMES, ARRAY_SIZE(SHAPE_NAMES));
+    gui_input_int(morph->op == OP_SHELL ? "Thickness" : "Radius",
+                  &morph->radius, 1, MORPH_MAX_RADIUS);
+    gui_checkbox(
+        "Current layer only",
+        &morph->current_only,
+        "If checked, only voxels on the current layer will be modified.\n"
+        "If unchecked, voxels on all layers will be modified."
+    );
+    gui_group_end();
+
+    if (!gui_button("Apply", -1, 0)) return 0;
+    if (morph->current_only && !goxel.image->active_layer->visible)
+        return 0;
+
+    DL_FOREACH(goxel.image->layers, layer) {
+        if (morph->current_only && layer != goxel.image->active_layer)
+            continue;
+        apply(layer->volume, morph->op, morph->shape, morph->radius);
+    }
+    image_history_push(goxel.image);
+    return 0;
+}
+
+FILTER_REGISTER(morphology, filter_morphology_t,
+    .name = "Morphology",
+    .gui_fn = gui,
+)
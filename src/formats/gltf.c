@@ -48,8 +48,13 @@ typedef struct {
 typedef struct {
     bool vertex_color;
     float simplify;
+    bool merge_faces;
+    bool optimize_chunks;
 } export_options_t;
 
+// Size of the chunks when we optimize the meshes by chunks.
+#define OPTIMIZE_CHUNK_SIZE 128
+
 static export_options_t g_export_options = {};
 
 
@@ -255,8 +260,11 @@ static void save_layer(gltf_t *g, cgltf_node *root_node,
     cgltf_accessor *accessor;
 
     mesh = volume_generate_mesh(
-            layer->volume, goxel.rend.settings.effects, palette,
-            g_export_options.simplify);
+            layer->volume,
+            goxel.rend.settings.effects |
+                (options->merge_faces ? EFFECT_MERGE_FACES : 0),
+            palette, options->simplify,
+            options->optimize_chunks ? OPTIMIZE_CHUNK_SIZE : 0);
 
     if (mesh->vertices_count == 0) return;
 
@@ -448,6 +456,11 @@ static void export_gui(file_format_t *format)
                  _("Save colors as vertex attribute"));
     gui_input_float(_("Simplify"), &g_export_options.simplify, 0.1,
                     0, 1, "%.1f");
+    gui_checkbox(_("Merge Faces"), &g_export_options.merge_faces,
+                 _("Merge the adjacent faces of the same color"));
+    gui_checkbox(_("Optimize By Chunks"), &g_export_options.optimize_chunks,
+                 _("Faster for big models, but the vertices on the borders "
+                   "of the chunks are not merged"));
 }
 
 FILE_FORMAT_REGISTER(gltf,
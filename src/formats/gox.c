@@ -79,7 +79,8 @@
  */
 
 // We create a hash table of all the blocks, so that blocks with the same
-// ids get written only once.
+// ids get written only once.  When saving, empty blocks get a negative
+// index and are not written at all.
 typedef struct {
     UT_hash_handle  hh;
     void            *v;
@@ -89,6 +90,35 @@ typedef struct {
 
 #define CHUNK_BUFF_SIZE (1 << 20) // 1 MiB max buffer size!
 
+// The file format always uses 16^3 blocks, so bigger tiles are saved as
+// several blocks.
+#define BLOCKS_PER_TILE_SIDE (TILE_SIZE / 16)
+#define BLOCKS_PER_TILE (BLOCKS_PER_TILE_SIDE * BLOCKS_PER_TILE_SIDE * \
+                         BLOCKS_PER_TILE_SIDE)
+
+/*
+ * Get the position and uid of the i-th 16^3 block of a tile.  Two blocks
+ * with the same uid are guarantied to have the same content.
+ */
+static uint64_t get_block(const volume_t *volume, const int tile_pos[3],
+                          int i, int pos[3])
+{
+    const int n = BLOCKS_PER_TILE_SIDE;
+    pos[0] = tile_pos[0] + i % n * 16;
+    pos[1] = tile_pos[1] + i / n % n * 16;
+    pos[2] = tile_pos[2] + i / (n * n) * 16;
+    return volume_get_tile_id(volume, tile_pos) * BLOCKS_PER_TILE + i;
+}
+
+static bool block_is_empty(const uint8_t *v)
+{
+    int i;
+    for (i = 0; i < 16 * 16 * 16; i++) {
+        if (v[i * 4 + 3]) return false;
+    }
+    return true;
+}
+
 // XXX: should be something in goxel.h
 static const shape_t *SHAPES[] = {
     &shape_sphere,
@@ -260,7 +290,7 @@ void save_to_file(const image_t *img, const char *path)
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     layer_t *layer;
     chunk_t c;
-    int nb_blocks, index, size, bpos[3], material_idx;
+    int nb_blocks, index, size, bpos[3], pos[3], material_idx, i;
     uint64_t uid;
     FILE *out;
     uint8_t *png, *preview;
@@ -295,20 +325,23 @@ void save_to_file(const image_t *img, const char *path)
     DL_FOREACH(img->layers, layer) {
         iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
         while (volume_iter(&iter, bpos)) {
-            volume_get_tile_data(layer->volume, &iter, bpos, &uid);
-            HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
-            if (data) continue;
-            data = calloc(1, sizeof(*data));
-            data->v = volume_get_tile_data(layer->volume, &iter, bpos, NULL);
-            assert(data->v);
-            data->uid = uid;
-            data->index = index++;
-            HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
+            for (i = 0; i < BLOCKS_PER_TILE; i++) {
+                uid = get_block(layer->volume, bpos, i, pos);
+                HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
+                if (data) continue;
+                data = calloc(1, sizeof(*data));
+                data->v = malloc(16 * 16 * 16 * 4);
+                volume_read(layer->volume, pos, (int[]){16, 16, 16}, data->v);
+                data->uid = uid;
+                data->index = block_is_empty(data->v) ? -1 : index++;
+                HASH_ADD(hh, blocks_table, uid, sizeof(data->uid), data);
+            }
         }
     }
 
     // Write all the blocks chunks.
     HASH_ITER(hh, blocks_table, data, data_tmp) {
+        if (data->index < 0) continue;
         png = img_write_to_mem((uint8_t*)data->v, 64, 64, 4, &size);
         chunk_write_all(out, "BL16", (char*)png, size);
         free(png);
@@ -337,21 +370,28 @@ void save_to_file(const image_t *img, const char *path)
         if (!layer->base_id && !layer->shape) {
             iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
             while (volume_iter(&iter, bpos)) {
-                nb_blocks++;
+                for (i = 0; i < BLOCKS_PER_TILE; i++) {
+                    uid = get_block(layer->volume, bpos, i, pos);
+                    HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
+                    assert(data);
+                    if (data->index >= 0) nb_blocks++;
+                }
             }
         }
         chunk_write_int32(&c, out, nb_blocks);
         if (!layer->base_id && !layer->shape) {
             iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
             while (volume_iter(&iter, bpos)) {
-                volume_get_tile_data(layer->volume, &iter, bpos, &uid);
-                HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
-                assert(data);
-                chunk_write_int32(&c, out, data->index);
-                chunk_write_int32(&c, out, bpos[0]);
-                chunk_write_int32(&c, out, bpos[1]);
-                chunk_write_int32(&c, out, bpos[2]);
-                chunk_write_int32(&c, out, 0);
+                for (i = 0; i < BLOCKS_PER_TILE; i++) {
+                    uid = get_block(layer->volume, bpos, i, pos);
+                    HASH_FIND(hh, blocks_table, &uid, sizeof(uid), data);
+                    if (data->index < 0) continue;
+                    chunk_write_int32(&c, out, data->index);
+                    chunk_write_int32(&c, out, pos[0]);
+                    chunk_write_int32(&c, out, pos[1]);
+                    chunk_write_int32(&c, out, pos[2]);
+                    chunk_write_int32(&c, out, 0);
+                }
             }
         }
         chunk_write_dict_value(&c, out, "name", layer->name,
@@ -425,6 +465,7 @@ void save_to_file(const image_t *img, const char *path)
 
     HASH_ITER(hh, blocks_table, data, data_tmp) {
         HASH_DEL(blocks_table, data);
+        free(data->v);
         free(data);
     }
 
@@ -114,10 +114,9 @@ static int export_as_png_slices(const file_format_t *format,
     float box[4][4];
     const volume_t *volume;
     const layer_t *layer;
-    int x, y, z, w, h, d, pos[3], start_pos[3];
-    uint8_t c[4];
-    uint8_t *img;
-    volume_iterator_t iter = {0};
+    int x, y, z, w, h, d, start_pos[3], aabb[2][3];
+    const uint8_t *c;
+    uint8_t *img, *buf;
     float material_alpha;
 
     // Get the bounding box from the merged volume
@@ -132,6 +131,13 @@ static int export_as_png_slices(const file_format_t *format,
     start_pos[2] = box[3][2] - box[2][2];
 
     img = calloc(w * h * d, 4);
+    buf = malloc(w * h * d * 4);
+    aabb[0][0] = start_pos[0];
+    aabb[0][1] = start_pos[1];
+    aabb[0][2] = start_pos[2];
+    aabb[1][0] = start_pos[0] + w;
+    aabb[1][1] = start_pos[1] + h;
+    aabb[1][2] = start_pos[2] + d;
 
     // Iterate through layers to preserve material alpha information
     DL_FOREACH(image->layers, layer) {
@@ -144,16 +150,11 @@ static int export_as_png_slices(const file_format_t *format,
             material_alpha = layer->material->base_color[3];
         }
 
-        iter = (volume_iterator_t){0};
+        volume_read_region(layer->volume, aabb, buf, NULL);
+        c = buf;
         for (z = 0; z < d; z++)
         for (y = 0; y < h; y++)
-        for (x = 0; x < w; x++) {
-            pos[0] = x + start_pos[0];
-            pos[1] = y + start_pos[1];
-            pos[2] = z + start_pos[2];
-
-            volume_get_at(layer->volume, &iter, pos, c);
-
+        for (x = 0; x < w; x++, c += 4) {
             // Skip empty voxels
             if (c[3] == 0) continue;
 
@@ -178,6 +179,7 @@ static int export_as_png_slices(const file_format_t *format,
 
     img_write(img, w * d, h, 4, path);
     free(img);
+    free(buf);
 
     // Write companion JSON file
     char json_path[1024];
@@ -45,6 +45,7 @@ typedef struct {
 
 typedef struct {
     bool y_up;
+    bool merge_faces;
 } export_options_t;
 
 static export_options_t g_export_options = {
@@ -87,20 +88,18 @@ static int lines_add(UT_array *lines, const line_t *line, int search_nb)
 
 static int export(const volume_t *volume, const char *path, bool ply)
 {
-    // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
+    // XXX: Allow to chose between quads or triangles.
     //      Also export mlt file for the colors.
-    voxel_vertex_t* verts;
+    const voxel_vertex_t *verts;
     float v[3];
     uint8_t c[3];
-    int nb_elems, i, j, bpos[3];
+    int i, j, t, nb_tiles;
     float mat[4][4];
     FILE *out;
-    const int N = BLOCK_SIZE;
-    int size = 0, subdivide;
+    int size = 0, subdivide, effects;
     UT_array *lines_f, *lines_v, *lines_vn;
     line_t line, face, *line_ptr = NULL;
-    volume_iterator_t iter;
+    volume_tile_vertices_t *tiles;
     static const float ZUP2YUP[4][4] = {
         {1, 0, 0, 0}, {0, 0, -1, 0}, {0, 1, 0, 0}, {0, 0, 0, 1},
     };
@@ -108,20 +107,23 @@ static int export(const volume_t *volume, const char *path, bool ply)
     utarray_new(lines_f, &line_icd);
     utarray_new(lines_v, &line_icd);
     utarray_new(lines_vn, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
     face = (line_t){};
-    iter = volume_get_iterator(volume,
-            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
-    while (volume_iter(&iter, bpos)) {
+    effects = goxel.rend.settings.effects;
+    if (g_export_options.merge_faces) effects |= EFFECT_MERGE_FACES;
+    // The tiles faces are generated in parallel, then we merge the
+    // vertices in a single pass.
+    tiles = volume_generate_tiles_vertices(volume, effects, &nb_tiles);
+    for (t = 0; t < nb_tiles; t++) {
         mat4_set_identity(mat);
         if (g_export_options.y_up) {
             mat4_mul(ZUP2YUP, mat, mat);
         }
-        mat4_itranslate(mat, bpos[0], bpos[1], bpos[2]);
-        nb_elems = volume_generate_vertices(volume, bpos,
-                                    goxel.rend.settings.effects, verts,
-                                    &size, &subdivide);
-        for (i = 0; i < nb_elems; i++) {
+        mat4_itranslate(mat, tiles[t].pos[0], tiles[t].pos[1],
+                        tiles[t].pos[2]);
+        verts = tiles[t].vertices;
+        size = tiles[t].size;
+        subdivide = tiles[t].subdivide;
+        for (i = 0; i < tiles[t].nb; i++) {
             // Put the vertices.
             for (j = 0; j < size; j++) {
                 v[0] = verts[i * size + j].pos[0] / (float)subdivide;
@@ -146,6 +148,7 @@ static int export(const volume_t *volume, const char *path, bool ply)
             lines_add(lines_f, &face, 0);
         }
     }
+    volume_tiles_vertices_free(tiles, nb_tiles);
     out = fopen(path, "w");
     if (ply) {
         fprintf(out, "ply\n");
@@ -212,7 +215,6 @@ static int export(const volume_t *volume, const char *path, bool ply)
     utarray_free(lines_f);
     utarray_free(lines_v);
     utarray_free(lines_vn);
-    free(verts);
     return 0;
 }
 
@@ -233,6 +235,8 @@ int ply_export(const file_format_t *format, const image_t *image,
 static void export_gui(file_format_t *format)
 {
     gui_checkbox(_("Y Up"), &g_export_options.y_up, _("Use +Y up convention"));
+    gui_checkbox(_("Merge Faces"), &g_export_options.merge_faces,
+                 _("Merge the adjacent faces of the same color"));
 }
 
 static void get_file_data(void *ctx, const char *filename, const int is_mtl,
@@ -57,13 +57,14 @@ texture_t *texture_new_image(const char *path, int flags)
 static void unpack_pos_data(uint32_t v, int pos[3], int *face,
                             int *cube_id)
 {
-    assert(TILE_SIZE == 16);
+    const int b = POS_DATA_POS_BITS;
+    const uint32_t m = (1 << b) - 1;
     int x, y, z, f, i;
-    x = v >> 28;
-    y = (v >> 24) & 0x0f;
-    z = (v >> 20) & 0x0f;
-    f = (v >> 16) & 0x0f;
-    i = v & 0xffff;
+    x = v >> (32 - b);
+    y = (v >> (32 - 2 * b)) & m;
+    z = (v >> (32 - 3 * b)) & m;
+    f = (v >> POS_DATA_ID_BITS) & ((1 << (32 - 3 * b - POS_DATA_ID_BITS)) - 1);
+    i = v & ((1 << POS_DATA_ID_BITS) - 1);
     assert(f < 6);
     pos[0] = x;
     pos[1] = y;
@@ -697,6 +698,7 @@ int goxel_iter(const inputs_t *inputs)
     update_window_title();
 
     goxel.frame_count++;
+    goxel_check_memory_budget();
 
     if (goxel.request_test_graphic_release) {
         goxel_release_graphics();
@@ -1383,6 +1385,165 @@ void goxel_on_low_memory(void)
     render_on_low_memory(&goxel.rend);
 }
 
+/*
+ * Estimation of the memory we can release: the volumes tiles, shared by the
+ * layers, the undo history and the volumes caches, plus the caches that
+ * hold their own data.  The GPU buffers of the render cache are not part of
+ * it.  We don't use the process RSS, since it also counts a lot of memory
+ * we have no control over (code, GPU driver...), but after we release
+ * memory we trim the pools so that the RSS follows.
+ */
+static uint64_t get_memory_usage(void)
+{
+    volume_global_stats_t stats;
+    cache_t *cache;
+    cache_stats_t cache_stats;
+    uint64_t ret;
+
+    volume_get_global_stats(&stats);
+    ret = stats.mem;
+    for (cache = cache_next(NULL); cache; cache = cache_next(cache)) {
+        cache_get_stats(cache, &cache_stats);
+        if (cache_stats.flags & (CACHE_SHARED_MEM | CACHE_GPU_MEM)) continue;
+        ret += cache_stats.size;
+    }
+    return ret;
+}
+
+// Ratio of the cache lookups that were hits.
+static float cache_get_hit_ratio(const cache_stats_t *stats)
+{
+    if (stats->hits + stats->misses == 0) return 0;
+    return (float)stats->hits / (stats->hits + stats->misses);
+}
+
+/*
+ * Pick the cache that gives back the most memory for the hits we lose if
+ * we halve it: halving a cache frees half its size and, assuming all the
+ * items are equally used, loses half its hits.
+ */
+static cache_t *pick_cache_to_shrink(cache_t **caches, int nb)
+{
+    cache_stats_t stats;
+    cache_t *ret = NULL;
+    double score, best = -1;
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        cache_get_stats(caches[i], &stats);
+        if (stats.nb_items == 0) continue;
+        score = stats.size / (cache_get_hit_ratio(&stats) + 0.01);
+        if (score > best) {
+            best = score;
+            ret = caches[i];
+        }
+    }
+    return ret;
+}
+
+/*
+ * Check if the undo snapshots we can remove hold some tiles that the image
+ * layers don't use anymore.  If not, removing them won't free any memory,
+ * since the image alone is what takes it.
+ */
+static bool history_has_own_tiles(const image_t *img)
+{
+    const image_t *snap;
+    const layer_t *layer, *img_layer;
+    volume_iterator_t iter;
+    uint64_t id;
+    int pos[3];
+    bool found;
+
+    for (snap = img->history; snap && snap != img->history_pos;
+         snap = snap->history_next) {
+        DL_FOREACH(snap->layers, layer) {
+            iter = volume_get_iterator(layer->volume, VOLUME_ITER_TILES);
+            while (volume_iter(&iter, pos)) {
+                id = volume_get_tile_id(layer->volume, pos);
+                found = false;
+                DL_FOREACH(img->layers, img_layer) {
+                    if (volume_get_tile_id(img_layer->volume, pos) == id) {
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Release memory until we get under a given target, starting with what is
+ * cheap to get back: first the caches, in cost/benefit order, then the
+ * undo history, from the oldest snapshots, as long as it holds some tiles
+ * the image doesn't use.  The freed tiles go back to the pools, that we trim
+ * at the end to give the memory to the system.
+ *
+ * Returns the memory usage at the end.
+ */
+static uint64_t release_memory(uint64_t target)
+{
+    cache_t *caches[64], *cache;
+    cache_stats_t stats;
+    pool_t *pool;
+    int nb = 0, nb_undo = 0;
+    uint64_t usage = get_memory_usage();
+
+    for (cache = cache_next(NULL); cache && nb < ARRAY_SIZE(caches);
+         cache = cache_next(cache)) {
+        // Releasing GPU memory won't help.
+        cache_get_stats(cache, &stats);
+        if (stats.flags & CACHE_GPU_MEM) continue;
+        caches[nb++] = cache;
+    }
+
+    // Halve the caches one at a time, until they are all empty.
+    while (usage > target && (cache = pick_cache_to_shrink(caches, nb))) {
+        cache_get_stats(cache, &stats);
+        cache_shrink(cache, stats.size / 2);
+        usage = get_memory_usage();
+    }
+
+    while (usage > target && history_has_own_tiles(goxel.image) &&
+           image_history_pop_oldest(goxel.image)) {
+        usage = get_memory_usage();
+        nb_undo++;
+    }
+    if (nb_undo)
+        LOG_W("Memory budget: removed %d undo steps", nb_undo);
+
+    for (pool = pool_next(NULL); pool; pool = pool_next(pool))
+        pool_trim(pool);
+    return usage;
+}
+
+void goxel_check_memory_budget(void)
+{
+    // Usage we got down to the last time we could not go under the budget.
+    static uint64_t floor = 0;
+    uint64_t budget = (uint64_t)goxel.memory_budget * MB;
+    uint64_t usage;
+
+    if (!budget) return;
+    usage = get_memory_usage();
+    if (usage <= budget) {
+        floor = 0;
+        return;
+    }
+    // Don't release everything again at every frame if the image alone
+    // is bigger than the budget: wait for the usage to grow.
+    if (floor && usage <= floor + budget / 8) return;
+
+    // Go a bit under the budget so that we don't run it too often.
+    usage = release_memory(budget - budget / 8);
+    LOG_I("Memory budget exceeded, released memory down to %dM",
+          (int)(usage / MB));
+    floor = usage > budget ? usage : 0;
+}
+
 int goxel_import_file(const char *path, const char *format)
 {
     const file_format_t *f;
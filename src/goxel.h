@@ -66,9 +66,11 @@
 #include "utils/img.h"
 #include "utils/path.h"
 #include "utils/plane.h"
+#include "utils/pool.h"
 #include "utils/sound.h"
 #include "utils/texture.h"
 #include "utils/vec.h"
+#include "utils/workers.h"
 
 #include <float.h>
 #include <stdarg.h>
@@ -429,8 +431,25 @@ enum {
 #undef X
 
 // #### Block ##################
-// The block size can only be 16.
-#define BLOCK_SIZE 16
+// The block size is the tile size, set at compile time (16 or 32).
+#define BLOCK_SIZE TILE_SIZE
+
+/*
+ * Packing of the pixels of the pos data render, used for picking.  The tile
+ * id is in the lower bits, then the face, and the voxel position in the
+ * tile in the upper bits:
+ *
+ *   TILE_SIZE 16: id 16 bits, face 4 bits, z, y, x 4 bits each.
+ *   TILE_SIZE 32: id 14 bits, face 3 bits, z, y, x 5 bits each.
+ */
+#if BLOCK_SIZE == 16
+#   define POS_DATA_ID_BITS     16
+#   define POS_DATA_POS_BITS    4
+#else
+#   define POS_DATA_ID_BITS     14
+#   define POS_DATA_POS_BITS    5
+#endif
+
 #define VOXEL_TEXTURE_SIZE 8
 
 // Generate an optimal palette whith a fixed number of colors from a volume.
@@ -566,6 +585,10 @@ typedef struct goxel
     // Can be set to a key code (only KEY_LEFT_ALT is supported for now).
     int emulate_three_buttons_mouse;
 
+    // Max memory used by the volumes and the caches (MB), 0 for no limit.
+    // See goxel_check_memory_budget.
+    int memory_budget;
+
     // Stb arrary of hints to show on top of the screen.
     hint_t *hints;
 
@@ -601,6 +624,13 @@ void goxel_release_graphics(void);
  */
 void goxel_on_low_memory(void);
 
+/*
+ * Function: goxel_check_memory_budget
+ * Release cached data and old undo snapshots if we use more memory than
+ * the budget set in the settings.  Called at every frame.
+ */
+void goxel_check_memory_budget(void);
+
 int goxel_unproject(const float viewport[4],
                     const float pos[2], int snap_mask,
                     const float snap_shape[4][4],
@@ -694,5 +724,9 @@ void goxel_update_keymaps(void);
  * Run all the unit tests */
 void tests_run(void);
 
+/* Function: bench_run
+ * Run some benchmarks of the volume functions and print the results */
+void bench_run(void);
+
 
 #endif // GOXEL_H
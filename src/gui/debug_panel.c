@@ -21,12 +21,34 @@
 void gui_debug_panel(void)
 {
     volume_global_stats_t stats;
+    pool_t *pool;
+    pool_stats_t pool_stats;
+    cache_t *cache;
+    cache_stats_t cache_stats;
 
     gui_text("FPS: %d", (int)round(goxel.fps));
     volume_get_global_stats(&stats);
     gui_text("Nb volumes: %d", stats.nb_volumes);
     gui_text("Nb tiles: %d", stats.nb_tiles);
+    gui_text("Uniform / indexed: %d / %d", stats.nb_uniform_tiles,
+             stats.nb_indexed_tiles);
     gui_text("Mem: %dM", (int)(stats.mem / (1 << 20)));
+    gui_text("Mem saved: %dM", (int)(stats.mem_saved / (1 << 20)));
+    for (pool = pool_next(NULL); pool; pool = pool_next(pool)) {
+        pool_get_stats(pool, &pool_stats);
+        gui_text("Pool %s: %d/%d %dM%s", pool_stats.name, pool_stats.nb_used,
+                 pool_stats.nb_used + pool_stats.nb_free,
+                 (int)(pool_stats.mem / (1 << 20)),
+                 pool_stats.huge_pages ? " (huge pages)" : "");
+    }
+    for (cache = cache_next(NULL); cache; cache = cache_next(cache)) {
+        cache_get_stats(cache, &cache_stats);
+        gui_text("Cache %s: %d %dM/%dM", cache_stats.name,
+                 cache_stats.nb_items, (int)(cache_stats.size / (1 << 20)),
+                 (int)(cache_stats.max_size / (1 << 20)));
+        gui_text("  hits %d miss %d evict %d", (int)cache_stats.hits,
+                 (int)cache_stats.misses, (int)cache_stats.evictions);
+    }
 
     if (!DEFINED(GLES2)) {
         gui_checkbox_flag("Show wireframe", &goxel.view_effects,
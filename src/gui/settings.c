@@ -23,6 +23,11 @@
 
 #include "utils/ini.h"
 
+// Default max memory usage (MB), see goxel_check_memory_budget.
+#ifndef DEFAULT_MEMORY_BUDGET
+#   define DEFAULT_MEMORY_BUDGET 0
+#endif
+
 static int shortcut_callback(action_t *action, void *user)
 {
     if (!(action->flags & ACTION_CAN_EDIT_SHORTCUT)) return 0;
@@ -178,6 +183,15 @@ int gui_settings_popup(void *data)
         }
     } gui_section_end();
 
+    if (gui_section_begin("Memory", GUI_SECTION_COLLAPSABLE_CLOSED)) {
+        gui_input_int("Budget (MB)", &goxel.memory_budget, 0, 1 << 20);
+        if (gui_is_item_deactivated()) {
+            settings_save();
+        }
+        gui_text("Use 0 for no limit.");
+        gui_text("Over the budget the oldest undo steps are removed.");
+    } gui_section_end();
+
     if (gui_section_begin(_("Paths"), GUI_SECTION_COLLAPSABLE_CLOSED)) {
         gui_text("Palettes: %s/palettes", sys_get_user_dir());
         gui_text("Progs: %s/progs", sys_get_user_dir());
@@ -263,6 +277,11 @@ static int settings_ini_handler(void *user, const char *section,
     if (strcmp(section, "keymaps") == 0) {
         add_keymap(name, value);
     }
+    if (strcmp(section, "memory") == 0) {
+        if (strcmp(name, "budget") == 0) {
+            goxel.memory_budget = max(0, atoi(value));
+        }
+    }
     if (strcmp(section, "inputs") == 0) {
         if (strcmp(name, "emulate_three_buttons_mouse") == 0) {
             if (strcmp(value, "alt") == 0) {
@@ -280,6 +299,7 @@ void settings_load(void)
     LOG_I("Read settings file: %s", path);
     arrfree(goxel.keymaps);
     goxel.emulate_three_buttons_mouse = 0;
+    goxel.memory_budget = DEFAULT_MEMORY_BUDGET;
     ini_parse(path, settings_ini_handler, NULL);
     actions_check_shortcuts();
     gesture_set_emulate_three_buttons_mouse(goxel.emulate_three_buttons_mouse);
@@ -350,6 +370,10 @@ void settings_save(void)
     fprintf(file, "scale=%f\n", gui_get_scale());
     fprintf(file, "\n");
 
+    fprintf(file, "[memory]\n");
+    fprintf(file, "budget=%d\n", goxel.memory_budget);
+    fprintf(file, "\n");
+
     fprintf(file, "[shortcuts]\n");
     actions_iter(shortcut_save_callback, file);
 
@@ -60,6 +60,10 @@ void gui_view_panel(void)
             &goxel.rend.settings.effects, EFFECT_SEE_BACK, NULL);
     gui_checkbox_flag(_("Marching Cubes"),
                 &goxel.rend.settings.effects, EFFECT_MARCHING_CUBES, NULL);
+    gui_checkbox_flag(_("Merge Faces"),
+                &goxel.rend.settings.effects, EFFECT_MERGE_FACES,
+                _("Render big flat surfaces with fewer triangles.  "
+                  "Not used with the borders and grid effects."));
 
     if (goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) {
         gui_checkbox_flag(_("Smooth"), &goxel.rend.settings.effects,
@@ -357,6 +357,7 @@ void image_delete(image_t *img)
         material_delete(mat);
     }
 
+    volume_delete(img->selection_mask);
     free(img->path);
     free(img->export_path);
 
@@ -670,6 +671,7 @@ void image_history_push(image_t *img)
         while (img->history_pos->history_next) {
             snap = img->history_pos->history_next;
             DL_DELETE2(img->history, snap, history_prev, history_next);
+            image_delete(snap);
             debug_print_history(img);
         }
     }
@@ -680,27 +682,24 @@ void image_history_push(image_t *img)
     debug_print_history(img);
 }
 
+bool image_history_pop_oldest(image_t *img)
+{
+    image_t *snap = img->history;
+    // The current position is needed for undo and redo.
+    if (!snap || snap == img->history_pos) return false;
+    DL_DELETE2(img->history, snap, history_prev, history_next);
+    image_delete(snap);
+    return true;
+}
+
 void image_history_resize(image_t *img, int size)
 {
-    int i, nb = 0;
+    int nb;
     image_t *hist;
-    layer_t *layer, *layer_tmp;
-
-    // First cound the size of the history to compute how many we are going
-    // to remove.
-    for (hist = img->history; hist != img; hist = hist->history_next) nb++;
-    nb = max(0, nb - size);
-    for (i = 0; i < nb; i++) {
-        hist = img->history;
-
-        // XXX: do that in a function!
-        DL_FOREACH_SAFE(hist->layers, layer, layer_tmp) {
-            assert(layer);
-            DL_DELETE(hist->layers, layer);
-            layer_delete(layer);
-        }
-        DL_DELETE2(img->history, hist, history_prev, history_next);
-        free(hist);
+
+    DL_COUNT2(img->history, hist, nb, history_next);
+    for (; nb > size; nb--) {
+        if (!image_history_pop_oldest(img)) break;
     }
 }
 
@@ -75,6 +75,16 @@ void image_undo(image_t *img);
 void image_redo(image_t *img);
 void image_history_resize(image_t *img, int size);
 
+/*
+ * Function: image_history_pop_oldest
+ * Remove the oldest snapshot of the undo history.
+ *
+ * Returns:
+ *   false if there was nothing to remove.  The snapshot of the current
+ *   history position is never removed.
+ */
+bool image_history_pop_oldest(image_t *img);
+
 bool image_layer_can_edit(const image_t *img, const layer_t *layer);
 
 material_t *image_add_material(image_t *img, material_t *mat);
@@ -77,11 +77,13 @@ typedef struct
     const char *script;
     int script_args_nb;
     const char *script_args[32];
+    bool bench;
 } args_t;
 
 #define OPT_HELP 1
 #define OPT_VERSION 2
 #define OPT_SCRIPT 3
+#define OPT_BENCH 4
 
 typedef struct {
     const char *name;
@@ -97,6 +99,7 @@ static const gox_option_t OPTIONS[] = {
     {"scale", 's', required_argument, "FLOAT", .help="Set UI scale"},
     {"script", OPT_SCRIPT, required_argument, "FILENAME",
         .help="Run a script and exit"},
+    {"bench", OPT_BENCH, .help="Run the benchmarks and exit"},
     {"help", OPT_HELP, .help="Give this help list"},
     {"version", OPT_VERSION, .help="Print program version"},
     {}
@@ -162,6 +165,9 @@ static void parse_options(int argc, char **argv, args_t *args)
         case OPT_SCRIPT:
             args->script = optarg;
             break;
+        case OPT_BENCH:
+            args->bench = true;
+            break;
         case '?':
             exit(-1);
         }
@@ -409,6 +415,12 @@ int main(int argc, char **argv)
     sys_callbacks.open_dialog = open_dialog;
     parse_options(argc, argv, &args);
 
+    // The benchmarks don't need any window.
+    if (args.bench) {
+        bench_run();
+        return 0;
+    }
+
     g_scale = args.scale;
 
     glfwSetErrorCallback(on_glfw_error);
@@ -21,10 +21,18 @@
 
 // Number of sub position per voxel in the marching
 // cube rendering.
-#define MC_VOXEL_SUB_POS 8 // XXX: try to make it higher (up to 16!)
+// Must be such that the vertices positions fit in an uint8_t, so we use a
+// lower precision with big tiles.
+#define MC_VOXEL_SUB_POS (128 / BLOCK_SIZE) // XXX: try to make it higher!
 
 static const int N = BLOCK_SIZE;
 
+// Max distance of the signed distance field used for the smooth normals.
+// The normals depend on the voxels up to MC_SDF_DIST + 2 voxels away, so
+// this must stay smaller than a tile, since the rendering only check the
+// adjacent tiles to know if it needs to regenerate a tile mesh.
+#define MC_SDF_DIST 3
+
 // Marching cube data.
 static const int MC_EDGE_TABLE[256];
 static const int8_t MC_TRI_TABLE[256][16];
@@ -80,12 +88,49 @@ static void mc_interp_pos(const mc_vert_t *vert, float out[3], bool rounded)
     for (i = 0; i < 3; i++) {
         out[i] = (p0[i] * (1 - mu) + p1[i] * mu);
         if (rounded)
-            out[i] = round(out[i] * MC_VOXEL_SUB_POS / 4) * 4;
+            out[i] = round(out[i] * 2) * (MC_VOXEL_SUB_POS / 2);
         else
             out[i] = out[i] * MC_VOXEL_SUB_POS;
     }
 }
 
+// Gradient of the signed distance field at a voxel.
+static void sdf_gradient(const volume_sdf_t *sdf, const int pos[3],
+                         float out[3])
+{
+    int i, p0[3], p1[3];
+    for (i = 0; i < 3; i++) {
+        memcpy(p0, pos, sizeof(p0));
+        memcpy(p1, pos, sizeof(p1));
+        p0[i]--;
+        p1[i]++;
+        out[i] = (volume_sdf_get(sdf, p1) - volume_sdf_get(sdf, p0)) / 2;
+    }
+}
+
+/*
+ * Compute the normal of a vertex from the gradient of the signed distance
+ * field at the two voxels of its edge.  Return false if the gradient is
+ * null.
+ */
+static bool compute_vertex_normal(const volume_sdf_t *sdf,
+                                  const int pos[3], const mc_vert_t *vert,
+                                  float out[3])
+{
+    int i, p0[3], p1[3];
+    float g0[3], g1[3];
+    for (i = 0; i < 3; i++) {
+        p0[i] = pos[i] + VERTICES_POSITIONS[vert->v0][i];
+        p1[i] = pos[i] + VERTICES_POSITIONS[vert->v1][i];
+    }
+    sdf_gradient(sdf, p0, g0);
+    sdf_gradient(sdf, p1, g1);
+    vec3_mix(g0, g1, vert->mu, out);
+    if (vec3_norm2(out) == 0) return false;
+    vec3_normalize(out, out);
+    return true;
+}
+
 static void compute_triangle_normal(const mc_vert_t t[3], float out[3])
 {
     int i;
@@ -248,8 +293,14 @@ static int split_triangles(int nb, const mc_vert_t (*tri)[3],
     return ret;
 }
 
+volume_sdf_t *volume_compute_mc_sdf(const volume_t *volume)
+{
+    return volume_compute_sdf(volume, MC_SDF_DIST);
+}
+
 int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
-                                int effects, voxel_vertex_t *out,
+                                int effects, const volume_sdf_t *sdf,
+                                voxel_vertex_t *out,
                                 int *size, int *subdivide)
 {
     int i, vi, x, y, z, v, vx, vy, vz, nb_tri, nb_tri_tot = 0;
@@ -262,12 +313,18 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
                       {INT_MIN, INT_MIN, INT_MIN}};
 
     mc_vert_t tri[30][3];
-    float n[3];
+    float n[3], vn[3];
     const bool flat = !(effects & EFFECT_MC_SMOOTH);
+    volume_sdf_t *own_sdf = NULL;
 
     *size = 3;      // Triangles.
     *subdivide = MC_VOXEL_SUB_POS;
 
+    // In smooth mode, we use the distance field for the vertices normals.
+    // The caller can pass it already computed, since volume_compute_sdf
+    // can only be called from the main thread.
+    if (!flat && !sdf) sdf = own_sdf = volume_compute_mc_sdf(volume);
+
     // To speed things up we first get the voxel cube around the block.
     data = malloc((N + 2) * (N + 2) * (N + 2) * 4);
     p[0] = block_pos[0] - 1;
@@ -342,14 +399,19 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
             compute_triangle_normal(tri[i], n);
             for (v = 0; v < 3; v++) {
                 vi = nb_tri_tot * 3 + v;
+                p[0] = block_pos[0] + x;
+                p[1] = block_pos[1] + y;
+                p[2] = block_pos[2] + z;
+                if (!sdf || !compute_vertex_normal(sdf, p, &tri[i][v], vn))
+                    vec3_copy(n, vn);
                 memcpy(out[vi].color, tri[i][v].color, sizeof(out[vi].color));
                 out[vi].color[3] = 255;
                 out[vi].pos[0] = tri[i][v].pos[0] + x * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
                 out[vi].pos[1] = tri[i][v].pos[1] + y * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
                 out[vi].pos[2] = tri[i][v].pos[2] + z * MC_VOXEL_SUB_POS + MC_VOXEL_SUB_POS / 2 + 0.5;
-                out[vi].normal[0] = n[0] * 64;
-                out[vi].normal[1] = n[1] * 64;
-                out[vi].normal[2] = n[2] * 64;
+                out[vi].normal[0] = vn[0] * 64;
+                out[vi].normal[1] = vn[1] * 64;
+                out[vi].normal[2] = vn[2] * 64;
                 // XXX: this shouldn't matter.
                 memset(out[vi].occlusion_uv, 0, sizeof(out[vi].occlusion_uv));
                 memset(out[vi].bump_uv, 0, sizeof(out[vi].bump_uv));
@@ -359,6 +421,7 @@ int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
         }
     }
     free(data);
+    volume_sdf_release(own_sdf);
     return nb_tri_tot;
 }
 
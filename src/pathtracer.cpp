@@ -104,7 +104,8 @@ static int add_material(pathtracer_t *pt, const material_t *mat)
 }
 
 static shape_data create_shape_for_tile(
-        const volume_t *volume, const int tile_pos[3])
+        const volume_t *volume, const int tile_pos[3],
+        const volume_sdf_t *sdf, volume_faces_t *faces)
 {
     voxel_vertex_t* vertices;
     int i, nb, size, subdivide;
@@ -114,7 +115,7 @@ static shape_data create_shape_for_tile(
                 TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4,
                 sizeof(*vertices));
     nb = volume_generate_vertices(volume, tile_pos,
-                                goxel.rend.settings.effects,
+                                goxel.rend.settings.effects, sdf, faces,
                                 vertices, &size, &subdivide);
     if (!nb) goto end;
 
@@ -264,6 +265,8 @@ static void update_scene(pathtracer_t *pt)
 {
     volume_iterator_t iter;
     const volume_t *volume;
+    volume_sdf_t *sdf;
+    volume_faces_t *faces;
     int tile_pos[3];
     shape_data shape;
     pathtracer_internal_t *p = pt->p;
@@ -280,14 +283,21 @@ static void update_scene(pathtracer_t *pt)
     p->scene = {};
     p->lights = {};
 
+    faces = NULL;
+    if (goxel.rend.settings.effects & EFFECT_MERGE_FACES)
+        faces = volume_faces_new();
     layers = goxel_get_render_layers(false);
     DL_FOREACH(layers, layer) {
         if (!layer->visible || !layer->volume) continue;
         volume = layer->volume;
+        sdf = NULL;
+        if ((goxel.rend.settings.effects & EFFECT_MARCHING_CUBES) &&
+                (goxel.rend.settings.effects & EFFECT_MC_SMOOTH))
+            sdf = volume_compute_mc_sdf(volume);
         iter = volume_get_iterator(volume,
                         VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
         while (volume_iter(&iter, tile_pos)) {
-            shape = create_shape_for_tile(volume, tile_pos);
+            shape = create_shape_for_tile(volume, tile_pos, sdf, faces);
             if (shape.positions.empty()) continue;
             p->scene.shapes.push_back(shape);
             p->scene.instances.push_back({
@@ -299,7 +309,9 @@ static void update_scene(pathtracer_t *pt)
                 .material = add_material(pt, layer->material),
             });
         }
+        volume_sdf_release(sdf);
     }
+    volume_faces_delete(faces);
 
     // Add the floor.
     if (pt->floor.type != PT_FLOOR_NONE) {
@@ -122,7 +122,7 @@ static const struct {
     [A_TANGENT_LOC] = {3, GL_BYTE, false, OFFSET(tangent)},
     [A_GRADIENT_LOC] = {3, GL_BYTE, false, OFFSET(gradient)},
     [A_COLOR_LOC] = {4, GL_UNSIGNED_BYTE, true, OFFSET(color)},
-    [A_POS_DATA_LOC] = {2, GL_UNSIGNED_BYTE, true, OFFSET(pos_data)},
+    [A_POS_DATA_LOC] = {4, GL_UNSIGNED_BYTE, true, OFFSET(pos_data)},
     [A_UV_LOC] = {2, GL_UNSIGNED_BYTE, true,  OFFSET(uv)},
     [A_BUMP_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(bump_uv)},
     [A_OCCLUSION_UV_LOC] = {2, GL_UNSIGNED_BYTE, false, OFFSET(occlusion_uv)},
@@ -334,7 +334,8 @@ void render_init()
     init_bump_texture();
 
     // XXX: pick the proper memory size according to what is available.
-    g_items_cache = cache_create("render_items", RENDER_CACHE_SIZE);
+    g_items_cache = cache_create("render_items", RENDER_CACHE_SIZE,
+                                 CACHE_GPU_MEM);
     g_cube_model = model3d_cube();
     g_line_model = model3d_line();
     g_wire_cube_model = model3d_wire_cube();
@@ -362,6 +363,8 @@ void render_deinit(void)
 
 // A global buffer large enough to contain all the vertices for any tile.
 static voxel_vertex_t* g_vertices_buffer = NULL;
+// Used to merge the faces of the tiles.
+static volume_faces_t *g_faces_buffer = NULL;
 
 // Used for the cache.
 static int item_delete(void *item_)
@@ -372,15 +375,21 @@ static int item_delete(void *item_)
     return 0;
 }
 
+/*
+ * The smooth marching cube distance field is only computed on the first
+ * cache miss of a render pass, and then shared by all the tiles of the
+ * pass.  It should be released by the caller.
+ */
 static render_item_t *get_item_for_tile(
         const volume_t *volume,
         volume_iterator_t *iter,
         const int tile_pos[3],
-        int effects, float smoothness)
+        int effects, float smoothness,
+        volume_sdf_t **sdf)
 {
     render_item_t *item;
-    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH;
-    uint64_t tile_data_id;
+    const int effects_mask = EFFECT_MARCHING_CUBES | EFFECT_MC_SMOOTH |
+                             EFFECT_MERGE_FACES;
     int p[3], i, x, y, z;
     tile_item_key_t key = {};
 
@@ -394,8 +403,7 @@ static render_item_t *get_item_for_tile(
         p[0] = tile_pos[0] + x * TILE_SIZE;
         p[1] = tile_pos[1] + y * TILE_SIZE;
         p[2] = tile_pos[2] + z * TILE_SIZE;
-        volume_get_tile_data(volume, NULL, p, &tile_data_id);
-        key.ids[i] = tile_data_id;
+        key.ids[i] = volume_get_tile_id(volume, p);
     }
 
     item = cache_get(g_items_cache, &key, sizeof(key));
@@ -409,13 +417,14 @@ static render_item_t *get_item_for_tile(
         g_vertices_buffer = calloc(
                 TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4,
                 sizeof(*g_vertices_buffer));
+    if ((effects & EFFECT_MERGE_FACES) && !g_faces_buffer)
+        g_faces_buffer = volume_faces_new();
+    if ((effects & EFFECT_MARCHING_CUBES) && (effects & EFFECT_MC_SMOOTH) &&
+            !*sdf)
+        *sdf = volume_compute_mc_sdf(volume);
     item->nb_elements = volume_generate_vertices(
-            volume, tile_pos, effects, g_vertices_buffer,
-            &item->size, &item->subdivide);
-    if (item->nb_elements > BATCH_QUAD_COUNT) {
-        LOG_W("Too many quads!");
-        item->nb_elements = BATCH_QUAD_COUNT;
-    }
+            volume, tile_pos, effects, *sdf, g_faces_buffer,
+            g_vertices_buffer, &item->size, &item->subdivide);
     if (item->nb_elements != 0) {
         GL(glBufferData(GL_ARRAY_BUFFER,
                 item->nb_elements * item->size * sizeof(*g_vertices_buffer),
@@ -428,29 +437,16 @@ static render_item_t *get_item_for_tile(
     return item;
 }
 
-static void render_tile_(renderer_t *rend, volume_t *volume,
-                          volume_iterator_t *iter,
-                          const int tile_pos[3],
-                          int tile_id,
-                          const material_t *material,
-                          int effects, gl_shader_t *shader,
-                          const float model[4][4])
+/*
+ * Render a part of a render item.  Since the quads index buffer only covers
+ * BATCH_QUAD_COUNT quads, bigger items are rendered in several batches.
+ */
+static void render_item_batch(renderer_t *rend, const render_item_t *item,
+                              int start, int nb, int effects,
+                              gl_shader_t *shader)
 {
-    render_item_t *item;
-    float tile_model[4][4];
     int attr;
-    float tile_id_f[2];
-
-    item = get_item_for_tile(volume, iter, tile_pos, effects,
-                              rend->settings.smoothness);
-    if (item->nb_elements == 0) return;
-    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
-    if (gl_has_uniform(shader, "u_tile_id")) {
-        tile_id_f[1] = ((tile_id >> 8) & 0xff) / 255.0;
-        tile_id_f[0] = ((tile_id >> 0) & 0xff) / 255.0;
-        gl_update_uniform(shader, "u_tile_id", tile_id_f);
-    }
-    gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
+    const size_t ofs = (size_t)start * item->size * sizeof(voxel_vertex_t);
 
     for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++) {
         GL(glVertexAttribPointer(attr,
@@ -458,27 +454,23 @@ static void render_tile_(renderer_t *rend, volume_t *volume,
                                  ATTRIBUTES[attr].type,
                                  ATTRIBUTES[attr].norm,
                                  sizeof(voxel_vertex_t),
-                                 (void*)(intptr_t)ATTRIBUTES[attr].offset));
+                                 (void*)(ofs + ATTRIBUTES[attr].offset)));
     }
 
-    mat4_copy(model, tile_model);
-    mat4_itranslate(tile_model, tile_pos[0], tile_pos[1], tile_pos[2]);
-    gl_update_uniform(shader, "u_model", tile_model);
     if (item->size == 4) {
         if (!(effects & (EFFECT_GRID | EFFECT_EDGES))) {
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
+            GL(glDrawElements(GL_TRIANGLES, nb * 6, GL_UNSIGNED_SHORT, 0));
         } else {
             gl_update_uniform(shader, "u_l_amb", 0.0);
             gl_update_uniform(shader, "u_z_ofs", -0.001);
-            GL(glDrawElements(GL_LINES, item->nb_elements * 8,
+            GL(glDrawElements(GL_LINES, nb * 8,
                               GL_UNSIGNED_SHORT,
                               (void*)(uintptr_t)(BATCH_QUAD_COUNT * 6 * 2)));
             gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
             gl_update_uniform(shader, "u_z_ofs", 0.0);
         }
     } else {
-        GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+        GL(glDrawArrays(GL_TRIANGLES, 0, nb * item->size));
     }
 
 #ifndef GLES2
@@ -486,16 +478,53 @@ static void render_tile_(renderer_t *rend, volume_t *volume,
         gl_update_uniform(shader, "u_l_amb", 0.0);
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_LINE));
         if (item->size == 4)
-            GL(glDrawElements(GL_TRIANGLES, item->nb_elements * 6,
-                              GL_UNSIGNED_SHORT, 0));
+            GL(glDrawElements(GL_TRIANGLES, nb * 6, GL_UNSIGNED_SHORT, 0));
         else
-            GL(glDrawArrays(GL_TRIANGLES, 0, item->nb_elements * item->size));
+            GL(glDrawArrays(GL_TRIANGLES, 0, nb * item->size));
         GL(glPolygonMode(GL_FRONT_AND_BACK, GL_FILL));
         gl_update_uniform(shader, "u_l_amb", rend->settings.ambient);
     }
 #endif
 }
 
+static void render_tile_(renderer_t *rend, volume_t *volume,
+                          volume_iterator_t *iter,
+                          const int tile_pos[3],
+                          int tile_id,
+                          const material_t *material,
+                          int effects, gl_shader_t *shader,
+                          const float model[4][4],
+                          volume_sdf_t **sdf)
+{
+    render_item_t *item;
+    float tile_model[4][4];
+    float tile_id_f[2];
+    int start;
+
+    item = get_item_for_tile(volume, iter, tile_pos, effects,
+                              rend->settings.smoothness, sdf);
+    if (item->nb_elements == 0) return;
+    GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
+    if (gl_has_uniform(shader, "u_tile_id")) {
+        // The upper bits are used by the pos data.
+        tile_id &= (1 << POS_DATA_ID_BITS) - 1;
+        tile_id_f[1] = ((tile_id >> 8) & 0xff) / 255.0;
+        tile_id_f[0] = ((tile_id >> 0) & 0xff) / 255.0;
+        gl_update_uniform(shader, "u_tile_id", tile_id_f);
+    }
+    gl_update_uniform(shader, "u_pos_scale", 1.f / item->subdivide);
+
+    mat4_copy(model, tile_model);
+    mat4_itranslate(tile_model, tile_pos[0], tile_pos[1], tile_pos[2]);
+    gl_update_uniform(shader, "u_model", tile_model);
+
+    for (start = 0; start < item->nb_elements; start += BATCH_QUAD_COUNT) {
+        render_item_batch(rend, item, start,
+                          min(item->nb_elements - start, BATCH_QUAD_COUNT),
+                          effects, shader);
+    }
+}
+
 static void get_light_dir(const renderer_t *rend, float out[3])
 {
     float light_dir[4];
@@ -581,12 +610,16 @@ static void render_volume_(renderer_t *rend, volume_t *volume,
     float light_dir[3], alpha;
     bool shadow = false;
     volume_iterator_t iter;
+    volume_sdf_t *sdf = NULL;
 
     mat4_set_identity(model);
     get_light_dir(rend, light_dir);
 
     if (effects & EFFECT_MARCHING_CUBES)
         effects &= ~EFFECT_BORDERS;
+    // The borders, grid and edges are drawn per voxel.
+    if (effects & (EFFECT_BORDERS | EFFECT_GRID | EFFECT_EDGES))
+        effects &= ~EFFECT_MERGE_FACES;
 
     if (effects & EFFECT_RENDER_POS)
         shader = shader_get("pos_data", NULL, ATTR_NAMES, shader_init);
@@ -678,8 +711,10 @@ static void render_volume_(renderer_t *rend, volume_t *volume,
             VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
     while (volume_iter(&iter, tile_pos)) {
         render_tile_(rend, volume, &iter, tile_pos,
-                      tile_id++, material, effects, shader, model);
+                      tile_id++, material, effects, shader, model, &sdf);
     }
+    volume_sdf_release(sdf);
+
     for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
         GL(glDisableVertexAttribArray(attr));
 
@@ -711,7 +746,7 @@ void render_volume(renderer_t *rend, const volume_t *volume,
         // With EFFECT_RENDER_POS we need to remove some effects.
         if (item->effects & EFFECT_RENDER_POS)
             item->effects &= ~(EFFECT_SEMI_TRANSPARENT | EFFECT_SEE_BACK |
-                               EFFECT_MARCHING_CUBES);
+                               EFFECT_MARCHING_CUBES | EFFECT_MERGE_FACES);
         DL_APPEND(rend->items, item);
     }
 
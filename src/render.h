@@ -45,6 +45,9 @@ enum {
     EFFECT_LINE_THICK       = 1 << 19,
 
     EFFECT_NO_DEPTH_TEST    = 1 << 20,
+
+    // Merge the adjacent voxel faces with the same color into bigger quads.
+    EFFECT_MERGE_FACES      = 1 << 21,
 };
 
 typedef struct {
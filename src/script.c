@@ -440,6 +440,56 @@ static JSValue js_volume_save(JSContext *ctx, JSValueConst this_val,
     return JS_UNDEFINED;
 }
 
+/*
+ * Morphology functions.  Called from js with the radius and optionally
+ * the name of the structuring element ('cube', 'sphere' or 'cross').
+ */
+static JSValue js_volume_morph(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv,
+                               void (*func)(volume_t *volume, int shape,
+                                            int radius))
+{
+    volume_t *volume;
+    int radius, shape = MORPH_CUBE;
+    const char *name;
+
+    volume = JS_GetOpaque2(ctx, this_val, volume_klass.id);
+    if (!volume) return JS_EXCEPTION;
+    if (argc < 1) return JS_ThrowTypeError(ctx, "Missing radius");
+    if (JS_ToInt32(ctx, &radius, argv[0])) return JS_EXCEPTION;
+    if (argc > 1) {
+        name = JS_ToCString(ctx, argv[1]);
+        if (!name) return JS_EXCEPTION;
+        if (strcmp(name, "sphere") == 0) shape = MORPH_SPHERE;
+        else if (strcmp(name, "cross") == 0) shape = MORPH_CROSS;
+        else if (strcmp(name, "cube") != 0) {
+            JS_FreeCString(ctx, name);
+            return JS_ThrowTypeError(ctx, "Unknown shape");
+        }
+        JS_FreeCString(ctx, name);
+    }
+    func(volume, shape, radius);
+    return JS_UNDEFINED;
+}
+
+static JSValue js_volume_dilate(JSContext *ctx, JSValueConst this_val,
+                                int argc, JSValueConst *argv)
+{
+    return js_volume_morph(ctx, this_val, argc, argv, volume_dilate);
+}
+
+static JSValue js_volume_erode(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    return js_volume_morph(ctx, this_val, argc, argv, volume_erode);
+}
+
+static JSValue js_volume_shell(JSContext *ctx, JSValueConst this_val,
+                               int argc, JSValueConst *argv)
+{
+    return js_volume_morph(ctx, this_val, argc, argv, volume_shell);
+}
+
 static klass_t volume_klass = {
     .def.class_name = "Volume",
     .def.finalizer = js_volume_finalizer,
@@ -449,6 +499,9 @@ static klass_t volume_klass = {
         {"iter", .fn=js_volume_iter},
         {"setAt", .fn=js_volume_setAt},
         {"save", .fn=js_volume_save},
+        {"dilate", .fn=js_volume_dilate},
+        {"erode", .fn=js_volume_erode},
+        {"shell", .fn=js_volume_shell},
         { .name = NULL }
     }
 };
@@ -20,6 +20,8 @@
 
 #include "utils/b64.h"
 
+#include <limits.h>
+
 #define TEST(cond) \
     do { \
         if (!(cond)) { \
@@ -129,9 +131,1415 @@ static void test_load_corrupt(void)
     sys_delete_file("/tmp/goxel_test.gox");
 }
 
+static cache_t *find_cache(const char *name)
+{
+    cache_t *cache;
+    cache_stats_t stats;
+    for (cache = cache_next(NULL); cache; cache = cache_next(cache)) {
+        cache_get_stats(cache, &stats);
+        if (strcmp(stats.name, name) == 0) return cache;
+    }
+    return NULL;
+}
+
+static void test_workers_func(void *user, int i)
+{
+    int *counts = user;
+    volatile int k;
+    // Make some indices much slower, so that the threads steal work.
+    if (i % 97 == 0) for (k = 0; k < 100000; k++);
+    __atomic_add_fetch(&counts[i], 1, __ATOMIC_RELAXED);
+}
+
+static void test_workers_nested_func(void *user, int i)
+{
+    int *counts = user;
+    workers_run(10, test_workers_func, counts + i * 10);
+}
+
+// Check that workers_run calls the function exactly once per index.
+static void test_workers(void)
+{
+    const int sizes[] = {0, 1, 3, 64, 1000, 100000};
+    int i, j, *counts;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        counts = calloc(max(sizes[i], 1), sizeof(*counts));
+        workers_run(sizes[i], test_workers_func, counts);
+        for (j = 0; j < sizes[i]; j++) TEST(counts[j] == 1);
+        free(counts);
+    }
+    // Nested calls run in the calling thread.
+    counts = calloc(100 * 10, sizeof(*counts));
+    workers_run(100, test_workers_nested_func, counts);
+    for (j = 0; j < 100 * 10; j++) TEST(counts[j] == 1);
+    free(counts);
+}
+
+// Check the pool allocations, and that pool_trim only releases the chunks
+// without any used item.
+static void test_pool(void)
+{
+    const int nb = 1000;
+    pool_t *pool = pool_create("test", 1000, 0);
+    pool_stats_t stats;
+    uint64_t mem;
+    uint8_t **items;
+    int i;
+
+    items = calloc(nb, sizeof(*items));
+    for (i = 0; i < nb; i++) {
+        items[i] = pool_alloc(pool);
+        memset(items[i], i % 256, 1000);
+    }
+    pool_get_stats(pool, &stats);
+    TEST(stats.nb_used == nb && stats.nb_free == 0);
+    mem = stats.mem;
+
+    // All the chunks still have some used items.
+    for (i = 1; i < nb; i += 2) pool_free(pool, items[i]);
+    pool_trim(pool);
+    pool_get_stats(pool, &stats);
+    TEST(stats.nb_used == nb / 2 && stats.nb_free == nb / 2);
+    TEST(stats.mem == mem);
+    for (i = 0; i < nb; i += 2)
+        TEST(items[i][0] == i % 256 && items[i][999] == i % 256);
+
+    for (i = 0; i < nb; i += 2) pool_free(pool, items[i]);
+    TEST(pool_trim(pool) >= mem);
+    pool_get_stats(pool, &stats);
+    TEST(stats.nb_used == 0 && stats.nb_free == 0 && stats.mem == 0);
+
+    // We can still use the pool.
+    for (i = 0; i < 10; i++) {
+        items[i] = pool_alloc(pool);
+        memset(items[i], i, 1000);
+    }
+    for (i = 0; i < 10; i++) TEST(items[i][999] == i);
+    for (i = 0; i < 10; i++) pool_free(pool, items[i]);
+    pool_trim(pool);
+    free(items);
+}
+
+static int g_test_cache_deleted = 0;
+
+static int test_cache_del(void *data)
+{
+    free(data);
+    g_test_cache_deleted++;
+    return 0;
+}
+
+static void test_cache_add(cache_t *cache, int key, uint64_t cost)
+{
+    int *data = malloc(sizeof(*data));
+    *data = key;
+    cache_add(cache, &key, sizeof(key), data, cost, test_cache_del);
+}
+
+static bool test_cache_has(cache_t *cache, int key)
+{
+    int *data = cache_get(cache, &key, sizeof(key));
+    return data && *data == key;
+}
+
+// Check the cache LRU eviction order and stats.
+static void test_cache(void)
+{
+    const uint64_t item_size = 100 + sizeof(int); // Cost plus key.
+    cache_t *cache = cache_create("test", 4 * item_size, 0);
+    cache_stats_t stats;
+    int i;
+
+    for (i = 0; i < 4; i++) test_cache_add(cache, i, 100);
+    // Use item 0, so that item 1 is now the oldest one.
+    TEST(test_cache_has(cache, 0));
+    test_cache_add(cache, 4, 100);
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 4 && stats.size == 4 * item_size);
+    TEST(stats.evictions == 1 && g_test_cache_deleted == 1);
+    TEST(!test_cache_has(cache, 1));
+    // LRU order is now: 0, 2, 3, 4 -> 2, 3, 4, 0.
+    TEST(test_cache_has(cache, 0));
+    cache_shrink(cache, 2 * item_size);
+    TEST(!test_cache_has(cache, 2));
+    TEST(!test_cache_has(cache, 3));
+    TEST(test_cache_has(cache, 4));
+    TEST(test_cache_has(cache, 0));
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 2 && stats.evictions == 3);
+    TEST(stats.hits == 4 && stats.misses == 3);
+
+    // An item bigger than the cache is released right away.
+    test_cache_add(cache, 5, 10 * item_size);
+    TEST(!test_cache_has(cache, 5));
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 0 && stats.size == 0);
+
+    test_cache_add(cache, 6, 100);
+    cache_delete(cache);
+    TEST(g_test_cache_deleted == 7);
+}
+
+// Check that we can still use a distance field too big for its cache.
+static void test_sdf_bigger_than_cache(void)
+{
+    volume_t *volume = volume_new();
+    volume_sdf_t *sdf;
+    cache_t *cache;
+    cache_stats_t stats;
+    uint64_t max_size;
+    int pos[3];
+    uint8_t c[4] = {255, 255, 255, 255};
+
+    for (pos[2] = -8; pos[2] < 8; pos[2]++)
+    for (pos[1] = -8; pos[1] < 8; pos[1]++)
+    for (pos[0] = -8; pos[0] < 8; pos[0]++) {
+        if (vec3_norm2(VEC(pos[0], pos[1], pos[2])) > 8 * 8) continue;
+        volume_set_at(volume, NULL, pos, c);
+    }
+    // First call, to make sure the cache exists.
+    volume_sdf_release(volume_compute_sdf(volume, 3));
+    cache = find_cache("volume_sdf");
+    TEST(cache);
+    cache_get_stats(cache, &stats);
+    max_size = stats.max_size;
+    cache_set_max_size(cache, 1024);
+
+    sdf = volume_compute_sdf(volume, 3);
+    cache_get_stats(cache, &stats);
+    TEST(stats.nb_items == 0);
+    TEST(volume_sdf_get(sdf, (int[]){0, 0, 0}) < 0);
+    TEST(volume_sdf_get(sdf, (int[]){10, 0, 0}) > 0);
+    TEST(volume_sdf_get(sdf, (int[]){100, 0, 0}) == 3);
+    volume_sdf_release(sdf);
+
+    cache_set_max_size(cache, max_size);
+    volume_delete(volume);
+}
+
+// Color we put in the test volumes at a given position.
+static void test_color(const int pos[3], uint8_t c[4])
+{
+    c[0] = pos[0] * 7;
+    c[1] = pos[1] * 13;
+    c[2] = pos[2] * 29;
+    c[3] = 255;
+}
+
+// Insert and remove tiles from the tiles map, and check that copies of a
+// volume don't see the changes of each other.
+static void test_tiles_map(void)
+{
+    const int N = TILE_SIZE;
+    const int nb = 2000;
+    volume_t *volume = volume_new(), *copy;
+    int i;
+    uint8_t c[4], v[4];
+    const uint8_t red[4] = {255, 0, 0, 255};
+    uint64_t key, id;
+
+#define TILE_POS(i) (int[]){((i) % 17 - 8) * N, ((i) / 17 % 13 - 6) * N, \
+                            ((i) / 221 - 4) * N}
+    for (i = 0; i < nb; i++) {
+        test_color(TILE_POS(i), c);
+        volume_set_at(volume, NULL, TILE_POS(i), c);
+    }
+    TEST(volume_get_tiles_count(volume) == nb);
+    for (i = 0; i < nb; i++) {
+        test_color(TILE_POS(i), c);
+        volume_get_at(volume, NULL, TILE_POS(i), v);
+        TEST(memcmp(c, v, 4) == 0);
+    }
+
+    // Remove every other tile.
+    for (i = 0; i < nb; i += 2) volume_clear_tile(volume, NULL, TILE_POS(i));
+    TEST(volume_get_tiles_count(volume) == nb / 2);
+    for (i = 0; i < nb; i++) {
+        TEST((volume_get_tile_id(volume, TILE_POS(i)) == 0) == (i % 2 == 0));
+        volume_get_at(volume, NULL, TILE_POS(i), v);
+        TEST(v[3] == (i % 2 ? 255 : 0));
+    }
+
+    // Modify a copy: the original volume keeps its content, and the tiles
+    // we didn't touch are still shared.
+    key = volume_get_key(volume);
+    copy = volume_copy(volume);
+    TEST(volume_get_key(copy) == key);
+    volume_set_at(copy, NULL, TILE_POS(1), red);
+    volume_clear_tile(copy, NULL, TILE_POS(3));
+    volume_set_at(copy, NULL, TILE_POS(4), red);
+    TEST(volume_get_key(copy) != key);
+    TEST(volume_get_key(volume) == key);
+    TEST(volume_get_tiles_count(volume) == nb / 2);
+    TEST(volume_get_tiles_count(copy) == nb / 2);
+    volume_get_at(volume, NULL, TILE_POS(1), v);
+    test_color(TILE_POS(1), c);
+    TEST(memcmp(c, v, 4) == 0);
+    volume_get_at(volume, NULL, TILE_POS(3), v);
+    TEST(v[3] == 255);
+    TEST(volume_get_tile_id(volume, TILE_POS(4)) == 0);
+    volume_get_at(copy, NULL, TILE_POS(1), v);
+    TEST(memcmp(red, v, 4) == 0);
+    id = volume_get_tile_id(volume, TILE_POS(5));
+    TEST(id && volume_get_tile_id(copy, TILE_POS(5)) == id);
+
+    // The copy stays valid after we delete the original.
+    volume_delete(volume);
+    for (i = 5; i < nb; i += 2) {
+        test_color(TILE_POS(i), c);
+        volume_get_at(copy, NULL, TILE_POS(i), v);
+        TEST(memcmp(c, v, 4) == 0);
+    }
+    volume_delete(copy);
+#undef TILE_POS
+}
+
+// Tiles far apart from each other, up to the limits of the int positions.
+static void test_tiles_far_apart(void)
+{
+    const int N = TILE_SIZE;
+    const int pos[][3] = {
+        {0, 0, 0},
+        {N * 0x200000, 0, 0},
+        {-N * 0x200000, 0, 0},
+        {0, N * 0x200000, N * 0x400000},
+        {1 << 30, -(1 << 30), 0},
+        {INT_MIN, INT_MIN, INT_MIN},
+        {INT_MAX & ~(N - 1), INT_MIN, INT_MAX & ~(N - 1)},
+    };
+    volume_t *volume = volume_new();
+    volume_iterator_t iter;
+    int i, p[3], nb = 0;
+    uint8_t v[4];
+
+    for (i = 0; i < ARRAY_SIZE(pos); i++)
+        volume_set_at(volume, NULL, pos[i], (uint8_t[]){i, 0, 0, 255});
+    TEST(volume_get_tiles_count(volume) == ARRAY_SIZE(pos));
+    for (i = 0; i < ARRAY_SIZE(pos); i++) {
+        volume_get_at(volume, NULL, pos[i], v);
+        TEST(v[0] == i && v[3] == 255);
+    }
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, p)) nb++;
+    TEST(nb == ARRAY_SIZE(pos));
+
+    for (i = 0; i < ARRAY_SIZE(pos); i += 2)
+        volume_clear_tile(volume, NULL, pos[i]);
+    for (i = 0; i < ARRAY_SIZE(pos); i++)
+        TEST((volume_get_tile_id(volume, pos[i]) == 0) == (i % 2 == 0));
+    volume_delete(volume);
+}
+
+/*
+ * Fill a tile with a given number of colors, compact it, and check that
+ * we get the expected representation without changing the voxels, also
+ * after we write into the tile again.
+ */
+static void test_compact_tile(int nb_colors, int bits)
+{
+    const int N = TILE_SIZE;
+    volume_t *volume = volume_new();
+    volume_accessor_t accessor = volume_get_accessor(volume);
+    volume_global_stats_t s0, s1;
+    int i, pos[3];
+    uint8_t (*ref)[4] = malloc(N * N * N * 4), v[4];
+    const uint8_t red[4] = {255, 0, 0, 255};
+    uint64_t key;
+    int64_t mem;
+
+    for (i = 0; i < N * N * N; i++) {
+        ref[i][0] = i % nb_colors;
+        ref[i][1] = i % nb_colors / 256;
+        ref[i][2] = 100;
+        ref[i][3] = 255;
+        volume_set_at(volume, &accessor,
+                      (int[]){i % N, i / N % N, i / (N * N)}, ref[i]);
+    }
+
+    key = volume_get_key(volume);
+    volume_get_global_stats(&s0);
+    volume_compact_tiles(volume, NULL);
+    volume_get_global_stats(&s1);
+    TEST(volume_get_key(volume) == key);
+    if (nb_colors == 1) {
+        TEST(s1.nb_uniform_tiles == s0.nb_uniform_tiles + 1);
+        TEST(s1.mem == s0.mem - N * N * N * 4);
+    } else if (bits) {
+        TEST(s1.nb_indexed_tiles == s0.nb_indexed_tiles + 1);
+        mem = nb_colors * 4 + N * N * N * bits / 8 - N * N * N * 4;
+        TEST((int64_t)(s1.mem - s0.mem) == mem);
+    } else {
+        // Too many colors: the tile stays dense.
+        TEST(s1.mem == s0.mem);
+    }
+
+    accessor = volume_get_accessor(volume);
+    for (i = 0; i < N * N * N; i++) {
+        volume_get_at(volume, &accessor,
+                      (int[]){i % N, i / N % N, i / (N * N)}, v);
+        TEST(memcmp(v, ref[i], 4) == 0);
+    }
+
+    // Writing expands the tile back.
+    pos[0] = pos[1] = pos[2] = N / 2;
+    volume_set_at(volume, NULL, pos, red);
+    memcpy(ref[pos[0] + pos[1] * N + pos[2] * N * N], red, 4);
+    accessor = volume_get_accessor(volume);
+    for (i = 0; i < N * N * N; i++) {
+        volume_get_at(volume, &accessor,
+                      (int[]){i % N, i / N % N, i / (N * N)}, v);
+        TEST(memcmp(v, ref[i], 4) == 0);
+    }
+
+    volume_delete(volume);
+    free(ref);
+}
+
+static void test_compact_tiles(void)
+{
+    test_compact_tile(1, 0);
+    test_compact_tile(2, 4);
+    test_compact_tile(16, 4);
+    test_compact_tile(17, 8);
+    test_compact_tile(256, 8);
+    test_compact_tile(257, 16);
+    test_compact_tile(1024, 16);
+    test_compact_tile(1025, 0);
+}
+
+// Check that two volumes have the same voxels inside a box.
+static bool volumes_equal_in_box(const volume_t *a, const volume_t *b,
+                                 const int aabb[2][3])
+{
+    int pos[3];
+    uint8_t va[4], vb[4];
+    for (pos[2] = aabb[0][2]; pos[2] < aabb[1][2]; pos[2]++)
+    for (pos[1] = aabb[0][1]; pos[1] < aabb[1][1]; pos[1]++)
+    for (pos[0] = aabb[0][0]; pos[0] < aabb[1][0]; pos[0]++) {
+        volume_get_at(a, NULL, pos, va);
+        volume_get_at(b, NULL, pos, vb);
+        if (memcmp(va, vb, 4) != 0) return false;
+    }
+    return true;
+}
+
+// Compare the region functions with volume_get_at and volume_set_at.
+static void test_regions(void)
+{
+    const int N = TILE_SIZE;
+    // Not aligned to the tiles, and crossing the origin.
+    const int aabb[2][3] = {{-5, -3, -N - 7}, {N + 9, 2 * N + 1, 11}};
+    const int big[2][3] = {{-N - 8, -N - 8, -2 * N - 8},
+                           {2 * N + 8, 3 * N + 8, N + 8}};
+    const int w = aabb[1][0] - aabb[0][0];
+    const int h = aabb[1][1] - aabb[0][1];
+    const int d = aabb[1][2] - aabb[0][2];
+    volume_t *volume = volume_new(), *ref = volume_new();
+    int x, y, z, pos[3];
+    uint8_t (*buf)[4] = calloc(w * h * d, 4), c[4], v[4];
+
+    // Some voxels around the region, half of them empty.
+    for (pos[2] = aabb[0][2] - 3; pos[2] < aabb[1][2] + 3; pos[2]++)
+    for (pos[1] = aabb[0][1] - 3; pos[1] < aabb[1][1] + 3; pos[1]++)
+    for (pos[0] = aabb[0][0] - 3; pos[0] < aabb[1][0] + 3; pos[0]++) {
+        test_color(pos, c);
+        if ((pos[0] + pos[1] + pos[2]) & 1) continue;
+        volume_set_at(volume, NULL, pos, c);
+        volume_set_at(ref, NULL, pos, c);
+    }
+
+    // Packed read.
+    volume_read_region(volume, aabb, (uint8_t*)buf, NULL);
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        pos[0] = aabb[0][0] + x;
+        pos[1] = aabb[0][1] + y;
+        pos[2] = aabb[0][2] + z;
+        volume_get_at(volume, NULL, pos, v);
+        TEST(memcmp(v, buf[x + y * w + z * w * h], 4) == 0);
+    }
+
+    // Read with the x and z axis flipped.
+    memset(buf, 0, w * h * d * 4);
+    volume_read_region(volume, aabb,
+                       (uint8_t*)buf[(w - 1) + (d - 1) * w * h],
+                       (int[]){-4, 4 * w, -4 * w * h});
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        pos[0] = aabb[0][0] + x;
+        pos[1] = aabb[0][1] + y;
+        pos[2] = aabb[0][2] + z;
+        volume_get_at(volume, NULL, pos, v);
+        TEST(memcmp(v, buf[(w - 1 - x) + y * w + (d - 1 - z) * w * h],
+                    4) == 0);
+    }
+
+    // Write with the y axis flipped, including fully transparent voxels.
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++) {
+        pos[0] = aabb[0][0] + x;
+        pos[1] = aabb[0][1] + y;
+        pos[2] = aabb[0][2] + z;
+        test_color((int[]){pos[2], pos[0], pos[1]}, c);
+        if (x % 5 == 0 || z > d / 2) c[3] = 0;
+        if (c[3] == 0) memset(c, 0, 4);
+        memcpy(buf[x + (h - 1 - y) * w + z * w * h], c, 4);
+        volume_set_at(ref, NULL, pos, c);
+    }
+    volume_write_region(volume, aabb, (uint8_t*)buf[(h - 1) * w],
+                        (int[]){4, -4 * w, 4 * w * h});
+    TEST(volumes_equal_in_box(volume, ref, big));
+
+    // Write with a zero x stride: each row repeats the same voxel.
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++) {
+        test_color((int[]){y, z, y + z}, c);
+        memcpy(buf[y + z * h], c, 4);
+        for (x = 0; x < w; x++) {
+            pos[0] = aabb[0][0] + x;
+            pos[1] = aabb[0][1] + y;
+            pos[2] = aabb[0][2] + z;
+            volume_set_at(ref, NULL, pos, c);
+        }
+    }
+    volume_write_region(volume, aabb, (uint8_t*)buf, (int[]){0, 4, 4 * h});
+    TEST(volumes_equal_in_box(volume, ref, big));
+
+    // And read it back the same way.
+    memset(buf, 0, w * h * d * 4);
+    volume_read_region(volume, aabb, (uint8_t*)buf, (int[]){0, 4, 4 * h});
+    for (z = 0; z < d; z++)
+    for (y = 0; y < h; y++) {
+        test_color((int[]){y, z, y + z}, c);
+        TEST(memcmp(c, buf[y + z * h], 4) == 0);
+    }
+
+    free(buf);
+    volume_delete(volume);
+    volume_delete(ref);
+}
+
+// Check volume_extrude against the voxels of the plane slice.
+static void test_extrude(void)
+{
+    const int N = TILE_SIZE;
+    const int box_aabb[2][3] = {{-5, -3, 0}, {21, 19, 7}};
+    volume_t *base = volume_new(), *volume;
+    float plane[4][4], box[4][4];
+    int i, pos[3], p[3];
+    bool in_box, touched;
+    uint8_t c[4], v[4];
+
+    for (pos[2] = -40; pos[2] < 48; pos[2]++)
+    for (pos[1] = -40; pos[1] < 48; pos[1]++)
+    for (pos[0] = -40; pos[0] < 48; pos[0]++) {
+        if ((pos[0] * 7 + pos[1] * 3 + pos[2] * 5) % 4) continue;
+        test_color(pos, c);
+        volume_set_at(base, NULL, pos, c);
+    }
+    // Extrude the z = 0 slice.
+    mat4_set_identity(plane);
+    mat4_itranslate(plane, 0, 0, 0.5);
+    mat4_set_identity(box);
+    mat4_itranslate(box, (box_aabb[0][0] + box_aabb[1][0]) / 2.0,
+                         (box_aabb[0][1] + box_aabb[1][1]) / 2.0,
+                         (box_aabb[0][2] + box_aabb[1][2]) / 2.0);
+    mat4_iscale(box, (box_aabb[1][0] - box_aabb[0][0]) / 2.0,
+                     (box_aabb[1][1] - box_aabb[0][1]) / 2.0,
+                     (box_aabb[1][2] - box_aabb[0][2]) / 2.0);
+    volume = volume_copy(base);
+    volume_extrude(volume, plane, box);
+
+    for (pos[2] = -40; pos[2] < 48; pos[2]++)
+    for (pos[1] = -40; pos[1] < 48; pos[1]++)
+    for (pos[0] = -40; pos[0] < 48; pos[0]++) {
+        in_box = touched = true;
+        for (i = 0; i < 3; i++) {
+            p[i] = pos[i];
+            in_box &= pos[i] >= box_aabb[0][i] && pos[i] < box_aabb[1][i];
+            touched &= (pos[i] & ~(N - 1)) + N > box_aabb[0][i] &&
+                       (pos[i] & ~(N - 1)) < box_aabb[1][i];
+        }
+        if (in_box) p[2] = 0;
+        memset(c, 0, 4);
+        if (in_box || !touched) volume_get_at(base, NULL, p, c);
+        volume_get_at(volume, NULL, pos, v);
+        TEST(memcmp(c, v, 4) == 0);
+    }
+    volume_delete(volume);
+    volume_delete(base);
+}
+
+static int test_select_cond(void *user, const volume_t *volume,
+                            const int base_pos[3], const int new_pos[3],
+                            volume_accessor_t *accessor)
+{
+    uint8_t a[4], b[4];
+    volume_get_at(volume, accessor, base_pos, a);
+    volume_get_at(volume, accessor, new_pos, b);
+    if (memcmp(a, b, 4) != 0) return 0;
+    return new_pos[2] == 2 ? 100 : 255;
+}
+
+// Check the flood fill of volume_select, across the tiles borders.
+static void test_select(void)
+{
+    volume_t *volume = volume_new(), *sel = volume_new();
+    volume_iterator_t iter;
+    int pos[3], nb = 0, expected;
+    bool in_slab, in_block;
+    uint8_t c[4];
+
+    // A slab split in two by a wall of another color at x = 0, and a
+    // disconnected block of the same color.
+    for (pos[2] = 0; pos[2] < 3; pos[2]++)
+    for (pos[1] = -20; pos[1] < 20; pos[1]++)
+    for (pos[0] = -20; pos[0] < 40; pos[0]++) {
+        in_slab = pos[0] < 20 && pos[1] < 10;
+        in_block = pos[0] >= 30 && pos[1] >= 10;
+        if (!in_slab && !in_block) continue;
+        c[0] = pos[0] == 0 ? 0 : 255;
+        c[1] = 0;
+        c[2] = pos[0] == 0 ? 255 : 0;
+        c[3] = 255;
+        volume_set_at(volume, NULL, pos, c);
+    }
+    volume_select(volume, (int[]){-5, 0, 1}, test_select_cond, NULL, sel);
+
+    for (pos[2] = -1; pos[2] < 4; pos[2]++)
+    for (pos[1] = -21; pos[1] < 21; pos[1]++)
+    for (pos[0] = -21; pos[0] < 41; pos[0]++) {
+        volume_get_at(sel, NULL, pos, c);
+        expected = 0;
+        if (pos[0] >= -20 && pos[0] < 0 && pos[1] >= -20 && pos[1] < 10 &&
+            pos[2] >= 0 && pos[2] < 3)
+            expected = pos[2] == 2 ? 100 : 255;
+        TEST(c[3] == expected);
+    }
+    iter = volume_get_iterator(sel,
+            VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) nb++;
+    TEST(nb == 20 * 30 * 3);
+
+    // Nothing to select from an empty voxel.
+    volume_select(volume, (int[]){25, 0, 0}, test_select_cond, NULL, sel);
+    TEST(volume_get_tiles_count(sel) == 0);
+
+    volume_delete(sel);
+    volume_delete(volume);
+}
+
+/*
+ * Check the tile classification of volume_op, by comparing with the per
+ * voxel evaluation we get with a copy of the shape (the classification
+ * only recognizes the default shapes).  Each shape needs its own copy,
+ * since the volume_op cache uses the shape pointer as key.
+ */
+static void test_op_classify(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_INTERSECT,
+                         MODE_MULT_ALPHA};
+    const shape_t *shapes[] = {&shape_sphere, &shape_cube, &shape_cylinder};
+    volume_t *base = volume_new(), *v1, *v2;
+    shape_t copies[ARRAY_SIZE(shapes)];
+    painter_t painter;
+    float box[4][4], clip[4][4];
+    int s, m, k, pos[3];
+    uint8_t c[4];
+
+    for (pos[2] = -32; pos[2] < 32; pos[2]++)
+    for (pos[1] = -32; pos[1] < 32; pos[1]++)
+    for (pos[0] = -32; pos[0] < 32; pos[0]++) {
+        if ((pos[0] ^ pos[1] ^ pos[2]) & 8) continue;
+        test_color(pos, c);
+        volume_set_at(base, NULL, pos, c);
+    }
+    mat4_set_identity(clip);
+    mat4_iscale(clip, 20, 30, 30);
+
+    for (s = 0; s < ARRAY_SIZE(shapes); s++)
+    for (m = 0; m < ARRAY_SIZE(modes); m++)
+    for (k = 0; k < 3; k++) {
+        copies[s] = *shapes[s];
+        painter = (painter_t) {
+            .mode = modes[m],
+            .shape = shapes[s],
+            .color = {200, 100, 50, 255},
+            .smoothness = k == 1 ? 1.5 : 0,
+            .box = k == 2 ? &clip : NULL,
+        };
+        mat4_set_identity(box);
+        mat4_itranslate(box, 8.3, 7.9, -8.2);
+        mat4_irotate(box, 0.3, 0, 0, 1);
+        mat4_iscale(box, 30, 28, 26);
+
+        v1 = volume_copy(base);
+        v2 = volume_copy(base);
+        volume_op(v1, &painter, box);
+        painter.shape = &copies[s];
+        volume_op(v2, &painter, box);
+        TEST(volume_crc32(v1) == volume_crc32(v2));
+        volume_delete(v1);
+        volume_delete(v2);
+    }
+    volume_delete(base);
+}
+
+// Apply volume_op with the symmetry done by applying the operation once
+// per mirror, the way volume_op used to do it.
+static void op_recursive_symmetry(volume_t *volume, const painter_t *painter,
+                                  const float box[4][4])
+{
+    const float *o = painter->symmetry_origin;
+    painter_t painter2 = *painter;
+    float box2[4][4];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (!(painter->symmetry & (1 << i))) continue;
+        painter2.symmetry &= ~(1 << i);
+        mat4_set_identity(box2);
+        mat4_itranslate(box2, +o[0], +o[1], +o[2]);
+        if (i == 0) mat4_iscale(box2, -1,  1,  1);
+        if (i == 1) mat4_iscale(box2,  1, -1,  1);
+        if (i == 2) mat4_iscale(box2,  1,  1, -1);
+        mat4_itranslate(box2, -o[0], -o[1], -o[2]);
+        mat4_imul(box2, box);
+        op_recursive_symmetry(volume, &painter2, box2);
+    }
+    painter2 = *painter;
+    painter2.symmetry = 0;
+    volume_op(volume, &painter2, box);
+}
+
+/*
+ * Compare the single pass symmetry of volume_op with the recursive one.
+ * With a smooth shape, the mirrored boxes of the recursion can give
+ * slightly different shape values because of float rounding, so we accept
+ * a difference of one on the smooth border of the shape.
+ */
+static void test_op_symmetry(void)
+{
+    const int modes[] = {MODE_OVER, MODE_SUB, MODE_SUB_CLAMP, MODE_PAINT,
+                         MODE_MAX, MODE_MULT_ALPHA};
+    const float origins[][3] = {{0, 0, 0}, {2.5, -3, 0.5}};
+    volume_t *base = volume_new(), *v1, *v2;
+    volume_accessor_t acc1, acc2;
+    painter_t painter;
+    float box[4][4];
+    int i, k, m, o, pos[3], diff, nb_diff = 0, nb_smooth_diff = 0;
+    uint8_t c[4], a[4], b[4];
+
+    for (pos[2] = -12; pos[2] < 12; pos[2]++)
+    for (pos[1] = -12; pos[1] < 12; pos[1]++)
+    for (pos[0] = -12; pos[0] < 12; pos[0]++) {
+        if ((pos[0] ^ pos[1] ^ pos[2]) & 4) continue;
+        test_color(pos, c);
+        c[3] = 128 + pos[0] * 5;
+        volume_set_at(base, NULL, pos, c);
+    }
+
+    for (k = 0; k < 8; k++)
+    for (m = 0; m < ARRAY_SIZE(modes); m++)
+    for (o = 0; o < ARRAY_SIZE(origins); o++) {
+        painter = (painter_t) {
+            .mode = modes[m],
+            .shape = &shape_sphere,
+            .color = {200, 100, 50, 220},
+            .smoothness = k % 2 ? 2 : 0,
+            .symmetry = 7,
+        };
+        memcpy(painter.symmetry_origin, origins[o], sizeof(origins[o]));
+        mat4_set_identity(box);
+        mat4_itranslate(box, 6.3 + k * 0.37, 4 - k * 0.21, -2.2 + k * 0.13);
+        mat4_irotate(box, 0.5 + k * 0.3, 1, 1, 0);
+        mat4_iscale(box, 7 + k * 0.1, 5, 4);
+
+        v1 = volume_copy(base);
+        v2 = volume_copy(base);
+        volume_op(v1, &painter, box);
+        op_recursive_symmetry(v2, &painter, box);
+        acc1 = volume_get_accessor(v1);
+        acc2 = volume_get_accessor(v2);
+        for (pos[2] = -24; pos[2] < 24; pos[2]++)
+        for (pos[1] = -24; pos[1] < 24; pos[1]++)
+        for (pos[0] = -24; pos[0] < 24; pos[0]++) {
+            volume_get_at(v1, &acc1, pos, a);
+            volume_get_at(v2, &acc2, pos, b);
+            diff = 0;
+            for (i = 0; i < 4; i++) diff = max(diff, abs(a[i] - b[i]));
+            TEST(diff <= (painter.smoothness ? 1 : 0));
+            nb_diff += diff != 0;
+            nb_smooth_diff += diff != 0 && painter.smoothness;
+        }
+        volume_delete(v1);
+        volume_delete(v2);
+    }
+    // Make sure the rounding differences stay rare.
+    TEST(nb_diff == nb_smooth_diff && nb_diff < 100);
+    volume_delete(base);
+}
+
+/*
+ * Check that volume_merge, that blends the tiles several voxels at a time,
+ * gives the same voxels as the per voxel combine of volume_op with a copy
+ * of the cube shape filling the tiles with a single color.
+ */
+static void test_merge_combine(void)
+{
+    const int N = TILE_SIZE;
+    const int modes[] = {MODE_OVER, MODE_PAINT, MODE_SUB, MODE_MAX,
+                         MODE_SUB_CLAMP, MODE_MULT_ALPHA, MODE_INTERSECT,
+                         MODE_INTERSECT_FILL};
+    const uint8_t alphas[] = {0, 1, 100, 254, 255};
+    const uint8_t colors[][4] = {
+        {200, 100, 50, 255}, {200, 100, 50, 128}, {10, 20, 30, 1}};
+    volume_t *base = volume_new(), *other, *white_other, *v1, *v2, *v3;
+    shape_t cube = shape_cube;
+    painter_t painter;
+    float box[4][4];
+    int m, k, pos[3];
+    uint8_t c[4], c1[4], c2[4], c3[4];
+
+    // Two tiles with all sort of alpha values.
+    for (pos[2] = 0; pos[2] < N; pos[2]++)
+    for (pos[1] = 0; pos[1] < N; pos[1]++)
+    for (pos[0] = 0; pos[0] < 2 * N; pos[0]++) {
+        test_color(pos, c);
+        c[3] = alphas[(pos[0] + pos[1] + pos[2]) % ARRAY_SIZE(alphas)];
+        if (c[3]) volume_set_at(base, NULL, pos, c);
+    }
+    mat4_set_identity(box);
+    mat4_itranslate(box, N, N / 2, N / 2);
+    mat4_iscale(box, N, N / 2, N / 2);
+    white_other = volume_new();
+    volume_op(white_other, &(painter_t){.mode = MODE_OVER, .shape = &cube,
+              .color = {255, 255, 255, 255}}, box);
+
+    for (k = 0; k < ARRAY_SIZE(colors); k++) {
+        other = volume_new();
+        volume_op(other, &(painter_t){.mode = MODE_OVER, .shape = &cube,
+                  .color = {colors[k][0], colors[k][1], colors[k][2],
+                            colors[k][3]}}, box);
+        for (m = 0; m < ARRAY_SIZE(modes); m++) {
+            painter = (painter_t) {
+                .mode = modes[m],
+                .shape = &cube,
+                .color = {colors[k][0], colors[k][1], colors[k][2],
+                          colors[k][3]},
+            };
+            v1 = volume_copy(base);
+            volume_op(v1, &painter, box);
+            v2 = volume_copy(base);
+            volume_merge(v2, other, modes[m], NULL);
+            v3 = volume_copy(base);
+            volume_merge(v3, white_other, modes[m], colors[k]);
+            for (pos[2] = 0; pos[2] < N; pos[2]++)
+            for (pos[1] = 0; pos[1] < N; pos[1]++)
+            for (pos[0] = 0; pos[0] < 2 * N; pos[0]++) {
+                volume_get_at(v1, NULL, pos, c1);
+                volume_get_at(v2, NULL, pos, c2);
+                volume_get_at(v3, NULL, pos, c3);
+                TEST(c1[3] == c2[3] && c1[3] == c3[3]);
+                if (!c1[3]) continue;
+                TEST(memcmp(c1, c2, 3) == 0 && memcmp(c1, c3, 3) == 0);
+            }
+            volume_delete(v1);
+            volume_delete(v2);
+            volume_delete(v3);
+        }
+        volume_delete(other);
+    }
+    volume_delete(white_other);
+    volume_delete(base);
+}
+
+// Check volume_move with the transformations that map voxels to voxels.
+static void test_move(void)
+{
+    const int N = TILE_SIZE;
+    volume_t *base = volume_new(), *volume, *ref;
+    volume_iterator_t iter;
+    float mat[4][4], p[3];
+    int k, pos[3], q[3];
+    uint8_t c[4];
+
+    for (pos[2] = -12; pos[2] < 20; pos[2]++)
+    for (pos[1] = -12; pos[1] < 12; pos[1]++)
+    for (pos[0] = -12; pos[0] < 12; pos[0]++) {
+        if ((pos[0] ^ pos[1] ^ pos[2]) & 4 && pos[2] < 16) continue;
+        test_color(pos, c);
+        volume_set_at(base, NULL, pos, c);
+    }
+
+    for (k = 0; k < 6; k++) {
+        mat4_set_identity(mat);
+        switch (k) {
+        case 0: // Tile aligned translation.
+            mat4_itranslate(mat, N, -2 * N, 3 * N);
+            break;
+        case 1:
+            mat4_itranslate(mat, 5, -3, 17);
+            break;
+        case 2:
+            mat4_itranslate(mat, 1, 2, 3);
+            mat4_irotate(mat, M_PI / 2, 0, 0, 1);
+            break;
+        case 3:
+            mat4_irotate(mat, M_PI, 1, 0, 0);
+            break;
+        case 4:
+            mat4_itranslate(mat, -7, 0, N);
+            mat4_iscale(mat, 1, -1, 1);
+            break;
+        case 5:
+            mat4_irotate(mat, M_PI / 2, 0, 1, 0);
+            mat4_irotate(mat, -M_PI / 2, 1, 0, 0);
+            break;
+        }
+
+        // Reference: move each voxel one by one.
+        ref = volume_new();
+        iter = volume_get_iterator(base,
+                VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+        while (volume_iter(&iter, pos)) {
+            volume_get_at(base, &iter, pos, c);
+            vec3_set(p, pos[0], pos[1], pos[2]);
+            mat4_mul_vec3(mat, p, p);
+            q[0] = round(p[0]);
+            q[1] = round(p[1]);
+            q[2] = round(p[2]);
+            volume_set_at(ref, NULL, q, c);
+        }
+
+        volume = volume_copy(base);
+        volume_move(volume, mat);
+        TEST(volume_crc32(volume) == volume_crc32(ref));
+        TEST(volume_get_tiles_count(volume) == volume_get_tiles_count(ref));
+        volume_delete(volume);
+        volume_delete(ref);
+    }
+    volume_delete(base);
+}
+
+// Naive version of the morphology structuring elements.
+static bool morph_element_contains(int shape, int r, int x, int y, int z)
+{
+    switch (shape) {
+    case MORPH_CROSS:
+        return abs(x) + abs(y) + abs(z) <= r;
+    case MORPH_SPHERE:
+        return x * x + y * y + z * z <= r * r;
+    case MORPH_CUBE:
+    default:
+        return max(abs(x), max(abs(y), abs(z))) <= r;
+    }
+}
+
+static int offset_dist2(const int o[3])
+{
+    return o[0] * o[0] + o[1] * o[1] + o[2] * o[2];
+}
+
+/*
+ * Compare the morphology functions with a naive reference, that checks all
+ * the voxels of the element around each voxel.  The added voxels of a
+ * dilation can take the color of any of the closest voxels.
+ */
+static void test_morph(void)
+{
+    // Scene inside [-10, 10], the results stay inside [-L, L).
+    enum { L = 16, S = 2 * L };
+    const int radii[] = {1, 2, 4};
+    volume_t *base = volume_new(), *volume;
+    volume_accessor_t acc;
+    uint8_t (*src)[4] = calloc(S * S * S, 4);
+    uint8_t c[4];
+    const uint8_t *n;
+    int op, shape, k, r, i, j, x, y, z, pos[3], p[3], nb, best;
+    int (*offsets)[3] = malloc(9 * 9 * 9 * sizeof(*offsets));
+    bool set, found;
+
+    for (pos[2] = -L; pos[2] < L; pos[2]++)
+    for (pos[1] = -L; pos[1] < L; pos[1]++)
+    for (pos[0] = -L; pos[0] < L; pos[0]++) {
+        if (max(abs(pos[0]), max(abs(pos[1]), abs(pos[2]))) > 10) continue;
+        // A sphere across the tiles borders, plus some isolated voxels.
+        if ((pos[0] - 1) * (pos[0] - 1) + (pos[1] + 2) * (pos[1] + 2) +
+                pos[2] * pos[2] > 64 &&
+            ((uint32_t)pos[0] * 73856093 ^ (uint32_t)pos[1] * 19349663 ^
+             (uint32_t)pos[2] * 83492791) % 7) continue;
+        test_color(pos, c);
+        volume_set_at(base, NULL, pos, c);
+        memcpy(src[((pos[2] + L) * S + pos[1] + L) * S + pos[0] + L], c, 4);
+    }
+
+    for (op = 0; op < 3; op++)
+    for (shape = MORPH_CUBE; shape <= MORPH_CROSS; shape++)
+    for (k = 0; k < ARRAY_SIZE(radii); k++) {
+        r = radii[k];
+        nb = 0;
+        for (z = -r; z <= r; z++)
+        for (y = -r; y <= r; y++)
+        for (x = -r; x <= r; x++) {
+            if (!morph_element_contains(shape, r, x, y, z)) continue;
+            offsets[nb][0] = x;
+            offsets[nb][1] = y;
+            offsets[nb][2] = z;
+            nb++;
+        }
+        volume = volume_copy(base);
+        if (op == 0) volume_dilate(volume, shape, r);
+        if (op == 1) volume_erode(volume, shape, r);
+        if (op == 2) volume_shell(volume, shape, r);
+        acc = volume_get_accessor(volume);
+
+        for (pos[2] = -L; pos[2] < L; pos[2]++)
+        for (pos[1] = -L; pos[1] < L; pos[1]++)
+        for (pos[0] = -L; pos[0] < L; pos[0]++) {
+            volume_get_at(volume, &acc, pos, c);
+            n = src[((pos[2] + L) * S + pos[1] + L) * S + pos[0] + L];
+            // Dilation: set if any voxel of the element is set.  Erosion:
+            // set if all the voxels of the element are set.
+            set = op != 0;
+            best = 3 * S * S;
+            for (i = 0; i < nb; i++) {
+                for (j = 0; j < 3; j++) p[j] = pos[j] + offsets[i][j];
+                found = max(abs(p[0]), max(abs(p[1]), abs(p[2]))) <= 10 &&
+                        src[((p[2] + L) * S + p[1] + L) * S + p[0] + L][3];
+                if (op == 0 && found) {
+                    set = true;
+                    best = min(best, offset_dist2(offsets[i]));
+                }
+                if (op != 0 && !found) set = false;
+            }
+            if (op == 2) set = n[3] && !set;
+            TEST((bool)c[3] == set);
+            if (!set) continue;
+            if (n[3]) {
+                TEST(memcmp(c, n, 4) == 0);
+                continue;
+            }
+            // New voxel of a dilation: use one of the closest colors.
+            found = false;
+            for (i = 0; i < nb; i++) {
+                if (offset_dist2(offsets[i]) != best) continue;
+                for (j = 0; j < 3; j++) p[j] = pos[j] + offsets[i][j];
+                if (memcmp(c, src[((p[2] + L) * S + p[1] + L) * S + p[0] + L],
+                           4) == 0) found = true;
+            }
+            TEST(found);
+        }
+        volume_delete(volume);
+    }
+    volume_delete(base);
+    free(src);
+    free(offsets);
+}
+
+/*
+ * Mark (or unmark) the unit faces covered by a quad.  Return false if a
+ * face is unmarked twice or with a different color.
+ */
+static bool mark_quad_faces(const voxel_vertex_t v[4], uint8_t (*marks)[4],
+                            bool unmark)
+{
+    const int N = TILE_SIZE;
+    int i, n, u, w, a, b, f, p[3], aabb[2][3];
+    uint8_t *m;
+
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] = min(min(v[0].pos[i], v[1].pos[i]),
+                         min(v[2].pos[i], v[3].pos[i]));
+        aabb[1][i] = max(max(v[0].pos[i], v[1].pos[i]),
+                         max(v[2].pos[i], v[3].pos[i]));
+    }
+    n = v[0].normal[0] ? 0 : v[0].normal[1] ? 1 : 2;
+    u = (n + 1) % 3;
+    w = (n + 2) % 3;
+    f = n * 2 + (v[0].normal[n] > 0);
+    // The faces along the positive normals are on the far side of the voxel.
+    p[n] = aabb[0][n] - (v[0].normal[n] > 0);
+    for (b = aabb[0][w]; b < aabb[1][w]; b++)
+    for (a = aabb[0][u]; a < aabb[1][u]; a++) {
+        p[u] = a;
+        p[w] = b;
+        m = marks[((f * N + p[2]) * N + p[1]) * N + p[0]];
+        if (!unmark) {
+            memcpy(m, v[0].color, 4);
+            continue;
+        }
+        if (!m[3] || memcmp(m, v[0].color, 4) != 0) return false;
+        memset(m, 0, 4);
+    }
+    return true;
+}
+
+// Check that the cube mesher generates exactly the faces between a solid
+// voxel and a non solid one, by looking at the neighbors of each voxel.
+static void test_cube_faces(void)
+{
+    const int N = TILE_SIZE;
+    const int dirs[6][3] = {
+        {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+    volume_t *volume = volume_new();
+    volume_iterator_t iter;
+    voxel_vertex_t *verts;
+    uint8_t (*marks)[4], *m, c[4], nc[4];
+    int i, f, nb, nb_faces, pos[3], p[3], q[3], size, subdivide, h;
+
+    // Random voxels, some of them not solid (alpha < 127).
+    for (pos[2] = -20; pos[2] < 20; pos[2]++)
+    for (pos[1] = -20; pos[1] < 20; pos[1]++)
+    for (pos[0] = -20; pos[0] < 20; pos[0]++) {
+        h = (pos[0] * 73856093 ^ pos[1] * 19349663 ^ pos[2] * 83492791) & 7;
+        if (h < 4) continue;
+        test_color(pos, c);
+        c[3] = h == 4 ? 100 : 255;
+        volume_set_at(volume, NULL, pos, c);
+    }
+
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    marks = calloc(6 * N * N * N, 4);
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        nb = volume_generate_vertices(volume, pos, 0, NULL, NULL, verts,
+                                      &size, &subdivide);
+        for (i = 0; i < nb; i++) mark_quad_faces(verts + i * 4, marks, false);
+        nb_faces = 0;
+        for (p[2] = 0; p[2] < N; p[2]++)
+        for (p[1] = 0; p[1] < N; p[1]++)
+        for (p[0] = 0; p[0] < N; p[0]++) {
+            for (i = 0; i < 3; i++) q[i] = pos[i] + p[i];
+            volume_get_at(volume, NULL, q, c);
+            for (f = 0; f < 6; f++) {
+                // Same face index as in mark_quad_faces.
+                for (i = 0; i < 3; i++) q[i] = pos[i] + p[i] + dirs[f][i];
+                volume_get_at(volume, NULL, q, nc);
+                m = marks[((f * N + p[2]) * N + p[1]) * N + p[0]];
+                if (c[3] < 127 || nc[3] >= 127) {
+                    TEST(m[3] == 0);
+                    continue;
+                }
+                nb_faces++;
+                TEST(memcmp(m, c, 3) == 0 && m[3] == 255);
+                memset(m, 0, 4);
+            }
+        }
+        TEST(nb == nb_faces);
+    }
+
+    free(marks);
+    free(verts);
+    volume_delete(volume);
+}
+
+// Check that the greedy mesher covers exactly the same faces, with the same
+// colors, as the per voxel mesher.
+static void test_merge_faces(void)
+{
+    const int N = TILE_SIZE;
+    volume_t *volume = volume_new();
+    volume_iterator_t iter;
+    volume_faces_t *faces = volume_faces_new();
+    voxel_vertex_t *verts;
+    uint8_t (*marks)[4], c[4];
+    int i, nb, pos[3], size, subdivide, nb_quads = 0, nb_merged = 0;
+
+    // Flat areas of a few colors, with some holes and bumps on top.
+    for (pos[2] = -4; pos[2] < 6; pos[2]++)
+    for (pos[1] = -20; pos[1] < 20; pos[1]++)
+    for (pos[0] = -20; pos[0] < 20; pos[0]++) {
+        if (pos[2] == 5 && (pos[0] * pos[1]) % 7) continue;
+        if (pos[2] == 0 && pos[0] % 9 == 3) continue;
+        c[0] = (pos[0] + 20) / 6 * 30;
+        c[1] = (pos[1] + 20) / 9 * 50;
+        c[2] = pos[2] == 5 ? 255 : 0;
+        c[3] = 255;
+        volume_set_at(volume, NULL, pos, c);
+    }
+
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    marks = calloc(6 * N * N * N, 4);
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        nb = volume_generate_vertices(volume, pos, 0, NULL, NULL, verts,
+                                      &size, &subdivide);
+        nb_quads += nb;
+        for (i = 0; i < nb; i++) mark_quad_faces(verts + i * 4, marks, false);
+        nb = volume_generate_vertices(volume, pos, EFFECT_MERGE_FACES, NULL,
+                                      faces, verts, &size, &subdivide);
+        nb_merged += nb;
+        for (i = 0; i < nb; i++)
+            TEST(mark_quad_faces(verts + i * 4, marks, true));
+        for (i = 0; i < 6 * N * N * N; i++) TEST(marks[i][3] == 0);
+    }
+    TEST(nb_merged < nb_quads);
+
+    free(marks);
+    free(verts);
+    volume_faces_delete(faces);
+    volume_delete(volume);
+}
+
+typedef typeof(*((volume_mesh_t*)0)->vertices) test_mesh_vertex_t;
+
+static int test_triangle_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, 3 * sizeof(test_mesh_vertex_t));
+}
+
+/*
+ * Return the triangles of a mesh, each starting with its smallest vertex
+ * so that the winding is kept, and sorted.
+ */
+static test_mesh_vertex_t (*test_mesh_get_triangles(
+        const volume_mesh_t *mesh))[3]
+{
+    test_mesh_vertex_t (*ret)[3];
+    int i, j, first;
+
+    ret = calloc(mesh->indices_count / 3, sizeof(*ret));
+    for (i = 0; i < mesh->indices_count / 3; i++) {
+        first = 0;
+        for (j = 1; j < 3; j++) {
+            if (memcmp(&mesh->vertices[mesh->indices[i * 3 + j]],
+                       &mesh->vertices[mesh->indices[i * 3 + first]],
+                       sizeof(test_mesh_vertex_t)) < 0)
+                first = j;
+        }
+        for (j = 0; j < 3; j++) {
+            ret[i][j] = mesh->vertices[
+                mesh->indices[i * 3 + (first + j) % 3]];
+        }
+    }
+    qsort(ret, mesh->indices_count / 3, sizeof(*ret), test_triangle_cmp);
+    return ret;
+}
+
+// Check that the chunks of volume_generate_mesh don't change the triangles.
+static void test_mesh_chunks(void)
+{
+    const int N = TILE_SIZE;
+    volume_t *volume = volume_new();
+    volume_mesh_t *mesh, *chunked;
+    test_mesh_vertex_t (*t1)[3], (*t2)[3];
+    int pos[3], h;
+    uint8_t c[4];
+
+    // Layers of a few colors, with some holes.
+    for (pos[2] = -20; pos[2] < 40; pos[2]++)
+    for (pos[1] = -20; pos[1] < 40; pos[1]++)
+    for (pos[0] = -20; pos[0] < 40; pos[0]++) {
+        h = (pos[0] * 73856093 ^ pos[1] * 19349663 ^ pos[2] * 83492791) & 7;
+        if (h == 0) continue;
+        c[0] = (pos[2] + 20) / 8 * 40;
+        c[1] = 100;
+        c[2] = 128;
+        c[3] = 255;
+        volume_set_at(volume, NULL, pos, c);
+    }
+    mesh = volume_generate_mesh(volume, 0, NULL, 0, 0);
+    chunked = volume_generate_mesh(volume, 0, NULL, 0, N);
+    TEST(mesh->indices_count > 0);
+    TEST(mesh->indices_count == chunked->indices_count);
+    // The vertices are not merged across the chunks borders.
+    TEST(chunked->vertices_count > mesh->vertices_count);
+    TEST(vec3_equal(mesh->pos_min, chunked->pos_min));
+    TEST(vec3_equal(mesh->pos_max, chunked->pos_max));
+    t1 = test_mesh_get_triangles(mesh);
+    t2 = test_mesh_get_triangles(chunked);
+    TEST(memcmp(t1, t2, mesh->indices_count / 3 * sizeof(*t1)) == 0);
+
+    free(t1);
+    free(t2);
+    volume_mesh_free(mesh);
+    volume_mesh_free(chunked);
+    volume_delete(volume);
+}
+
+// Fill nb tiles along x with a color per voxel, so that they are dense.
+static void test_fill_tiles(volume_t *volume, int nb, int seed)
+{
+    const int N = TILE_SIZE;
+    volume_accessor_t accessor = volume_get_accessor(volume);
+    int pos[3];
+    uint8_t c[4];
+
+    for (pos[2] = 0; pos[2] < N; pos[2]++)
+    for (pos[1] = 0; pos[1] < N; pos[1]++)
+    for (pos[0] = 0; pos[0] < nb * N; pos[0]++) {
+        test_color(pos, c);
+        c[0] += seed;
+        volume_set_at(volume, &accessor, pos, c);
+    }
+}
+
+static int test_history_count(const image_t *img)
+{
+    const image_t *snap;
+    int ret = 0;
+    for (snap = img->history; snap; snap = snap->history_next) ret++;
+    return ret;
+}
+
+// Check that the memory budget removes the undo steps that free memory,
+// but not the ones that only share their data with the image.
+static void test_memory_budget(void)
+{
+    const int N = TILE_SIZE;
+    const int nb = 2 * MB / (N * N * N * 4); // 2M of tiles.
+    image_t *img = goxel.image;
+    int i, budget = goxel.memory_budget;
+    volume_t *volume;
+
+    goxel.image = image_new();
+    volume = goxel.image->active_layer->volume;
+    // Three states with different tiles: 6M.
+    for (i = 0; i < 3; i++) {
+        test_fill_tiles(volume, nb, i);
+        image_history_push(goxel.image);
+    }
+    // Removes the initial empty snapshot, and the first state.
+    goxel.memory_budget = 5;
+    goxel_check_memory_budget();
+    TEST(test_history_count(goxel.image) == 2);
+
+    // A few small changes: the older snapshots share all the big tiles.
+    for (i = 0; i < 3; i++) {
+        volume_set_at(volume, NULL, (int[]){-N * (i + 1), 0, 0},
+                      (uint8_t[]){255, 0, 0, 255});
+        image_history_push(goxel.image);
+    }
+    TEST(test_history_count(goxel.image) == 5);
+    // The image alone is bigger than the budget: removing the snapshot with
+    // the tiles of the second state helps, but not the next one.
+    goxel.memory_budget = 1;
+    goxel_check_memory_budget();
+    TEST(test_history_count(goxel.image) == 4);
+
+    image_delete(goxel.image);
+    goxel.image = img;
+    // Reset the governor state.
+    goxel.memory_budget = 1024 * 1024;
+    goxel_check_memory_budget();
+    goxel.memory_budget = budget;
+}
+
 void tests_run(void)
 {
     test_load_file_v2();
     test_load_file_v1_with_preview();
     test_load_corrupt();
+    test_workers();
+    test_pool();
+    test_cache();
+    test_sdf_bigger_than_cache();
+    test_tiles_map();
+    test_tiles_far_apart();
+    test_compact_tiles();
+    test_regions();
+    test_select();
+    test_extrude();
+    test_op_classify();
+    test_op_symmetry();
+    test_merge_combine();
+    test_move();
+    test_morph();
+    test_cube_faces();
+    test_merge_faces();
+    test_mesh_chunks();
+    test_memory_budget();
+}
+
+/*
+ * Benchmarks.
+ *
+ * The scene doesn't depend on the tile size, so that we can compare the
+ * results of builds with different TILE_SIZE values.
+ */
+
+// A 512x512 terrain with some hills.
+static volume_t *bench_create_scene(void)
+{
+    volume_t *volume = volume_new();
+    volume_accessor_t accessor = volume_get_accessor(volume);
+    int pos[3], h;
+    uint8_t c[4] = {0, 0, 0, 255};
+
+    for (pos[1] = -256; pos[1] < 256; pos[1]++)
+    for (pos[0] = -256; pos[0] < 256; pos[0]++) {
+        h = 32 + 16 * sin(pos[0] / 23.) * cos(pos[1] / 31.) +
+            8 * sin((pos[0] + pos[1]) / 11.);
+        for (pos[2] = 0; pos[2] < h; pos[2]++) {
+            c[0] = pos[2] * 4;
+            c[1] = 128 + h;
+            c[2] = pos[2] < h - 2 ? 64 : 200;
+            volume_set_at(volume, &accessor, pos, c);
+        }
+    }
+    return volume;
+}
+
+#define BENCH(name, code) do { \
+        double t_ = sys_get_time(); \
+        code; \
+        printf("%-16s %10.2f ms\n", name, (sys_get_time() - t_) * 1000); \
+    } while (0)
+
+void bench_run(void)
+{
+    volume_t *volume, *copy;
+    volume_iterator_t iter;
+    volume_global_stats_t stats;
+    voxel_vertex_t *vertices;
+    int i, pos[3], bbox[2][3], size, subdivide, nb_quads = 0;
+    uint8_t v[4];
+    uint64_t sum = 0;
+
+    printf("Tile size: %d\n", TILE_SIZE);
+    BENCH("create", volume = bench_create_scene());
+
+    BENCH("iter", {
+        iter = volume_get_iterator(volume,
+                VOLUME_ITER_VOXELS | VOLUME_ITER_SKIP_EMPTY);
+        while (volume_iter(&iter, pos)) {
+            volume_get_at(volume, &iter, pos, v);
+            sum += v[0];
+        }
+    });
+
+    BENCH("bbox", volume_get_bbox(volume, bbox, true));
+
+    BENCH("copy and write", {
+        for (i = 0; i < 100; i++) {
+            copy = volume_copy(volume);
+            volume_set_at(copy, NULL, (int[]){i, 0, 0}, v);
+            volume_delete(copy);
+        }
+    });
+
+    vertices = calloc(TILE_SIZE * TILE_SIZE * TILE_SIZE * 6 * 4,
+                      sizeof(*vertices));
+    BENCH("mesh", {
+        iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+        while (volume_iter(&iter, pos)) {
+            nb_quads += volume_generate_vertices(volume, pos, 0, NULL, NULL,
+                                                 vertices, &size, &subdivide);
+        }
+    });
+    free(vertices);
+
+    BENCH("compact", volume_compact_tiles(volume, NULL));
+
+    volume_get_global_stats(&stats);
+    printf("Tiles: %d, quads: %d, mem: %.1f MiB (checksum %u)\n",
+           volume_get_tiles_count(volume), nb_quads,
+           stats.mem / (1024. * 1024.), (unsigned)sum);
+    volume_delete(volume);
 }
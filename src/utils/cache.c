@@ -18,87 +18,123 @@
 
 #include "cache.h"
 #include "uthash.h"
+#include "utlist.h"
 
 #include <assert.h>
 #include <stdint.h>
 
+/*
+ * The items are both in a hash table for the lookups, and in an intrusive
+ * doubly linked list sorted by last use, so that getting an item and
+ * releasing the oldest one are O(1).  The key is stored inline at the end
+ * of the item.
+ */
 typedef struct item item_t;
 struct item {
     UT_hash_handle  hh;
-    char            key[256];
+    item_t          *prev, *next;   // LRU list, oldest first.
     void            *data;
-    int             cost;
-    uint64_t        last_used;
+    uint64_t        cost;
     int             (*delfunc)(void *data);
+    int             keylen;
+    char            key[];
 };
 
 struct cache {
-    item_t *items;
-    uint64_t clock;
-    int size;
-    int max_size;
+    cache_t *next;      // List of all the caches.
+    item_t *items;      // Hash table of the items.
+    item_t *lru;        // Head of the LRU list.
+    int nb_items;
+    uint64_t size;
+    uint64_t max_size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int flags;
     const char *name; // For debuging only.
 };
 
-cache_t *cache_create(const char *name, int size)
+static cache_t *g_caches = NULL;
+
+cache_t *cache_create(const char *name, uint64_t size, int flags)
 {
-    cache_t *cache = calloc(1, sizeof(*cache));
+    cache_t *cache = calloc(1, sizeof(*cache)), **last;
     cache->max_size = size;
     cache->name = name;
+    cache->flags = flags;
+    for (last = &g_caches; *last; last = &(*last)->next) {}
+    *last = cache;
     return cache;
 }
 
-static void cleanup(cache_t *cache)
+static uint64_t item_size(const item_t *item)
 {
-    item_t *item;
-    while (cache->size >= cache->max_size) {
-        assert(cache->items);
-        item = cache->items;
-        HASH_DEL(cache->items, item);
-        assert(item != cache->items);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
+    return item->cost + item->keylen;
+}
+
+static void remove_item(cache_t *cache, item_t *item)
+{
+    HASH_DEL(cache->items, item);
+    DL_DELETE(cache->lru, item);
+    item->delfunc(item->data);
+    cache->size -= item_size(item);
+    cache->nb_items--;
+    free(item);
+}
+
+void cache_shrink(cache_t *cache, uint64_t size)
+{
+    while (cache->size > size) {
+        assert(cache->lru);
+        remove_item(cache, cache->lru);
+        cache->evictions++;
     }
 }
 
+void cache_set_max_size(cache_t *cache, uint64_t size)
+{
+    cache->max_size = size;
+    cache_shrink(cache, size);
+}
+
 void cache_add(cache_t *cache, const void *key, int len, void *data,
-               int cost, int (*delfunc)(void *data))
+               uint64_t cost, int (*delfunc)(void *data))
 {
-    item_t *item = calloc(1, sizeof(*item));
-    assert(len <= sizeof(item->key));
+    item_t *item = calloc(1, sizeof(*item) + len);
     memcpy(item->key, key, len);
+    item->keylen = len;
     item->data = data;
     item->cost = cost;
-    item->last_used = cache->clock++;
     item->delfunc = delfunc;
     HASH_ADD(hh, cache->items, key, len, item);
-    cache->size += cost;
-    if (cache->size >= cache->max_size) cleanup(cache);
+    DL_APPEND(cache->lru, item);
+    cache->size += item_size(item);
+    cache->nb_items++;
+    cache_shrink(cache, cache->max_size);
 }
 
 void *cache_get(cache_t *cache, const void *key, int keylen)
 {
     item_t *item;
     HASH_FIND(hh, cache->items, key, keylen, item);
-    if (!item) return NULL;
-    item->last_used = cache->clock++;
-    // Reinsert item on top of the hash list so that it stays sorted.
-    HASH_DEL(cache->items, item);
-    HASH_ADD(hh, cache->items, key, keylen, item);
+    if (!item) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    // Move the item to the end of the LRU list.
+    if (item->next) {
+        DL_DELETE(cache->lru, item);
+        DL_APPEND(cache->lru, item);
+    }
     return item->data;
 }
 
 void cache_clear(cache_t *cache)
 {
-    item_t *item;
-    while ((item = cache->items)) {
-        HASH_DEL(cache->items, item);
-        item->delfunc(item->data);
-        cache->size -= item->cost;
-        free(item);
-    }
+    while (cache->lru) remove_item(cache, cache->lru);
     assert(cache->size == 0);
+    assert(cache->nb_items == 0);
 }
 
 /*
@@ -107,6 +143,26 @@ void cache_clear(cache_t *cache)
  */
 void cache_delete(cache_t *cache)
 {
+    cache_t **ptr;
     cache_clear(cache);
+    for (ptr = &g_caches; *ptr != cache; ptr = &(*ptr)->next) {}
+    *ptr = cache->next;
     free(cache);
 }
+
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats)
+{
+    stats->name = cache->name;
+    stats->flags = cache->flags;
+    stats->nb_items = cache->nb_items;
+    stats->size = cache->size;
+    stats->max_size = cache->max_size;
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+}
+
+cache_t *cache_next(const cache_t *cache)
+{
+    return cache ? cache->next : g_caches;
+}
@@ -19,11 +19,41 @@
 #ifndef CACHE_H
 #define CACHE_H
 
-// Generic data cache structure.
+#include <stdint.h>
 
-// Allow to cache blocks merge operations.
+/*
+ * Generic data cache structure.
+ *
+ * The items are kept in a least recently used list, and the oldest ones
+ * are released when the total cost of the items goes over the cache max
+ * size.  The caches are not thread safe.
+ */
 typedef struct cache cache_t;
 
+/*
+ * Enum: CACHE_FLAGS
+ *
+ * CACHE_SHARED_MEM - The items memory is shared with other objects, and
+ *                    already accounted somewhere else (for example cached
+ *                    volumes share their tiles).
+ * CACHE_GPU_MEM    - The items cost is GPU memory, not main memory.
+ */
+enum {
+    CACHE_SHARED_MEM = 1 << 0,
+    CACHE_GPU_MEM    = 1 << 1,
+};
+
+typedef struct {
+    const char  *name;
+    int         flags;
+    int         nb_items;
+    uint64_t    size;       // Total cost of the items, plus the keys.
+    uint64_t    max_size;
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;  // Number of items released to save space.
+} cache_stats_t;
+
 /*
  * Function: cache_create
  * Create a new cache with a given max size (in byte).
@@ -31,8 +61,9 @@ typedef struct cache cache_t;
  * Parameters:
  *   name   - A global static string used for debugging only.
  *   size   - The max size of the cache.
+ *   flags  - Any of the <CACHE_FLAGS> enum.
  */
-cache_t *cache_create(const char *name, int size);
+cache_t *cache_create(const char *name, uint64_t size, int flags);
 
 /*
  * Function: cache_add
@@ -42,13 +73,16 @@ cache_t *cache_create(const char *name, int size);
  *   cache      - A cache_t instance.
  *   key        - Unique key data for the cache item.
  *   keylen     - Size of the key data.
- *  data        - Pointer to the item data.  The cache takes ownership.
- *  cost        - Cost of the data used to compute the cache usage.
- *                It doesn't have to be the size.
- *  delfunc     - Function that the cache can use to free the data.
+ *   data       - Pointer to the item data.  The cache takes ownership.
+ *   cost       - Size in bytes of the data, used to compute the cache
+ *                usage.  It doesn't have to be exact.
+ *   delfunc    - Function that the cache can use to free the data.
+ *
+ * Adding an item can release the least recently used ones, including
+ * the added item itself if it is bigger than the cache.
  */
 void cache_add(cache_t *cache, const void *key, int keylen, void *data,
-               int cost, int (*delfunc)(void *data));
+               uint64_t cost, int (*delfunc)(void *data));
 
 /*
  * Function: cache_get
@@ -57,7 +91,7 @@ void cache_add(cache_t *cache, const void *key, int keylen, void *data,
  * Parameters:
  *   cache      - A cache_t instance.
  *   key        - Unique key data for the item.
- *   keylen     - Sizeo of the key data.
+ *   keylen     - Size of the key data.
  *
  * Returns:
  *   The data owned by the cache, or NULL if no item with this key is in
@@ -71,11 +105,43 @@ void *cache_get(cache_t *cache, const void *key, int keylen);
  */
 void cache_clear(cache_t *cache);
 
+/*
+ * Function: cache_shrink
+ * Release the least recently used items until the cache size is at most
+ * a given value.
+ */
+void cache_shrink(cache_t *cache, uint64_t size);
+
+/*
+ * Function: cache_set_max_size
+ * Change the max size of a cache, releasing the least recently used items
+ * if needed.
+ */
+void cache_set_max_size(cache_t *cache, uint64_t size);
+
 /*
  * Function: cache_delete
  * Delete a cache.
  */
 void cache_delete(cache_t *cache);
 
+/*
+ * Function: cache_get_stats
+ * Get usage info about a cache.
+ */
+void cache_get_stats(const cache_t *cache, cache_stats_t *stats);
+
+/*
+ * Function: cache_next
+ * Iterate all the existing caches.
+ *
+ * Parameters:
+ *   cache  - The previous cache, or NULL to get the first one.
+ *
+ * Returns:
+ *   The next cache, or NULL if there are no more caches.
+ */
+cache_t *cache_next(const cache_t *cache);
+
 
 #endif // CACHE_H
@@ -0,0 +1,342 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#   include <sys/mman.h>
+#   include <unistd.h>
+#endif
+
+#define HUGE_PAGE_SIZE (1 << 21)
+
+// Size of the chunks header, before the first item.
+#define CHUNK_HEADER ((sizeof(chunk_t) + 15) & ~15)
+
+typedef struct chunk chunk_t;
+struct chunk {
+    chunk_t     *next;
+    size_t      size;
+    bool        mapped; // Allocated with mmap.
+};
+
+typedef struct item item_t;
+struct item {
+    item_t *next;
+};
+
+struct pool {
+    pool_t      *next;      // Linked list of all the pools.
+    const char  *name;      // For debugging only.
+    int         item_size;
+    int         flags;
+    chunk_t     *chunks;
+    item_t      *free_list;
+    // Unused part of the last chunk.
+    char        *cur;
+    char        *end;
+    int         nb_used;
+    int         nb_free;
+    uint64_t    mem;
+    bool        huge_pages;
+    bool        lock;
+};
+
+static pool_t *g_pools = NULL;
+static bool g_pools_lock = false;
+
+static void spin_lock(bool *lock)
+{
+    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {}
+}
+
+static void spin_unlock(bool *lock)
+{
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+pool_t *pool_create(const char *name, int item_size, int flags)
+{
+    pool_t *pool, **last;
+    pool = calloc(1, sizeof(*pool));
+    pool->name = name;
+    // Keep all the items 16 bytes aligned.
+    pool->item_size = (item_size + 15) & ~15;
+    pool->flags = flags;
+    spin_lock(&g_pools_lock);
+    for (last = &g_pools; *last; last = &(*last)->next) {}
+    *last = pool;
+    spin_unlock(&g_pools_lock);
+    return pool;
+}
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+// Check if the kernel can back madvised memory with transparent huge pages.
+static bool huge_pages_supported(void)
+{
+    static int ret = -1;
+    char buf[128];
+    FILE *file;
+
+    if (ret != -1) return ret;
+    ret = 0;
+    file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!file) return ret;
+    if (fgets(buf, sizeof(buf), file))
+        ret = strstr(buf, "[always]") || strstr(buf, "[madvise]");
+    fclose(file);
+    return ret;
+}
+
+// Map a huge page aligned chunk of memory.  We map an extra huge page and
+// unmap the unaligned parts, so that we don't depend on the kernel to
+// align the mapping for us.
+static void *huge_pages_map(size_t size)
+{
+    char *addr, *start;
+    size_t head, tail;
+
+    addr = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return NULL;
+    start = (char*)(((uintptr_t)addr + HUGE_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    head = start - addr;
+    tail = HUGE_PAGE_SIZE - head;
+    if (head) munmap(addr, head);
+    if (tail) munmap(start + size, tail);
+    // Must be done before we touch the memory, or the first pages are
+    // already backed by normal pages.
+    if (madvise(start, size, MADV_HUGEPAGE) != 0) {
+        munmap(start, size);
+        return NULL;
+    }
+    return start;
+}
+#endif
+
+static chunk_t *chunk_alloc(pool_t *pool, size_t size)
+{
+    chunk_t *chunk = NULL;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if ((pool->flags & POOL_HUGE_PAGES) && huge_pages_supported()) {
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        chunk = huge_pages_map(size);
+        if (chunk) {
+            chunk->mapped = true;
+            pool->huge_pages = true;
+        }
+    }
+#endif
+    if (!chunk) {
+        chunk = malloc(size);
+        chunk->mapped = false;
+    }
+    chunk->size = size;
+    return chunk;
+}
+
+static void chunk_free(chunk_t *chunk)
+{
+#ifdef __linux__
+    if (chunk->mapped) {
+        munmap(chunk, chunk->size);
+        return;
+    }
+#endif
+    free(chunk);
+}
+
+static void pool_grow(pool_t *pool)
+{
+    chunk_t *chunk;
+    size_t size;
+    const size_t header = CHUNK_HEADER;
+
+    // At least 64 items per chunk.
+    size = header + (size_t)pool->item_size * 64;
+    if (size < (1 << 16)) size = 1 << 16;
+    if (pool->flags & POOL_HUGE_PAGES) size = HUGE_PAGE_SIZE;
+    chunk = chunk_alloc(pool, size);
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->mem += chunk->size;
+    pool->cur = (char*)chunk + header;
+    pool->end = (char*)chunk + chunk->size;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    void *ret;
+
+    spin_lock(&pool->lock);
+    pool->nb_used++;
+    if (pool->free_list) {
+        ret = pool->free_list;
+        pool->free_list = pool->free_list->next;
+        pool->nb_free--;
+    } else {
+        if (pool->cur + pool->item_size > pool->end) pool_grow(pool);
+        ret = pool->cur;
+        pool->cur += pool->item_size;
+    }
+    spin_unlock(&pool->lock);
+    return ret;
+}
+
+void pool_free(pool_t *pool, void *ptr)
+{
+    item_t *item = ptr;
+    if (!ptr) return;
+    spin_lock(&pool->lock);
+    assert(pool->nb_used > 0);
+    item->next = pool->free_list;
+    pool->free_list = item;
+    pool->nb_used--;
+    pool->nb_free++;
+    spin_unlock(&pool->lock);
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t)*(void**)a, pb = (uintptr_t)*(void**)b;
+    return pa < pb ? -1 : pa > pb ? +1 : 0;
+}
+
+// Find the index of the chunk containing a pointer in a sorted array.
+static int find_chunk(chunk_t **chunks, int nb, const void *ptr)
+{
+    int lo = 0, hi = nb - 1, mid;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if ((uintptr_t)chunks[mid] <= (uintptr_t)ptr) lo = mid;
+        else hi = mid - 1;
+    }
+    assert((char*)ptr >= (char*)chunks[lo] &&
+           (char*)ptr < (char*)chunks[lo] + chunks[lo]->size);
+    return lo;
+}
+
+// Discard the memory pages inside a free item, except the first bytes that
+// hold the free list pointer.  Return the number of bytes discarded.
+static uint64_t item_discard_pages(pool_t *pool, item_t *item)
+{
+#if defined(__linux__) && defined(MADV_DONTNEED)
+    static uintptr_t page_size = 0;
+    uintptr_t start, end;
+
+    if (!page_size) page_size = sysconf(_SC_PAGESIZE);
+    start = (uintptr_t)item + sizeof(*item);
+    start = (start + page_size - 1) & ~(page_size - 1);
+    end = ((uintptr_t)item + pool->item_size) & ~(page_size - 1);
+    if (end <= start) return 0;
+    if (madvise((void*)start, end - start, MADV_DONTNEED) != 0) return 0;
+    return end - start;
+#else
+    return 0;
+#endif
+}
+
+uint64_t pool_trim(pool_t *pool)
+{
+    chunk_t **chunks, *chunk, **chunk_ptr, *current;
+    item_t *item, **item_ptr;
+    int i, nb_chunks = 0, nb_items, *nb_free;
+    uint64_t ret = 0;
+
+    spin_lock(&pool->lock);
+    // The chunk we are currently allocating new items from, if any.
+    current = pool->cur ? pool->chunks : NULL;
+    for (chunk = pool->chunks; chunk; chunk = chunk->next) nb_chunks++;
+    chunks = malloc(nb_chunks * sizeof(*chunks));
+    nb_free = calloc(nb_chunks, sizeof(*nb_free));
+    for (chunk = pool->chunks, i = 0; chunk; chunk = chunk->next)
+        chunks[i++] = chunk;
+    if (nb_chunks) qsort(chunks, nb_chunks, sizeof(*chunks), ptr_cmp);
+
+    // Count the free items of each chunk.  If all the items we allocated
+    // from a chunk are free, we mark it to be released with -1.
+    for (item = pool->free_list; item; item = item->next)
+        nb_free[find_chunk(chunks, nb_chunks, item)]++;
+    for (i = 0; i < nb_chunks; i++) {
+        if (chunks[i] == current)
+            nb_items = (pool->cur - (char*)current - CHUNK_HEADER) /
+                       pool->item_size;
+        else
+            nb_items = (chunks[i]->size - CHUNK_HEADER) / pool->item_size;
+        if (nb_free[i] == nb_items) nb_free[i] = -1;
+    }
+
+    // Remove the items of the released chunks from the free list.
+    item_ptr = &pool->free_list;
+    while ((item = *item_ptr)) {
+        if (nb_free[find_chunk(chunks, nb_chunks, item)] == -1) {
+            *item_ptr = item->next;
+            pool->nb_free--;
+            continue;
+        }
+        // Large enough items can still give some pages back.
+        ret += item_discard_pages(pool, item);
+        item_ptr = &item->next;
+    }
+
+    chunk_ptr = &pool->chunks;
+    while ((chunk = *chunk_ptr)) {
+        if (nb_free[find_chunk(chunks, nb_chunks, chunk)] != -1) {
+            chunk_ptr = &chunk->next;
+            continue;
+        }
+        if (chunk == current) pool->cur = pool->end = NULL;
+        *chunk_ptr = chunk->next;
+        pool->mem -= chunk->size;
+        ret += chunk->size;
+        chunk_free(chunk);
+    }
+    spin_unlock(&pool->lock);
+
+    free(chunks);
+    free(nb_free);
+    return ret;
+}
+
+void pool_get_stats(pool_t *pool, pool_stats_t *stats)
+{
+    spin_lock(&pool->lock);
+    stats->name = pool->name;
+    stats->item_size = pool->item_size;
+    stats->nb_used = pool->nb_used;
+    stats->nb_free = pool->nb_free;
+    stats->mem = pool->mem;
+    stats->huge_pages = pool->huge_pages;
+    spin_unlock(&pool->lock);
+}
+
+pool_t *pool_next(const pool_t *pool)
+{
+    pool_t *ret;
+    spin_lock(&g_pools_lock);
+    ret = pool ? pool->next : g_pools;
+    spin_unlock(&g_pools_lock);
+    return ret;
+}
@@ -0,0 +1,113 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2019 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Fixed size items pool allocator.
+ *
+ * The items are allocated from big chunks of memory, and freed items are
+ * kept into a free list so that we can reuse them without going through
+ * malloc.  The memory is only given back to the system when we call
+ * <pool_trim>.
+ *
+ * The pools can be used from several threads, each call takes a small
+ * spin lock.
+ */
+
+typedef struct pool pool_t;
+
+/*
+ * Enum: POOL_FLAGS
+ *
+ * POOL_HUGE_PAGES - Try to back the chunks with huge pages.  Only
+ *                   supported on linux, ignored otherwise.
+ */
+enum {
+    POOL_HUGE_PAGES = 1 << 0,
+};
+
+typedef struct {
+    const char  *name;
+    int         item_size;
+    int         nb_used;    // Number of allocated items.
+    int         nb_free;    // Number of items in the free list.
+    uint64_t    mem;        // Total size of the chunks.
+    bool        huge_pages; // Chunks madvised for transparent huge pages.
+} pool_stats_t;
+
+/*
+ * Function: pool_create
+ * Create a new pool.
+ *
+ * Parameters:
+ *   name       - A global static string used for debugging only.
+ *   item_size  - Size of the items.
+ *   flags      - Any of the <POOL_FLAGS> enum.
+ */
+pool_t *pool_create(const char *name, int item_size, int flags);
+
+/*
+ * Function: pool_alloc
+ * Allocate a new item.  The memory is not initialized.
+ */
+void *pool_alloc(pool_t *pool);
+
+/*
+ * Function: pool_free
+ * Put back an item into the pool.
+ */
+void pool_free(pool_t *pool, void *ptr);
+
+/*
+ * Function: pool_trim
+ * Give the memory of the free items back to the system.
+ *
+ * The chunks that only contain free items are released, and on linux the
+ * memory pages inside the other free items are discarded.  The items
+ * stay in the free list, so this is only worth calling after we freed a
+ * lot of items.
+ *
+ * Returns:
+ *   An estimation of the number of bytes given back.
+ */
+uint64_t pool_trim(pool_t *pool);
+
+/*
+ * Function: pool_get_stats
+ * Get usage info about a pool.
+ */
+void pool_get_stats(pool_t *pool, pool_stats_t *stats);
+
+/*
+ * Function: pool_next
+ * Iterate all the created pools.
+ *
+ * Parameters:
+ *   pool   - The previous pool, or NULL to get the first one.
+ *
+ * Returns:
+ *   The next pool, or NULL if there are no more pools.
+ */
+pool_t *pool_next(const pool_t *pool);
+
+#endif // POOL_H
@@ -0,0 +1,266 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "workers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __EMSCRIPTEN__
+#   define WORKERS_THREADS 0
+#else
+#   define WORKERS_THREADS 1
+#   include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#   include <windows.h>
+#else
+#   include <unistd.h>
+#endif
+
+#define MAX_THREADS 64
+
+/*
+ * The indices of a job are split into one range per thread.  A thread
+ * takes the indices from the start of its own range, and once it is
+ * empty, steals the second half of the biggest range of the other threads.
+ * The ranges are packed into 64 bits values (start in the low bits, end
+ * in the high bits) so that we can update them with a compare and swap.
+ */
+typedef struct {
+    void        (*func)(void *user, int i);
+    void        *user;
+    int         n;
+    int         nb_slots;
+    int         nb_joined;  // Number of worker threads that joined the job.
+    int         nb_workers; // Number of worker threads inside the job.
+    uint64_t    ranges[MAX_THREADS];
+} job_t;
+
+#if WORKERS_THREADS
+
+static struct {
+    pthread_once_t  once;
+    pthread_mutex_t lock;
+    pthread_cond_t  job_cond;   // Signaled when a new job starts.
+    pthread_cond_t  done_cond;  // Signaled when a worker leaves a job.
+    int             nb_threads; // Not counting the calling thread.
+    bool            busy;
+    job_t           *job;
+    uint64_t        job_seq;
+} g_workers = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+#endif
+
+static uint64_t range_pack(uint32_t start, uint32_t end)
+{
+    return (uint64_t)end << 32 | start;
+}
+
+// Take the first index of a range, return -1 if the range is empty.
+static int range_pop(uint64_t *range)
+{
+    uint64_t r = __atomic_load_n(range, __ATOMIC_RELAXED);
+    uint32_t start, end;
+    while (true) {
+        start = r;
+        end = r >> 32;
+        if (start >= end) return -1;
+        if (__atomic_compare_exchange_n(range, &r, range_pack(start + 1, end),
+                    true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return start;
+    }
+}
+
+// Move half of the biggest range of the other slots into our own range.
+static bool job_steal(job_t *job, int slot)
+{
+    int i, best;
+    uint64_t r;
+    uint32_t start, end, mid, size, best_size;
+
+    while (true) {
+        best = -1;
+        best_size = 0;
+        for (i = 0; i < job->nb_slots; i++) {
+            if (i == slot) continue;
+            r = __atomic_load_n(&job->ranges[i], __ATOMIC_RELAXED);
+            start = r;
+            end = r >> 32;
+            size = start < end ? end - start : 0;
+            if (size > best_size) {
+                best = i;
+                best_size = size;
+            }
+        }
+        if (best == -1) return false;
+        r = __atomic_load_n(&job->ranges[best], __ATOMIC_RELAXED);
+        start = r;
+        end = r >> 32;
+        if (start >= end) continue;
+        mid = start + (end - start) / 2;
+        if (!__atomic_compare_exchange_n(&job->ranges[best], &r,
+                    range_pack(start, mid), false,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+        // Our range is empty, so nobody else can modify it.
+        __atomic_store_n(&job->ranges[slot], range_pack(mid, end),
+                         __ATOMIC_RELAXED);
+        return true;
+    }
+}
+
+static void job_init(job_t *job, int n, int nb_slots,
+                     void (*func)(void *user, int i), void *user)
+{
+    int i;
+    job->func = func;
+    job->user = user;
+    job->n = n;
+    job->nb_slots = nb_slots;
+    job->nb_joined = 0;
+    job->nb_workers = 0;
+    for (i = 0; i < nb_slots; i++) {
+        job->ranges[i] = range_pack((int64_t)n * i / nb_slots,
+                                    (int64_t)n * (i + 1) / nb_slots);
+    }
+}
+
+static void job_run(job_t *job, int slot)
+{
+    int i;
+    while (true) {
+        i = range_pop(&job->ranges[slot]);
+        if (i >= 0) {
+            job->func(job->user, i);
+            continue;
+        }
+        if (!job_steal(job, slot)) break;
+    }
+}
+
+#if WORKERS_THREADS
+
+static void *worker_func(void *arg)
+{
+    uint64_t seq = 0;
+    job_t *job;
+    int slot;
+
+    pthread_mutex_lock(&g_workers.lock);
+    while (true) {
+        while (!g_workers.job || g_workers.job_seq == seq)
+            pthread_cond_wait(&g_workers.job_cond, &g_workers.lock);
+        seq = g_workers.job_seq;
+        job = g_workers.job;
+        // The calling thread uses the slot 0.
+        slot = ++job->nb_joined;
+        job->nb_workers++;
+        pthread_mutex_unlock(&g_workers.lock);
+        job_run(job, slot);
+        pthread_mutex_lock(&g_workers.lock);
+        if (--job->nb_workers == 0)
+            pthread_cond_broadcast(&g_workers.done_cond);
+    }
+    return NULL;
+}
+
+static int get_nb_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+
+static void workers_init(void)
+{
+    int i, n;
+    pthread_t thread;
+
+    n = get_nb_cpus() - 1;
+    if (n > MAX_THREADS - 1) n = MAX_THREADS - 1;
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&thread, NULL, worker_func, NULL) != 0) break;
+        pthread_detach(thread);
+    }
+    g_workers.nb_threads = i;
+}
+
+void workers_run(int n, void (*func)(void *user, int i), void *user)
+{
+    job_t job;
+
+    if (n <= 0) return;
+    pthread_once(&g_workers.once, workers_init);
+    if (    n == 1 || g_workers.nb_threads == 0 ||
+            __atomic_test_and_set(&g_workers.busy, __ATOMIC_ACQUIRE)) {
+        job_init(&job, n, 1, func, user);
+        job_run(&job, 0);
+        return;
+    }
+
+    job_init(&job, n, g_workers.nb_threads + 1, func, user);
+    pthread_mutex_lock(&g_workers.lock);
+    g_workers.job = &job;
+    g_workers.job_seq++;
+    pthread_cond_broadcast(&g_workers.job_cond);
+    pthread_mutex_unlock(&g_workers.lock);
+
+    job_run(&job, 0);
+
+    // Wait for the workers still running the last calls.
+    pthread_mutex_lock(&g_workers.lock);
+    g_workers.job = NULL;
+    while (job.nb_workers)
+        pthread_cond_wait(&g_workers.done_cond, &g_workers.lock);
+    pthread_mutex_unlock(&g_workers.lock);
+    __atomic_clear(&g_workers.busy, __ATOMIC_RELEASE);
+}
+
+int workers_get_count(void)
+{
+    pthread_once(&g_workers.once, workers_init);
+    return g_workers.nb_threads + 1;
+}
+
+#else // WORKERS_THREADS
+
+void workers_run(int n, void (*func)(void *user, int i), void *user)
+{
+    job_t job;
+    if (n <= 0) return;
+    job_init(&job, n, 1, func, user);
+    job_run(&job, 0);
+}
+
+int workers_get_count(void)
+{
+    return 1;
+}
+
+#endif
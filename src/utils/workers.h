@@ -0,0 +1,54 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*
+ * Global pool of worker threads, used to split heavy computations over all
+ * the cpu cores.
+ *
+ * The threads are created the first time we need them, and are never
+ * stopped.  Only one job runs at a time: if the workers are already busy,
+ * for example if we call <workers_run> from a job function, the work is
+ * done in the calling thread.
+ */
+
+/*
+ * Function: workers_run
+ * Call a function for all the indices from 0 to n - 1, in parallel.
+ *
+ * The calling thread takes part in the work, and the function returns once
+ * all the calls are done.  The calls can happen in any order, so the
+ * function should only write to data specific to its index.
+ *
+ * Parameters:
+ *   n      - Number of calls.
+ *   func   - Function called for each index.
+ *   user   - User data passed to the function.
+ */
+void workers_run(int n, void (*func)(void *user, int i), void *user);
+
+/*
+ * Function: workers_get_count
+ * Return the number of threads used by <workers_run>, including the calling
+ * thread.
+ */
+int workers_get_count(void);
+
+#endif // WORKERS_H
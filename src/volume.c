@@ -17,10 +17,13 @@
  */
 
 #include "volume.h"
-#include "uthash.h"
+#include "utils/pool.h"
+
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define min(a, b) ({ \
       __typeof__ (a) _a = (a); \
@@ -39,6 +42,29 @@ enum {
     VOLUME_ITER_FINISHED                  = 1 << 9,
     VOLUME_ITER_BOX                       = 1 << 10,
     VOLUME_ITER_VOLUME2                     = 1 << 11,
+    // Set when we iterate the neighbors tiles.
+    VOLUME_ITER_NEIGHBORS                 = 1 << 12,
+    // Set if the accessor tile is not shared and can be modified in place.
+    VOLUME_ITER_WRITABLE                  = 1 << 13,
+};
+
+/*
+ * Enum: TILE_DATA
+ * The different ways the voxels of a tile can be stored.
+ *
+ * TILE_DATA_DENSE   - Plain array of RGBA values.
+ * TILE_DATA_UNIFORM - All the voxels have the same value.
+ * TILE_DATA_INDEXED - A per tile palette, plus 4, 8 or 16 bits indices
+ *                     into it for each voxel.
+ *
+ * Uniform and indexed data are never modified: when we write into them
+ * they get expanded into a dense array first, and volume_compact_tiles
+ * turns them back into the most compact representation.
+ */
+enum {
+    TILE_DATA_DENSE     = 0,
+    TILE_DATA_UNIFORM   = 1,
+    TILE_DATA_INDEXED   = 2,
 };
 
 typedef struct tile_data tile_data_t;
@@ -46,28 +72,130 @@ struct tile_data
 {
     int         ref;
     uint64_t    id;
-    uint8_t     voxels[TILE_SIZE * TILE_SIZE * TILE_SIZE][4]; // RGBA voxels.
+    int         type;           // One of the TILE_DATA enum values.
+    uint8_t     value[4];       // Value of all the voxels if uniform.
+    int         bits;           // Size of the indices if indexed.
+    int         palette_size;
+    uint8_t     (*palette)[4];  // Palette, followed by the indices.
+    void        *indices;
+    // RGBA voxels.  Always set for dense data, compact data only allocate
+    // it when the tile is expanded before a write.
+    uint8_t     (*voxels)[4];
+    int         count;                  // Number of non empty voxels.
+    uint64_t    mask[TILE_MASK_SIZE];   // Bit set for each non empty voxel.
 };
 
+#define TILE_VOXELS_SIZE (TILE_SIZE * TILE_SIZE * TILE_SIZE * 4)
+// Max number of colors for which we use an indexed tile.  Above that the
+// palette plus the 16 bits indices are not much smaller than the RGBA
+// voxels (at 16^3, 1024 colors use 12 KiB instead of 16 KiB), and we would
+// still pay the decoding on every read.
+#define TILE_PALETTE_MAX 1024
+
+/*
+ * The tiles are stored in a persistent hash array mapped trie keyed on the
+ * tile position hash, so that copies of a volume can share most of their
+ * structure: when we modify a shared volume, we only copy the nodes on the
+ * path to the modified tile.
+ *
+ * Each node has up to 64 entries, indexed by 6 bits of the hash, and only
+ * stores the used ones.  An entry is either a tile or a sub node.  Once
+ * all the bits of the hash are used, the last level nodes just list the
+ * tiles with the same hash, sorted by position.
+ */
+typedef struct node node_t;
+
 struct tile
 {
-    UT_hash_handle  hh;     // The hash table of pos -> tiles in a volume.
-    tile_data_t     *data;
-    int             pos[3];
-    uint64_t        id;
+    tile_data_t     *data;  // NULL if the entry is a sub node.
+    union {
+        int         pos[3];
+        node_t      *node;
+    };
+};
+
+struct node
+{
+    int         ref;
+    int         count;      // Number of entries.
+    uint64_t    bitmap;     // Bit set for each used entry index.
+    tile_t      entries[];
+};
+
+typedef struct tiles tiles_t;
+struct tiles
+{
+    int         ref;        // Used to implement copy on write of the tiles.
+    // Changed each time a tile pointer could get invalidated or the nodes
+    // become shared.
+    uint64_t    id;
+    int         count;      // Number of tiles.
+    node_t      *root;      // Can be NULL if there are no tiles.
 };
 
 struct volume
 {
     int ref;
-    tile_t *tiles;
-    int *tiles_ref;   // Used to implement copy on write of the tiles.
+    tiles_t *tiles;
     uint64_t key; // Two volumes with the same key have the same value.
 };
 
+/*
+ * The volumes can be used from several threads, as long as a given volume
+ * is not modified while an other thread uses it.  Since different volumes
+ * can share the same tiles, all the reference counters and the ids are
+ * updated atomically.
+ */
+#define REF_GET(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define REF_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define REF_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+
 static uint64_t g_uid = 2; // Global id counter.
 
-static volume_global_stats_t g_global_stats = {};
+static inline uint64_t new_uid(void)
+{
+    return __atomic_fetch_add(&g_uid, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The global stats are kept per thread, so that we don't need any
+ * synchronization to update them, and summed in volume_get_global_stats.
+ * The values of a given thread can be negative, since a tile can be
+ * released from an other thread than the one that created it.
+ */
+typedef struct thread_stats thread_stats_t;
+struct thread_stats {
+    thread_stats_t *next;
+    int64_t nb_volumes;
+    int64_t nb_tiles;
+    int64_t nb_uniform_tiles;
+    int64_t nb_indexed_tiles;
+    int64_t mem;
+    int64_t voxels_mem; // Memory used by the tiles voxels and palettes.
+};
+
+static thread_stats_t *g_threads_stats = NULL;
+static __thread thread_stats_t *g_thread_stats = NULL;
+
+static thread_stats_t *get_thread_stats(void)
+{
+    thread_stats_t *stats = g_thread_stats;
+    if (stats) return stats;
+    // Never released, since we still need the values after the thread ends.
+    stats = calloc(1, sizeof(*stats));
+    stats->next = __atomic_load_n(&g_threads_stats, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&g_threads_stats, &stats->next,
+                stats, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    g_thread_stats = stats;
+    return stats;
+}
+
+// Only the owner thread modifies its stats, so we don't need an atomic add.
+#define STAT_ADD(attr, v) do { \
+    thread_stats_t *stats_ = get_thread_stats(); \
+    __atomic_store_n(&stats_->attr, stats_->attr + (int64_t)(v), \
+                     __ATOMIC_RELAXED); \
+} while (0)
 
 #define N TILE_SIZE
 
@@ -80,7 +208,8 @@ static volume_global_stats_t g_global_stats = {};
             for (x = 0; x < N; x++)
 
 #define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
-#define TILE_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
+// Read only access to a tile voxel value.
+#define TILE_AT(c, x, y, z) (tile_data_voxel((c)->data, x + y * N + z * N * N))
 
 static void mat4_mul_vec4(float mat[4][4], const float v[4], float out[4])
 {
@@ -130,90 +259,293 @@ static void bbox_intersection(int a[2][3], int b[2][3], int out[2][3])
     }
 }
 
+static inline int tile_data_index(const tile_data_t *data, int i)
+{
+    switch (data->bits) {
+    case 4: return (((const uint8_t*)data->indices)[i / 2] >> (i % 2 * 4)) & 15;
+    case 8: return ((const uint8_t*)data->indices)[i];
+    default: return ((const uint16_t*)data->indices)[i];
+    }
+}
+
+// Return a pointer to the RGBA value of the voxel at index i.
+static inline const uint8_t *tile_data_voxel(const tile_data_t *data, int i)
+{
+    switch (data->type) {
+    case TILE_DATA_DENSE: return data->voxels[i];
+    case TILE_DATA_UNIFORM: return data->value;
+    default: return data->palette[tile_data_index(data, i)];
+    }
+}
+
+// Pools used to allocate the tiles data and voxels, and the data shared by
+// all the empty tiles.  Created at startup, before we use any thread.
+// The tiles themselves live inline in the trie nodes entries, so they
+// don't need a pool.
+static pool_t *g_data_pool = NULL;
+static pool_t *g_voxels_pool = NULL;
+static tile_data_t *g_empty_data = NULL;
+
+__attribute__((constructor))
+static void volume_init_globals(void)
+{
+    g_data_pool = pool_create("tile data", sizeof(tile_data_t), 0);
+    g_voxels_pool = pool_create("tile voxels", TILE_VOXELS_SIZE,
+                                POOL_HUGE_PAGES);
+    g_empty_data = calloc(1, sizeof(*g_empty_data));
+    g_empty_data->ref = 1;
+    g_empty_data->id = 0;
+    g_empty_data->type = TILE_DATA_UNIFORM;
+}
+
 static tile_data_t *get_empty_data(void)
 {
-    static tile_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
+    return g_empty_data;
+}
+
+static bool tile_is_empty(const tile_t *tile)
+{
+    return !tile || tile->data->count == 0;
+}
+
+// Update the occupancy mask after we set the voxel at index i.
+static void tile_data_update_mask(tile_data_t *data, int i, bool full)
+{
+    uint64_t bit = 1ULL << (i % 64);
+    if (((data->mask[i / 64] & bit) != 0) == full) return;
+    data->mask[i / 64] ^= bit;
+    data->count += full ? 1 : -1;
+}
+
+/*
+ * Return the index of the first non empty voxel of a tile, starting from
+ * index i, or -1 if there are none.
+ */
+static int tile_next_voxel(const tile_t *tile, int i)
+{
+    const uint64_t *mask = tile->data->mask;
+    uint64_t w;
+    int k = i / 64;
+    if (i >= N * N * N) return -1;
+    w = mask[k] & (~0ULL << (i % 64));
+    while (!w) {
+        if (++k == TILE_MASK_SIZE) return -1;
+        w = mask[k];
     }
-    return data;
+    return k * 64 + __builtin_ctzll(w);
 }
 
-static bool tile_is_empty(const tile_t *tile, bool fast)
+// Compute the exact bounding box of the non empty voxels of a tile.
+static void tile_get_bbox(const tile_t *tile, int bbox[2][3])
 {
-    int x, y, z;
-    if (!tile) return true;
-    if (tile->data->id == 0) return true;
-    if (fast) return false;
+    const int ROWS = 64 / N; // Number of x rows per mask word.
+    const int WORDS = N * N / 64; // Number of mask words per z slice.
+    const uint64_t *mask = tile->data->mask;
+    uint32_t s[3] = {}, row; // Bits set for each non empty x, y and z.
+    int i, j;
 
-    TILE_ITER(x, y, z) {
-        if (TILE_AT(tile, x, y, z)[3]) return false;
+    for (i = 0; i < TILE_MASK_SIZE; i++) {
+        if (!mask[i]) continue;
+        s[2] |= 1u << (i / WORDS);
+        for (j = 0; j < ROWS; j++) {
+            row = (mask[i] >> (j * N)) & ((1ULL << N) - 1);
+            if (!row) continue;
+            s[0] |= row;
+            s[1] |= 1u << (i % WORDS * ROWS + j);
+        }
+    }
+    for (i = 0; i < 3; i++) {
+        bbox[0][i] = tile->pos[i] + __builtin_ctz(s[i]);
+        bbox[1][i] = tile->pos[i] + 32 - __builtin_clz(s[i]);
     }
-    return true;
 }
 
-static tile_t *tile_new(const int pos[3])
+static size_t tile_data_palette_mem(const tile_data_t *data)
 {
-    tile_t *tile = calloc(1, sizeof(*tile));
-    memcpy(tile->pos, pos, sizeof(tile->pos));
-    tile->data = get_empty_data();
-    tile->data->ref++;
-    tile->id = g_uid++;
-    return tile;
+    return data->palette_size * 4 + N * N * N * data->bits / 8;
+}
+
+static void tile_data_set_type(tile_data_t *data, int type)
+{
+    if (data->type == TILE_DATA_UNIFORM) STAT_ADD(nb_uniform_tiles, -1);
+    if (data->type == TILE_DATA_INDEXED) STAT_ADD(nb_indexed_tiles, -1);
+    data->type = type;
+    if (data->type == TILE_DATA_UNIFORM) STAT_ADD(nb_uniform_tiles, +1);
+    if (data->type == TILE_DATA_INDEXED) STAT_ADD(nb_indexed_tiles, +1);
+}
+
+static void tile_data_free_voxels(tile_data_t *data)
+{
+    if (!data->voxels) return;
+    pool_free(g_voxels_pool, data->voxels);
+    data->voxels = NULL;
+    STAT_ADD(mem, -TILE_VOXELS_SIZE);
+    STAT_ADD(voxels_mem, -TILE_VOXELS_SIZE);
+}
+
+static void tile_data_free_palette(tile_data_t *data)
+{
+    if (!data->palette) return;
+    STAT_ADD(mem, -tile_data_palette_mem(data));
+    STAT_ADD(voxels_mem, -tile_data_palette_mem(data));
+    free(data->palette);
+    data->palette = NULL;
+    data->indices = NULL;
+    data->palette_size = 0;
+    data->bits = 0;
+}
+
+/*
+ * Make sure the voxels array is allocated, expanding the compact data.
+ * Only called on data we are about to write, so never shared between
+ * threads.  Return the voxels array.
+ */
+static uint8_t (*tile_data_alloc_voxels(tile_data_t *data))[4]
+{
+    int i;
+    if (data->voxels) return data->voxels;
+    data->voxels = pool_alloc(g_voxels_pool);
+    for (i = 0; i < N * N * N; i++)
+        memcpy(data->voxels[i], tile_data_voxel(data, i), 4);
+    STAT_ADD(mem, TILE_VOXELS_SIZE);
+    STAT_ADD(voxels_mem, TILE_VOXELS_SIZE);
+    return data->voxels;
+}
+
+static tile_data_t *tile_data_new(void)
+{
+    tile_data_t *data;
+    data = pool_alloc(g_data_pool);
+    memset(data, 0, sizeof(*data));
+    data->ref = 1;
+    data->id = new_uid();
+    STAT_ADD(nb_tiles, +1);
+    STAT_ADD(mem, sizeof(*data));
+    return data;
+}
+
+static void tile_data_release(tile_data_t *data)
+{
+    if (REF_DEC(data->ref) > 0) return;
+    tile_data_free_voxels(data);
+    tile_data_free_palette(data);
+    tile_data_set_type(data, TILE_DATA_DENSE);
+    pool_free(g_data_pool, data);
+    STAT_ADD(nb_tiles, -1);
+    STAT_ADD(mem, -(int64_t)sizeof(*data));
 }
 
-static void tile_delete(tile_t *tile)
+/*
+ * Build the palette of a dense data.  Returns the number of colors, or
+ * zero if there are more than TILE_PALETTE_MAX colors.
+ * The colors are stored in a small open addressing hash table.
+ */
+static int tile_data_get_palette(const tile_data_t *data,
+                                 uint32_t palette[TILE_PALETTE_MAX],
+                                 uint16_t *indices)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
-        free(tile->data);
-        g_global_stats.nb_tiles--;
-        g_global_stats.mem -= sizeof(*tile->data);
+    const int HSIZE = TILE_PALETTE_MAX * 2;
+    uint32_t v, h, *voxels = (uint32_t*)data->voxels;
+    uint16_t table[TILE_PALETTE_MAX * 2]; // Index + 1 into the palette.
+    int i, nb = 0;
+
+    memset(table, 0, sizeof(table));
+    for (i = 0; i < N * N * N; i++) {
+        v = voxels[i];
+        // Most of the time we have runs of the same color.
+        if (i && v == voxels[i - 1]) {
+            indices[i] = indices[i - 1];
+            continue;
+        }
+        for (h = (uint64_t)(v * 2654435761u) * HSIZE >> 32; ;
+             h = (h + 1) % HSIZE) {
+            if (!table[h]) {
+                if (nb == TILE_PALETTE_MAX) return 0;
+                palette[nb++] = v;
+                table[h] = nb;
+                break;
+            }
+            if (palette[table[h] - 1] == v) break;
+        }
+        indices[i] = table[h] - 1;
     }
-    free(tile);
+    return nb;
 }
 
-static tile_t *tile_copy(const tile_t *other)
+/*
+ * Set a data content from a palette and the voxels indices, using either
+ * a single value or an indexed representation.
+ */
+static void tile_data_set_palette(tile_data_t *data, int nb,
+                                  const uint32_t *palette,
+                                  const uint16_t *indices)
 {
-    tile_t *tile = malloc(sizeof(*tile));
-    *tile = *other;
-    memset(&tile->hh, 0, sizeof(tile->hh));
-    tile->data->ref++;
-    tile->id = g_uid++;
-    return tile;
+    int i, bits;
+    uint8_t *packed;
+
+    if (nb == 1) {
+        memcpy(data->value, palette, 4);
+        tile_data_set_type(data, TILE_DATA_UNIFORM);
+        tile_data_free_voxels(data);
+        return;
+    }
+    bits = nb <= 16 ? 4 : nb <= 256 ? 8 : 16;
+    data->bits = bits;
+    data->palette_size = nb;
+    packed = malloc(tile_data_palette_mem(data));
+    STAT_ADD(mem, tile_data_palette_mem(data));
+    STAT_ADD(voxels_mem, tile_data_palette_mem(data));
+    memcpy(packed, palette, nb * 4);
+    data->palette = (void*)packed;
+    data->indices = packed + nb * 4;
+    for (i = 0; i < N * N * N; i++) {
+        switch (bits) {
+        case 4:
+            if (i % 2 == 0) ((uint8_t*)data->indices)[i / 2] = 0;
+            ((uint8_t*)data->indices)[i / 2] |= indices[i] << (i % 2 * 4);
+            break;
+        case 8:
+            ((uint8_t*)data->indices)[i] = indices[i];
+            break;
+        default:
+            ((uint16_t*)data->indices)[i] = indices[i];
+            break;
+        }
+    }
+    tile_data_set_type(data, TILE_DATA_INDEXED);
+    tile_data_free_voxels(data);
 }
 
 static void tile_set_data(tile_t *tile, tile_data_t *data)
 {
-    tile->data->ref--;
-    if (tile->data->ref == 0) {
-        free(tile->data);
-        g_global_stats.nb_tiles--;
-        g_global_stats.mem -= sizeof(*tile->data);
-    }
+    tile_data_release(tile->data);
     tile->data = data;
-    data->ref++;
+    REF_INC(data->ref);
 }
 
 // Copy the data if there are any other tiles having reference to it.
+// Compact data also get expanded into a full voxels array.
 static void tile_prepare_write(tile_t *tile)
 {
-    if (tile->data->ref == 1) {
-        tile->data->id = ++g_uid;
+    int i;
+    tile_data_t *data;
+    if (REF_GET(tile->data->ref) == 1) {
+        tile->data->id = new_uid();
+        tile_data_alloc_voxels(tile->data);
+        tile_data_free_palette(tile->data);
+        tile_data_set_type(tile->data, TILE_DATA_DENSE);
         return;
     }
-    tile->data->ref--;
-    tile_data_t *data;
-    data = calloc(1, sizeof(*tile->data));
-    memcpy(data->voxels, tile->data->voxels, N * N * N * 4);
-    data->ref = 1;
+    data = tile_data_new();
+    data->voxels = pool_alloc(g_voxels_pool);
+    STAT_ADD(mem, TILE_VOXELS_SIZE);
+    STAT_ADD(voxels_mem, TILE_VOXELS_SIZE);
+    for (i = 0; i < N * N * N; i++)
+        memcpy(data->voxels[i], tile_data_voxel(tile->data, i), 4);
+    data->count = tile->data->count;
+    memcpy(data->mask, tile->data->mask, sizeof(data->mask));
+    tile_data_release(tile->data);
     tile->data = data;
-    tile->data->id = ++g_uid;
-
-    g_global_stats.nb_tiles++;
-    g_global_stats.mem += sizeof(*tile->data);
 }
 
 static void tile_get_at(const tile_t *tile, const int pos[3],
@@ -233,6 +565,367 @@ static void tile_get_at(const tile_t *tile, const int pos[3],
     memcpy(out, TILE_AT(tile, x, y, z), 4);
 }
 
+/*
+ * Hash of a tile position, using all the bits of the three coordinates.
+ * Different tiles can get the same hash, so the tiles are ordered by hash
+ * first and then by position.
+ */
+static inline uint64_t tile_pos_hash(const int pos[3])
+{
+    uint64_t k;
+    k = ((uint64_t)(uint32_t)(pos[1] / N) << 32 | (uint32_t)(pos[0] / N)) ^
+        ((uint32_t)(pos[2] / N) * 0x9e3779b97f4a7c15ULL);
+    // Murmur3 finalizer.
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static int pos_cmp(const int a[3], const int b[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : +1;
+    }
+    return 0;
+}
+
+// Compare two tiles keys (hash and position), in the tiles order.
+static int tile_key_cmp(uint64_t ha, const int a[3],
+                        uint64_t hb, const int b[3])
+{
+    if (ha != hb) return ha < hb ? -1 : +1;
+    return pos_cmp(a, b);
+}
+
+// Number of trie levels indexed by the hash.  The nodes at this depth
+// contain the tiles with the same hash.
+#define HASH_LEVELS 11
+
+// Entry index of a hash at a given depth of the trie.  We start from the
+// high bits so that the trie order is the same as the hash order.
+static inline int hash_index(uint64_t h, int level)
+{
+    return level < 10 ? (h >> (58 - 6 * level)) & 63 : h & 15;
+}
+
+// Index into the entries array of a node for a given entry bit.
+static inline int node_entry_index(const node_t *node, uint64_t bit)
+{
+    return __builtin_popcountll(node->bitmap & (bit - 1));
+}
+
+static node_t *node_alloc(int count)
+{
+    node_t *node;
+    node = malloc(sizeof(*node) + count * sizeof(tile_t));
+    node->ref = 1;
+    node->count = count;
+    node->bitmap = 0;
+    STAT_ADD(mem, sizeof(*node) + count * sizeof(tile_t));
+    return node;
+}
+
+static void node_free(node_t *node)
+{
+    STAT_ADD(mem, -(int64_t)(sizeof(*node) + node->count * sizeof(tile_t)));
+    free(node);
+}
+
+static void node_release(node_t *node)
+{
+    int i;
+    if (REF_DEC(node->ref) > 0) return;
+    for (i = 0; i < node->count; i++) {
+        if (node->entries[i].data)
+            tile_data_release(node->entries[i].data);
+        else
+            node_release(node->entries[i].node);
+    }
+    node_free(node);
+}
+
+// Change the number of entries of a node, this can move it.
+static node_t *node_resize(node_t *node, int count)
+{
+    STAT_ADD(mem, (count - node->count) * (int64_t)sizeof(tile_t));
+    node = realloc(node, sizeof(*node) + count * sizeof(tile_t));
+    node->count = count;
+    return node;
+}
+
+// Make sure that a node is not shared, copying it if needed.
+static node_t *node_make_unique(tiles_t *tiles, node_t **pnode)
+{
+    node_t *node = *pnode, *copy;
+    int i;
+    if (REF_GET(node->ref) == 1) return node;
+    copy = node_alloc(node->count);
+    copy->bitmap = node->bitmap;
+    memcpy(copy->entries, node->entries, node->count * sizeof(tile_t));
+    for (i = 0; i < copy->count; i++) {
+        if (copy->entries[i].data)
+            REF_INC(copy->entries[i].data->ref);
+        else
+            REF_INC(copy->entries[i].node->ref);
+    }
+    // The node could have been released by an other volume in between.
+    node_release(node);
+    *pnode = copy;
+    tiles->id = new_uid();
+    return copy;
+}
+
+static tile_t *node_first(node_t *node)
+{
+    while (!node->entries[0].data) node = node->entries[0].node;
+    return &node->entries[0];
+}
+
+/*
+ * Find the first tile with a key greater or equal to (h, pos), or strictly
+ * greater if strict is set.
+ */
+static tile_t *node_lower_bound(node_t *node, int level, uint64_t h,
+                                const int pos[3], bool strict)
+{
+    uint64_t bit;
+    int k, c;
+    tile_t *e, *ret;
+
+    if (level == HASH_LEVELS) {
+        for (k = 0; k < node->count; k++) {
+            c = pos_cmp(node->entries[k].pos, pos);
+            if (c > 0 || (c == 0 && !strict)) return &node->entries[k];
+        }
+        return NULL;
+    }
+    bit = 1ULL << hash_index(h, level);
+    k = node_entry_index(node, bit);
+    if (node->bitmap & bit) {
+        e = &node->entries[k++];
+        if (e->data) {
+            c = tile_key_cmp(tile_pos_hash(e->pos), e->pos, h, pos);
+            if (c > 0 || (c == 0 && !strict)) return e;
+        } else {
+            ret = node_lower_bound(e->node, level + 1, h, pos, strict);
+            if (ret) return ret;
+        }
+    }
+    if (k == node->count) return NULL;
+    e = &node->entries[k];
+    return e->data ? e : node_first(e->node);
+}
+
+static tiles_t *tiles_new(void)
+{
+    tiles_t *tiles = calloc(1, sizeof(*tiles));
+    tiles->ref = 1;
+    tiles->id = new_uid();
+    STAT_ADD(nb_volumes, +1);
+    return tiles;
+}
+
+static void tiles_release(tiles_t *tiles)
+{
+    if (REF_DEC(tiles->ref) > 0) return;
+    if (tiles->root) node_release(tiles->root);
+    free(tiles);
+    STAT_ADD(nb_volumes, -1);
+}
+
+/*
+ * Create a new tiles map sharing all its nodes with an other one.
+ * The original map gets a new id, since the accessors using it cannot
+ * modify its tiles in place anymore.
+ */
+static tiles_t *tiles_fork(tiles_t *other)
+{
+    tiles_t *tiles = tiles_new();
+    tiles->count = other->count;
+    tiles->root = other->root;
+    if (tiles->root) REF_INC(tiles->root->ref);
+    __atomic_store_n(&other->id, new_uid(), __ATOMIC_RELAXED);
+    return tiles;
+}
+
+// The id of a shared map can be changed by a fork from an other thread.
+static uint64_t tiles_get_id(const tiles_t *tiles)
+{
+    return __atomic_load_n(&tiles->id, __ATOMIC_RELAXED);
+}
+
+static tile_t *tiles_find(const tiles_t *tiles, const int pos[3])
+{
+    uint64_t h = tile_pos_hash(pos), bit;
+    const node_t *node = tiles->root;
+    tile_t *e;
+    int level, k;
+
+    for (level = 0; node; level++) {
+        if (level == HASH_LEVELS) {
+            for (k = 0; k < node->count; k++) {
+                e = (tile_t*)&node->entries[k];
+                if (vec3_equal(e->pos, pos)) return e;
+            }
+            return NULL;
+        }
+        bit = 1ULL << hash_index(h, level);
+        if (!(node->bitmap & bit)) return NULL;
+        e = (tile_t*)&node->entries[node_entry_index(node, bit)];
+        if (e->data) return vec3_equal(e->pos, pos) ? e : NULL;
+        node = e->node;
+    }
+    return NULL;
+}
+
+/*
+ * Find the first tile with a key (hash and position) greater or equal to
+ * (*h, pos), or strictly greater if strict is set, and set the key to the
+ * one of the tile.  We use it to iterate the tiles in order: since we
+ * only keep the key of the current tile, it is safe to modify the tiles
+ * during an iteration.
+ */
+static tile_t *tiles_lower_bound(const tiles_t *tiles, uint64_t *h,
+                                 int pos[3], bool strict)
+{
+    tile_t *tile;
+    if (!tiles->root) return NULL;
+    tile = node_lower_bound(tiles->root, 0, *h, pos, strict);
+    if (!tile) return NULL;
+    *h = tile_pos_hash(tile->pos);
+    vec3_copy(tile->pos, pos);
+    return tile;
+}
+
+static tile_t *tiles_first(const tiles_t *tiles, uint64_t *h, int pos[3])
+{
+    *h = 0;
+    pos[0] = pos[1] = pos[2] = INT_MIN;
+    return tiles_lower_bound(tiles, h, pos, false);
+}
+
+// Return the tile following the one of key (*h, pos).
+static tile_t *tiles_next(const tiles_t *tiles, uint64_t *h, int pos[3])
+{
+    return tiles_lower_bound(tiles, h, pos, true);
+}
+
+// Insert a new empty tile at a given entry index of a node.
+static tile_t *node_insert(tiles_t *tiles, node_t **pnode, int k,
+                           const int pos[3])
+{
+    node_t *node = *pnode = node_resize(*pnode, (*pnode)->count + 1);
+    tile_t *e;
+    memmove(&node->entries[k + 1], &node->entries[k],
+            (node->count - k - 1) * sizeof(tile_t));
+    e = &node->entries[k];
+    e->data = get_empty_data();
+    REF_INC(e->data->ref);
+    vec3_copy(pos, e->pos);
+    tiles->count++;
+    tiles->id = new_uid();
+    return e;
+}
+
+/*
+ * Get a tile that we can modify, copying all the shared nodes on its path.
+ * If create is set, add a new empty tile if needed.
+ */
+static tile_t *tiles_get_mut(tiles_t *tiles, const int pos[3], bool create)
+{
+    uint64_t h = tile_pos_hash(pos), bit;
+    node_t **pnode = &tiles->root, *node, *sub;
+    tile_t *e;
+    int level, k;
+
+    if (!tiles->root) {
+        if (!create) return NULL;
+        tiles->root = node_alloc(0);
+    }
+    for (level = 0; ; level++) {
+        node = node_make_unique(tiles, pnode);
+        if (level == HASH_LEVELS) {
+            for (k = 0; k < node->count; k++) {
+                e = &node->entries[k];
+                if (vec3_equal(e->pos, pos)) return e;
+                if (pos_cmp(e->pos, pos) > 0) break;
+            }
+            if (!create) return NULL;
+            return node_insert(tiles, pnode, k, pos);
+        }
+        bit = 1ULL << hash_index(h, level);
+        k = node_entry_index(node, bit);
+        if (!(node->bitmap & bit)) {
+            if (!create) return NULL;
+            (*pnode)->bitmap |= bit;
+            return node_insert(tiles, pnode, k, pos);
+        }
+        e = &node->entries[k];
+        if (!e->data) {
+            pnode = &e->node;
+            continue;
+        }
+        if (vec3_equal(e->pos, pos)) return e;
+        if (!create) return NULL;
+        // Push the existing tile into a new sub node.
+        sub = node_alloc(1);
+        if (level + 1 < HASH_LEVELS)
+            sub->bitmap = 1ULL << hash_index(tile_pos_hash(e->pos), level + 1);
+        sub->entries[0] = *e;
+        e->data = NULL;
+        e->node = sub;
+        tiles->id = new_uid();
+        pnode = &e->node;
+    }
+}
+
+static void node_remove(tiles_t *tiles, node_t **pnode, int level,
+                        uint64_t h, const int pos[3])
+{
+    node_t *node = node_make_unique(tiles, pnode), *sub;
+    uint64_t bit = 0;
+    int k;
+    tile_t *e;
+
+    if (level == HASH_LEVELS) {
+        for (k = 0; !vec3_equal(node->entries[k].pos, pos); k++) {}
+    } else {
+        bit = 1ULL << hash_index(h, level);
+        k = node_entry_index(node, bit);
+    }
+    e = &node->entries[k];
+    if (!e->data) {
+        node_remove(tiles, &e->node, level + 1, h, pos);
+        // Replace the sub node by its tile if only one is left.
+        sub = e->node;
+        if (sub->count == 1 && sub->entries[0].data) {
+            *e = sub->entries[0];
+            node_free(sub);
+        }
+        return;
+    }
+    tile_data_release(e->data);
+    memmove(e, e + 1, (node->count - k - 1) * sizeof(tile_t));
+    node->bitmap &= ~bit;
+    *pnode = node_resize(node, node->count - 1);
+}
+
+static void tiles_remove(tiles_t *tiles, const int pos[3])
+{
+    if (!tiles_find(tiles, pos)) return;
+    node_remove(tiles, &tiles->root, 0, tile_pos_hash(pos), pos);
+    tiles->count--;
+    tiles->id = new_uid();
+    if (tiles->count == 0) {
+        node_release(tiles->root);
+        tiles->root = NULL;
+    }
+}
+
 /*
  * Function: volume_get_bbox
  *
@@ -253,33 +946,24 @@ static void tile_get_at(const tile_t *tile, const int pos[3],
  */
 bool volume_get_bbox(const volume_t *volume, int bbox[2][3], bool exact)
 {
-    tile_t *tile;
+    const tile_t *tile;
+    int j, tile_bbox[2][3], hpos[3];
     int ret[2][3] = {{INT_MAX, INT_MAX, INT_MAX},
                      {INT_MIN, INT_MIN, INT_MIN}};
-    int pos[3];
-    volume_iterator_t iter;
     bool empty = false;
-
-    if (!exact) {
-        for (tile = volume->tiles; tile; tile = tile->hh.next) {
-            if (tile_is_empty(tile, true)) continue;
-            ret[0][0] = min(ret[0][0], tile->pos[0]);
-            ret[0][1] = min(ret[0][1], tile->pos[1]);
-            ret[0][2] = min(ret[0][2], tile->pos[2]);
-            ret[1][0] = max(ret[1][0], tile->pos[0] + N);
-            ret[1][1] = max(ret[1][1], tile->pos[1] + N);
-            ret[1][2] = max(ret[1][2], tile->pos[1] + N);
+    uint64_t h;
+
+    for (tile = tiles_first(volume->tiles, &h, hpos); tile;
+         tile = tiles_next(volume->tiles, &h, hpos)) {
+        if (tile_is_empty(tile)) continue;
+        if (exact) {
+            tile_get_bbox(tile, tile_bbox);
+        } else {
+            volume_get_tile_aabb(tile->pos, tile_bbox);
         }
-    } else {
-        iter = volume_get_iterator(volume, VOLUME_ITER_SKIP_EMPTY);
-        while (volume_iter(&iter, pos)) {
-            if (!volume_get_alpha_at(volume, &iter, pos)) continue;
-            ret[0][0] = min(ret[0][0], pos[0]);
-            ret[0][1] = min(ret[0][1], pos[1]);
-            ret[0][2] = min(ret[0][2], pos[2]);
-            ret[1][0] = max(ret[1][0], pos[0] + 1);
-            ret[1][1] = max(ret[1][1], pos[1] + 1);
-            ret[1][2] = max(ret[1][2], pos[2] + 1);
+        for (j = 0; j < 3; j++) {
+            ret[0][j] = min(ret[0][j], tile_bbox[0][j]);
+            ret[1][j] = max(ret[1][j], tile_bbox[1][j]);
         }
     }
     empty = ret[0][0] >= ret[1][0];
@@ -290,63 +974,69 @@ bool volume_get_bbox(const volume_t *volume, int bbox[2][3], bool exact)
 
 static void volume_prepare_write(volume_t *volume)
 {
-    tile_t *tiles, *tile, *new_tile;
-    assert(*volume->tiles_ref > 0);
-    volume->key = g_uid++;
-    if (*volume->tiles_ref == 1)
+    tiles_t *tiles;
+    assert(REF_GET(volume->tiles->ref) > 0);
+    volume->key = new_uid();
+    if (REF_GET(volume->tiles->ref) == 1)
         return;
-    (*volume->tiles_ref)--;
-    volume->tiles_ref = calloc(1, sizeof(*volume->tiles_ref));
-    *volume->tiles_ref = 1;
-    tiles = volume->tiles;
-    volume->tiles = NULL;
-    for (tile = tiles; tile; tile = tile->hh.next) {
-        tile->id = g_uid++; // Invalidate all accessors.
-        new_tile = tile_copy(tile);
-        HASH_ADD(hh, volume->tiles, pos, sizeof(new_tile->pos), new_tile);
-    }
-    g_global_stats.nb_volumes++;
+    // The copy gets a new id, which invalidates all the accessors.
+    tiles = tiles_fork(volume->tiles);
+    tiles_release(volume->tiles);
+    volume->tiles = tiles;
 }
 
-static tile_t *volume_add_tile(volume_t *volume, const int pos[3]);
-
-static void volume_add_neighbors_tiles(volume_t *volume)
+/*
+ * Store a tile using the most compact representation.  This doesn't change
+ * the content of the volume, so we keep the volume key and the data id.
+ */
+static void volume_compact_tile(volume_t *volume, const tile_t *tile)
 {
-    const int POS[6][3] = {
-        {0, 0, -1}, {0, 0, +1},
-        {0, -1, 0}, {0, +1, 0},
-        {-1, 0, 0}, {+1, 0, 0},
-    };
-    int i, p[3] = {};
+    uint32_t palette[TILE_PALETTE_MAX];
+    uint16_t indices[N * N * N];
+    int nb = 0, pos[3];
     uint64_t key = volume->key;
-    tile_t *tile, *tmp, *other;
+    tile_t *mut;
+    tile_data_t *data;
 
-    volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        if (tile_is_empty(tile, true)) continue;
-        for (i = 0; i < 6; i++) {
-            p[0] = tile->pos[0] + POS[i][0] * N;
-            p[1] = tile->pos[1] + POS[i][1] * N;
-            p[2] = tile->pos[2] + POS[i][2] * N;
-            HASH_FIND(hh, volume->tiles, p, 3 * sizeof(int), other);
-            if (!other) volume_add_tile(volume, p);
-        }
+    if (tile->data->type == TILE_DATA_DENSE) {
+        nb = tile_data_get_palette(tile->data, palette, indices);
+        if (nb == 0) return;
+    } else if (!__atomic_load_n(&tile->data->voxels, __ATOMIC_ACQUIRE) ||
+               REF_GET(tile->data->ref) > 1) {
+        // Nothing to release, or the voxels could be used by an other tile.
+        return;
     }
-    // Adding empty tiles shouldn't change the key of the volume.
+    vec3_copy(tile->pos, pos);
+    volume_prepare_write(volume);
     volume->key = key;
+    mut = tiles_get_mut(volume->tiles, pos, false);
+    data = mut->data;
+    if (REF_GET(data->ref) > 1) {
+        if (!nb) return;
+        // Shared data: replace it with a compact copy.
+        data = tile_data_new();
+        data->id = mut->data->id;
+        data->count = mut->data->count;
+        memcpy(data->mask, mut->data->mask, sizeof(data->mask));
+        tile_data_release(mut->data);
+        mut->data = data;
+    }
+    if (nb) tile_data_set_palette(data, nb, palette, indices);
+    tile_data_free_voxels(data);
 }
 
-void volume_remove_empty_tiles(volume_t *volume, bool fast)
+void volume_remove_empty_tiles(volume_t *volume)
 {
-    tile_t *tile, *tmp;
-    uint64_t key = volume->key;
+    tile_t *tile;
+    uint64_t key = volume->key, h;
+    int pos[3];
     volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        if (tile_is_empty(tile, false)) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
+    // The iteration key is a copy of the tile position, so we can remove
+    // the tile.
+    for (tile = tiles_first(volume->tiles, &h, pos); tile;
+         tile = tiles_next(volume->tiles, &h, pos)) {
+        if (!tile_is_empty(tile)) continue;
+        tiles_remove(volume->tiles, pos);
     }
     // Empty tiles shouldn't change the key of the volume.
     volume->key = key;
@@ -354,7 +1044,7 @@ void volume_remove_empty_tiles(volume_t *volume, bool fast)
 
 bool volume_is_empty(const volume_t *volume)
 {
-    return volume == NULL || volume->tiles == NULL;
+    return volume == NULL || volume->tiles->count == 0;
 }
 
 volume_t *volume_new(void)
@@ -362,17 +1052,15 @@ volume_t *volume_new(void)
     volume_t *volume;
     volume = calloc(1, sizeof(*volume));
     volume->ref = 1;
-    volume->tiles_ref = calloc(1, sizeof(*volume->tiles_ref));
+    volume->tiles = tiles_new();
     volume->key = 1; // Empty volume key.
-    *volume->tiles_ref = 1;
-    g_global_stats.nb_volumes++;
     return volume;
 }
 
 volume_t *volume_dup(const volume_t *volume)
 {
     volume_t *ret = (volume_t*)volume;
-    ret->ref++;
+    REF_INC(ret->ref);
     return ret;
 }
 
@@ -422,32 +1110,16 @@ volume_accessor_t volume_get_accessor(const volume_t *volume)
 void volume_clear(volume_t *volume)
 {
     assert(volume);
-    tile_t *tile, *tmp;
-    volume_prepare_write(volume);
-    HASH_ITER(hh, volume->tiles, tile, tmp) {
-        HASH_DEL(volume->tiles, tile);
-        assert(volume->tiles != tile);
-        tile_delete(tile);
-    }
+    tiles_release(volume->tiles);
+    volume->tiles = tiles_new();
     volume->key = 1; // Empty volume key.
-    volume->tiles = NULL;
 }
 
 void volume_delete(volume_t *volume)
 {
-    tile_t *tile, *tmp;
     if (!volume) return;
-    if (--volume->ref > 0) return;
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    if (REF_DEC(volume->ref) > 0) return;
+    tiles_release(volume->tiles);
     free(volume);
 }
 
@@ -459,36 +1131,26 @@ volume_t *volume_copy(const volume_t *volume)
     ret = calloc(1, sizeof(*volume));
     ret->ref = 1;
     ret->tiles = volume->tiles;
-    ret->tiles_ref = volume->tiles_ref;
     ret->key = volume->key;
-    (*ret->tiles_ref)++;
+    REF_INC(ret->tiles->ref);
     return ret;
 }
 
 void volume_set(volume_t *volume, const volume_t *other)
 {
-    tile_t *tile, *tmp;
     assert(volume && other);
     if (volume->tiles == other->tiles) return; // Already the same.
-    (*volume->tiles_ref)--;
-    if (*volume->tiles_ref == 0) {
-        HASH_ITER(hh, volume->tiles, tile, tmp) {
-            HASH_DEL(volume->tiles, tile);
-            assert(volume->tiles != tile);
-            tile_delete(tile);
-        }
-        free(volume->tiles_ref);
-        g_global_stats.nb_volumes--;
-    }
+    REF_INC(other->tiles->ref);
+    tiles_release(volume->tiles);
     volume->tiles = other->tiles;
-    volume->tiles_ref = other->tiles_ref;
     volume->key = other->key;
-    (*volume->tiles_ref)++;
 }
 
-static uint64_t get_tile_id(const tile_t *tile)
+// Check if the tile cached in an accessor is still valid.
+static inline bool accessor_is_valid(const volume_t *volume,
+                                     const volume_accessor_t *it)
 {
-    return tile ? tile->id : 1;
+    return it->tile_id && it->tile_id == tiles_get_id(volume->tiles);
 }
 
 static tile_t *volume_get_tile_at(const volume_t *volume, const int pos[3],
@@ -499,42 +1161,25 @@ static tile_t *volume_get_tile_at(const volume_t *volume, const int pos[3],
     p[0] = pos[0] & ~(int)(N - 1);
     p[1] = pos[1] & ~(int)(N - 1);
     p[2] = pos[2] & ~(int)(N - 1);
-    if (!it) {
-        HASH_FIND(hh, volume->tiles, p, sizeof(p), tile);
-        return tile;
-    }
+    if (!it) return tiles_find(volume->tiles, p);
 
-    if (    it->tile_id && it->tile_id == get_tile_id(it->tile) &&
-            vec3_equal(it->tile_pos, p)) {
+    if (accessor_is_valid(volume, it) && vec3_equal(it->tile_pos, p))
         return it->tile;
-    }
-    HASH_FIND(hh, volume->tiles, p, sizeof(p), tile);
+    tile = tiles_find(volume->tiles, p);
     it->tile = tile;
-    it->tile_id = get_tile_id(tile);
+    it->tile_id = tiles_get_id(volume->tiles);
+    it->flags &= ~VOLUME_ITER_WRITABLE;
     vec3_copy(p, it->tile_pos);
     return tile;
 }
 
-static tile_t *volume_add_tile(volume_t *volume, const int pos[3])
-{
-    tile_t *tile;
-    assert(pos[0] % TILE_SIZE == 0);
-    assert(pos[1] % TILE_SIZE == 0);
-    assert(pos[2] % TILE_SIZE == 0);
-    assert(!volume_get_tile_at(volume, pos, NULL));
-    volume_prepare_write(volume);
-    tile = tile_new(pos);
-    HASH_ADD(hh, volume->tiles, pos, sizeof(tile->pos), tile);
-    return tile;
-}
-
 void volume_get_at(const volume_t *volume, volume_iterator_t *it,
                  const int pos[3], uint8_t out[4])
 {
     tile_t *tile;
     int p[3];
 
-    if (it && it->tile_id && it->tile_id == get_tile_id(it->tile)) {
+    if (it && accessor_is_valid(volume, it)) {
         p[0] = pos[0] - it->tile_pos[0];
         p[1] = pos[1] - it->tile_pos[1];
         p[2] = pos[2] - it->tile_pos[2];
@@ -559,15 +1204,19 @@ void volume_set_at(volume_t *volume, volume_iterator_t *iter,
     int p[3] = {pos[0] & ~(int)(N - 1),
                 pos[1] & ~(int)(N - 1),
                 pos[2] & ~(int)(N - 1)};
+    tile_t *tile;
     volume_prepare_write(volume);
 
-    tile_t *tile = volume_get_tile_at(volume, p, iter);
-
-    if (!tile) {
-        tile = volume_add_tile(volume, p);
+    if (    iter && (iter->flags & VOLUME_ITER_WRITABLE) &&
+            accessor_is_valid(volume, iter) &&
+            vec3_equal(iter->tile_pos, p)) {
+        tile = iter->tile;
+    } else {
+        tile = tiles_get_mut(volume->tiles, p, true);
         if (iter) {
             iter->tile = tile;
-            iter->tile_id = get_tile_id(tile);
+            iter->tile_id = tiles_get_id(volume->tiles);
+            iter->flags |= VOLUME_ITER_WRITABLE;
             vec3_copy(p, iter->tile_pos);
         }
     }
@@ -579,18 +1228,17 @@ void volume_set_at(volume_t *volume, volume_iterator_t *iter,
     assert(p[0] >= 0 && p[0] < N);
     assert(p[1] >= 0 && p[1] < N);
     assert(p[2] >= 0 && p[2] < N);
-    memcpy(TILE_AT(tile, p[0], p[1], p[2]), v, 4);
+    memcpy(DATA_AT(tile->data, p[0], p[1], p[2]), v, 4);
+    tile_data_update_mask(tile->data, p[0] + p[1] * N + p[2] * N * N, v[3]);
 }
 
 void volume_clear_tile(volume_t *volume, volume_iterator_t *it, const int pos[3])
 {
-    tile_t *tile;
+    int p[3] = {pos[0] & ~(int)(N - 1),
+                pos[1] & ~(int)(N - 1),
+                pos[2] & ~(int)(N - 1)};
     volume_prepare_write(volume);
-    tile = volume_get_tile_at(volume, pos, it);
-    if (!tile) return;
-    HASH_DEL(volume->tiles, tile);
-    assert(volume->tiles != tile);
-    tile_delete(tile);
+    tiles_remove(volume->tiles, p);
     if (it) it->tile = NULL;
 }
 
@@ -614,49 +1262,171 @@ static bool volume_iter_next_tile_box(volume_iterator_t *it)
     if (i == 3) return false;
 
 end:
-    HASH_FIND(hh, volume->tiles, it->tile_pos, 3 * sizeof(int), it->tile);
-    it->tile_id = get_tile_id(it->tile);
+    it->tile = tiles_find(volume->tiles, it->tile_pos);
+    it->tile_id = tiles_get_id(volume->tiles);
+    it->flags &= ~VOLUME_ITER_WRITABLE;
     vec3_copy(it->tile_pos, it->pos);
     return true;
 }
 
+/*
+ * Move the iterator to the next tile of a volume, in the tiles hash order.
+ * It is safe to add or remove tiles during an iteration.
+ */
+static bool volume_iter_next_map_tile(volume_iterator_t *it,
+                                      const volume_t *volume, bool first)
+{
+    tile_t *tile;
+    if (first)
+        tile = tiles_first(volume->tiles, &it->tile_key, it->tile_key_pos);
+    else
+        tile = tiles_next(volume->tiles, &it->tile_key, it->tile_key_pos);
+    if (!tile) return false;
+    it->tile = tile;
+    it->tile_id = tiles_get_id(volume->tiles);
+    it->flags &= ~VOLUME_ITER_WRITABLE;
+    vec3_copy(tile->pos, it->tile_pos);
+    vec3_copy(tile->pos, it->pos);
+    return true;
+}
+
 static bool volume_iter_next_tile_union(volume_iterator_t *it)
 {
-    it->tile = it->tile ? it->tile->hh.next : it->volume->tiles;
-    if (!it->tile && !(it->flags & VOLUME_ITER_VOLUME2)) {
-        it->tile = it->volume2->tiles;
+    bool first = !it->tile_id;
+    if (!(it->flags & VOLUME_ITER_VOLUME2)) {
+        if (volume_iter_next_map_tile(it, it->volume, first)) return true;
         it->flags |= VOLUME_ITER_VOLUME2;
+        first = true;
     }
-    if (!it->tile) return false;
-    it->tile_id = it->tile->id;
-    vec3_copy(it->tile->pos, it->tile_pos);
-    vec3_copy(it->tile->pos, it->pos);
+    while (volume_iter_next_map_tile(it, it->volume2, first)) {
+        first = false;
+        // Discard tiles that we already did from the first volume.
+        if (!tiles_find(it->volume->tiles, it->tile_pos)) return true;
+    }
+    return false;
+}
+
+static const int NEIGHBORS_DIRS[6][3] = {
+    {0, 0, -1}, {0, 0, +1},
+    {0, -1, 0}, {0, +1, 0},
+    {-1, 0, 0}, {+1, 0, 0},
+};
 
-    // Discard tiles that we already did from the first volume.
-    if (it->flags & VOLUME_ITER_VOLUME2) {
-        if (volume_get_tile_at(it->volume, it->tile_pos, NULL))
-            return volume_iter_next_tile_union(it);
+/*
+ * Move the iterator to the next missing tile adjacent to a non empty tile.
+ * To avoid yielding the same position several times without keeping track
+ * of the visited positions, we only yield a position from the first non
+ * empty adjacent tile in the tiles hash order.
+ */
+static bool volume_iter_next_neighbor(volume_iterator_t *it, bool first)
+{
+    const tiles_t *tiles = it->volume->tiles;
+    const tile_t *tile, *other;
+    int i, p[3], q[3];
+    uint64_t h;
+
+    if (first) it->tile_dir = 5;
+    while (true) {
+        if (++it->tile_dir == 6) {
+            it->tile_dir = 0;
+            if (first)
+                tile = tiles_first(tiles, &it->tile_key, it->tile_key_pos);
+            else
+                tile = tiles_next(tiles, &it->tile_key, it->tile_key_pos);
+            first = false;
+            while (tile && tile_is_empty(tile))
+                tile = tiles_next(tiles, &it->tile_key, it->tile_key_pos);
+            if (!tile) return false;
+        } else {
+            h = it->tile_key;
+            vec3_copy(it->tile_key_pos, q);
+            tile = tiles_lower_bound(tiles, &h, q, false);
+            if (!tile) return false;
+        }
+        for (i = 0; i < 3; i++)
+            p[i] = tile->pos[i] + NEIGHBORS_DIRS[it->tile_dir][i] * N;
+        if (tiles_find(tiles, p)) continue;
+        for (i = 0; i < 6; i++) {
+            q[0] = p[0] + NEIGHBORS_DIRS[i][0] * N;
+            q[1] = p[1] + NEIGHBORS_DIRS[i][1] * N;
+            q[2] = p[2] + NEIGHBORS_DIRS[i][2] * N;
+            other = tiles_find(tiles, q);
+            if (    other && !tile_is_empty(other) &&
+                    tile_key_cmp(tile_pos_hash(other->pos), other->pos,
+                                 it->tile_key, it->tile_key_pos) < 0)
+                break;
+        }
+        if (i == 6) break;
     }
+    it->tile = NULL;
+    it->tile_id = tiles_get_id(tiles);
+    it->flags &= ~VOLUME_ITER_WRITABLE;
+    vec3_copy(p, it->tile_pos);
+    vec3_copy(p, it->pos);
     return true;
 }
 
+static bool volume_iter_next_tile_plain(volume_iterator_t *it)
+{
+    if (it->flags & VOLUME_ITER_NEIGHBORS)
+        return volume_iter_next_neighbor(it, false);
+    if (volume_iter_next_map_tile(it, it->volume, !it->tile_id)) return true;
+    if (!(it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)) return false;
+    it->flags |= VOLUME_ITER_NEIGHBORS;
+    return volume_iter_next_neighbor(it, true);
+}
+
+// Test if we skip the empty tiles and voxels.  Not supported for unions.
+static bool volume_iter_skip_empty(const volume_iterator_t *it)
+{
+    return (it->flags & VOLUME_ITER_SKIP_EMPTY) && !it->volume2;
+}
+
 static bool volume_iter_next_tile(volume_iterator_t *it)
 {
-    if (it->tile_id && it->tile_id != get_tile_id(it->tile)) {
-        it->tile = volume_get_tile_at(
-            (it->flags & VOLUME_ITER_VOLUME2) ? it->volume2 : it->volume,
-            it->tile_pos,
-            it);
+    int i;
+    bool ret;
+    while (true) {
+        if (it->flags & VOLUME_ITER_BOX)
+            ret = volume_iter_next_tile_box(it);
+        else if (it->volume2)
+            ret = volume_iter_next_tile_union(it);
+        else
+            ret = volume_iter_next_tile_plain(it);
+        if (!ret) return false;
+        if (!volume_iter_skip_empty(it)) return true;
+        if (!tile_is_empty(it->tile)) break;
     }
+    // Move to the first non empty voxel of the tile.
+    if (!(it->flags & VOLUME_ITER_TILES)) {
+        i = tile_next_voxel(it->tile, 0);
+        it->pos[0] = it->tile_pos[0] + i % N;
+        it->pos[1] = it->tile_pos[1] + i / N % N;
+        it->pos[2] = it->tile_pos[2] + i / (N * N);
+    }
+    return true;
+}
 
-    if (it->flags & VOLUME_ITER_BOX) return volume_iter_next_tile_box(it);
-    if (it->volume2) return volume_iter_next_tile_union(it);
-
-    it->tile = it->tile ? it->tile->hh.next : it->volume->tiles;
+// Move to the next non empty voxel using the tile occupancy mask.
+static bool volume_iter_next_voxel_skip_empty(volume_iterator_t *it)
+{
+    int i;
+    // The tiles might have changed if we wrote into the volume during the
+    // iteration, in that case we need to find the tile again.
+    if (!accessor_is_valid(it->volume, it)) {
+        it->tile = tiles_find(it->volume->tiles, it->tile_pos);
+        it->tile_id = tiles_get_id(it->volume->tiles);
+        it->flags &= ~VOLUME_ITER_WRITABLE;
+    }
     if (!it->tile) return false;
-    it->tile_id = it->tile->id;
-    vec3_copy(it->tile->pos, it->tile_pos);
-    vec3_copy(it->tile->pos, it->pos);
+    i = (it->pos[0] - it->tile_pos[0]) +
+        (it->pos[1] - it->tile_pos[1]) * N +
+        (it->pos[2] - it->tile_pos[2]) * N * N;
+    i = tile_next_voxel(it->tile, i + 1);
+    if (i < 0) return false;
+    it->pos[0] = it->tile_pos[0] + i % N;
+    it->pos[1] = it->tile_pos[1] + i / N % N;
+    it->pos[2] = it->tile_pos[2] + i / (N * N);
     return true;
 }
 
@@ -664,15 +1434,16 @@ int volume_iter(volume_iterator_t *it, int pos[3])
 {
     int i;
     if (!it->tile_id) { // First call.
-        // XXX: this is not good: volume_iter shouldn't make change to the
-        // volume.
-        if (it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)
-            volume_add_neighbors_tiles((volume_t*)it->volume);
         if (!volume_iter_next_tile(it)) return 0;
         goto end;
     }
     if (it->flags & VOLUME_ITER_TILES) goto next_tile;
 
+    if (volume_iter_skip_empty(it)) {
+        if (volume_iter_next_voxel_skip_empty(it)) goto end;
+        goto next_tile;
+    }
+
     for (i = 0; i < 3; i++) {
         if (++it->pos[i] < it->tile_pos[i] + N) break;
         it->pos[i] = it->tile_pos[i];
@@ -680,13 +1451,7 @@ int volume_iter(volume_iterator_t *it, int pos[3])
     if (i < 3) goto end;
 
 next_tile:
-    if (!volume_iter_next_tile(it)) {
-        // XXX: this is not good: volume_iter shouldn't make changes to the
-        // volume.
-        if (it->flags & VOLUME_ITER_INCLUDES_NEIGHBORS)
-            volume_remove_empty_tiles((volume_t*)it->volume, true);
-        return 0;
-    }
+    if (!volume_iter_next_tile(it)) return 0;
 
 end:
     if (pos) vec3_copy(it->pos, pos);
@@ -698,20 +1463,22 @@ uint64_t volume_get_key(const volume_t *volume)
     return volume ? volume->key : 0;
 }
 
-void *volume_get_tile_data(const volume_t *volume, volume_accessor_t *iter,
-                          const int bpos[3], uint64_t *id)
+uint64_t volume_get_tile_id(const volume_t *volume, const int bpos[3])
 {
-    tile_t *tile = NULL;
-    if (    iter &&
-            iter->tile_id &&
-            iter->tile_id == get_tile_id(iter->tile) &&
-            memcmp(&iter->pos, bpos, sizeof(iter->pos)) == 0) {
-        tile = iter->tile;
-    } else {
-        HASH_FIND(hh, volume->tiles, bpos, sizeof(iter->pos), tile);
+    const tile_t *tile = tiles_find(volume->tiles, bpos);
+    return tile ? tile->data->id : 0;
+}
+
+int volume_get_tile_mask(const volume_t *volume, const int bpos[3],
+                         uint64_t mask[TILE_MASK_SIZE])
+{
+    const tile_t *tile = tiles_find(volume->tiles, bpos);
+    if (!tile) {
+        memset(mask, 0, TILE_MASK_SIZE * sizeof(*mask));
+        return 0;
     }
-    if (id) *id = tile ? tile->data->id : 0;
-    return tile ? tile->data->voxels : NULL;
+    memcpy(mask, tile->data->mask, TILE_MASK_SIZE * sizeof(*mask));
+    return tile->data->count;
 }
 
 uint8_t volume_get_alpha_at(const volume_t *volume, volume_iterator_t *iter,
@@ -725,106 +1492,207 @@ uint8_t volume_get_alpha_at(const volume_t *volume, volume_iterator_t *iter,
 void volume_copy_tile(const volume_t *src, const int src_pos[3],
                      volume_t *dst, const int dst_pos[3])
 {
-    tile_t *b1, *b2;
+    tile_t *tile;
+    tile_data_t *data;
     volume_prepare_write(dst);
-    b1 = volume_get_tile_at(src, src_pos, NULL);
-    b2 = volume_get_tile_at(dst, dst_pos, NULL);
-    if (!b2) b2 = volume_add_tile(dst, dst_pos);
-    tile_set_data(b2, b1->data);
+    // Keep a reference to the data, since src could be the same as dst.
+    data = volume_get_tile_at(src, src_pos, NULL)->data;
+    REF_INC(data->ref);
+    tile = tiles_get_mut(dst->tiles, dst_pos, true);
+    tile_set_data(tile, data);
+    tile_data_release(data);
 }
 
-void volume_read(const volume_t *volume,
-               const int pos[3], const int size[3],
-               uint8_t *data)
-{
-    // For the moment we only support the case where we get the rectangle
-    // of a tile plus a one voxel border around it!
-    assert(pos[0] - (pos[0] & ~(int)(N - 1)) == N - 1);
-    assert(pos[1] - (pos[1] & ~(int)(N - 1)) == N - 1);
-    assert(pos[2] - (pos[2] & ~(int)(N - 1)) == N - 1);
-    assert(size[0] == N + 2);
-    assert(size[1] == N + 2);
-    assert(size[2] == N + 2);
+// Strides of a packed xyz buffer covering a box, in bytes.
+static void region_get_strides(const int aabb[2][3], const int strides[3],
+                               int out[3])
+{
+    if (strides) {
+        memcpy(out, strides, 3 * sizeof(int));
+        return;
+    }
+    out[0] = 4;
+    out[1] = 4 * (aabb[1][0] - aabb[0][0]);
+    out[2] = out[1] * (aabb[1][1] - aabb[0][1]);
+}
+
+// Iter the positions of all the tiles intersecting a box.
+#define REGION_ITER_TILES(aabb, pos) \
+    for (pos[2] = aabb[0][2] & ~(int)(N - 1); pos[2] < aabb[1][2]; \
+         pos[2] += N) \
+    for (pos[1] = aabb[0][1] & ~(int)(N - 1); pos[1] < aabb[1][1]; \
+         pos[1] += N) \
+    for (pos[0] = aabb[0][0] & ~(int)(N - 1); pos[0] < aabb[1][0]; \
+         pos[0] += N)
+
+// Compute the part of a tile inside a box, in tile local coordinates.
+static void region_clip_tile(const int aabb[2][3], const int pos[3],
+                             int a[3], int b[3])
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        a[i] = max(aabb[0][i], pos[i]) - pos[i];
+        b[i] = min(aabb[1][i], pos[i] + N) - pos[i];
+    }
+}
+
+// Copy n voxels of a data, starting at index i, into a buffer.
+static void tile_data_read_row(const tile_data_t *data, int i, int n,
+                               uint8_t *dst, int stride)
+{
+    int k;
+    if (data->type == TILE_DATA_DENSE && stride == 4) {
+        memcpy(dst, data->voxels[i], n * 4);
+        return;
+    }
+    for (k = 0; k < n; k++, dst += stride)
+        memcpy(dst, tile_data_voxel(data, i + k), 4);
+}
+
+// Copy n voxels from a buffer into a dense data, starting at index i.
+static void tile_data_write_row(tile_data_t *data, int i, int n,
+                                const uint8_t *src, int stride)
+{
+    int k;
+    assert(data->type == TILE_DATA_DENSE);
+    if (stride == 4) memcpy(data->voxels[i], src, n * 4);
+    for (k = 0; k < n; k++, src += stride) {
+        if (stride != 4) memcpy(data->voxels[i + k], src, 4);
+        tile_data_update_mask(data, i + k, src[3]);
+    }
+}
+
+void volume_read_region(const volume_t *volume, const int aabb[2][3],
+                        uint8_t *data, const int strides[3])
+{
+    int s[3], pos[3], a[3], b[3], y, z;
+    const tile_t *tile;
+    const tile_data_t *tdata;
+    uint8_t *dst;
+
+    region_get_strides(aabb, strides, s);
+    REGION_ITER_TILES(aabb, pos) {
+        region_clip_tile(aabb, pos, a, b);
+        tile = tiles_find(volume->tiles, pos);
+        tdata = tile ? tile->data : get_empty_data();
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            dst = data + (pos[0] + a[0] - aabb[0][0]) * s[0] +
+                         (pos[1] + y - aabb[0][1]) * s[1] +
+                         (pos[2] + z - aabb[0][2]) * s[2];
+            tile_data_read_row(tdata, a[0] + y * N + z * N * N,
+                               b[0] - a[0], dst, s[0]);
+        }
+    }
+}
+
+// Test if a part of a region buffer only has fully transparent voxels.
+static bool region_is_empty(const uint8_t *data, const int s[3],
+                            const int a[3], const int b[3])
+{
+    int x, y, z;
+    for (z = a[2]; z < b[2]; z++)
+    for (y = a[1]; y < b[1]; y++)
+    for (x = a[0]; x < b[0]; x++) {
+        if (data[x * s[0] + y * s[1] + z * s[2] + 3]) return false;
+    }
+    return true;
+}
 
+void volume_write_region(volume_t *volume, const int aabb[2][3],
+                         const uint8_t *data, const int strides[3])
+{
+    int s[3], pos[3], a[3], b[3], y, z;
     tile_t *tile;
-    int tile_pos[3] = {pos[0] + 1, pos[1] + 1, pos[2] + 1};
-    int i, z, y, x, dx, dy, dz, p[3];
-    uint8_t v[4];
-    volume_accessor_t accessor;
-
-    memset(data, 0, size[0] * size[1] * size[2] * 4);
-    tile = volume_get_tile_at(volume, tile_pos, NULL);
-    if (!tile) goto rest;
-
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        dx = x + 1;
-        dy = y + 1;
-        dz = z + 1;
-        memcpy(&data[(dz * size[1] * size[0] + dy * size[0] + dx) * 4],
-               &tile->data->voxels[z * N * N + y * N + x],
-               4);
-    }
-
-rest:
-    // Fill the rest.
-    // In order to optimize access, we iter in such a way to avoid changing
-    // the current tile: start with the planes, then the edges, and finally
-    // the 8 corners.
-    accessor = volume_get_accessor(volume);
-    const int ranges[26][3][2] = {
-        // 6 planes.
-        {{0,         1}, {1,     N + 1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 1}},
-        {{1,     N + 1}, {0,         1}, {1,     N + 1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{1,     N + 1}, {1,     N + 1}, {0,         1}},
-        {{1,     N + 1}, {1,     N + 1}, {N + 1, N + 2}},
-        // 4 edges moving along X.
-        {{1,     N + 1}, {0,         1}, {0,         1}},
-        {{1,     N + 1}, {N + 1, N + 2}, {0,         1}},
-        {{1,     N + 1}, {0,         1}, {N + 1, N + 2}},
-        {{1,     N + 1}, {N + 1, N + 2}, {N + 1, N + 2}},
-        // 4 edges moving along Y.
-        {{0,         1}, {1,     N + 1}, {0,         1}},
-        {{N + 1, N + 2}, {1,     N + 1}, {0,         1}},
-        {{0,         1}, {1,     N + 1}, {1,     N + 2}},
-        {{N + 1, N + 2}, {1,     N + 1}, {1,     N + 2}},
-        // 4 edges moving along Z.
-        {{0,         1}, {0,         1}, {1,     N + 1}},
-        {{N + 1, N + 2}, {0,         1}, {1,     N + 1}},
-        {{0,         1}, {N + 1, N + 2}, {1,     N + 1}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {1,     N + 1}},
-        // 8 Corners.
-        {{0,     1    }, {0,     1    }, {0,     1    }},
-        {{N + 1, N + 2}, {0,     1    }, {0,     1    }},
-        {{0,     1    }, {N + 1, N + 2}, {0,     1    }},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {0,     1    }},
-        {{0,     1    }, {0,     1    }, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {0,     1    }, {N + 1, N + 2}},
-        {{0,     1    }, {N + 1, N + 2}, {N + 1, N + 2}},
-        {{N + 1, N + 2}, {N + 1, N + 2}, {N + 1, N + 2}},
-    };
+    tile_data_t *tdata;
+    const uint8_t *src;
+    bool full;
+
+    volume_prepare_write(volume);
+    region_get_strides(aabb, strides, s);
+    REGION_ITER_TILES(aabb, pos) {
+        region_clip_tile(aabb, pos, a, b);
+        // Origin of the tile in the buffer.
+        src = data + (pos[0] - aabb[0][0]) * s[0] +
+                     (pos[1] - aabb[0][1]) * s[1] +
+                     (pos[2] - aabb[0][2]) * s[2];
+        full = a[0] == 0 && a[1] == 0 && a[2] == 0 &&
+               b[0] == N && b[1] == N && b[2] == N;
+        tile = tiles_get_mut(volume->tiles, pos, false);
+        if (!tile) {
+            if (region_is_empty(src, s, a, b)) continue;
+            tile = tiles_get_mut(volume->tiles, pos, true);
+        }
+        if (full) {
+            // Tile aligned: no need to keep the previous data at all.
+            tdata = tile_data_new();
+            tdata->voxels = pool_alloc(g_voxels_pool);
+            STAT_ADD(mem, TILE_VOXELS_SIZE);
+            STAT_ADD(voxels_mem, TILE_VOXELS_SIZE);
+            tile_data_release(tile->data);
+            tile->data = tdata;
+        } else {
+            tile_prepare_write(tile);
+        }
+        for (z = a[2]; z < b[2]; z++)
+        for (y = a[1]; y < b[1]; y++) {
+            tile_data_write_row(tile->data, a[0] + y * N + z * N * N,
+                                b[0] - a[0],
+                                src + a[0] * s[0] + y * s[1] + z * s[2],
+                                s[0]);
+        }
+        if (tile_is_empty(tile)) tiles_remove(volume->tiles, pos);
+    }
+}
 
-    for (i = 0; i < 26; i++)
-    for (z = ranges[i][2][0]; z < ranges[i][2][1]; z++)
-    for (y = ranges[i][1][0]; y < ranges[i][1][1]; y++)
-    for (x = ranges[i][0][0]; x < ranges[i][0][1]; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        volume_get_at(volume, &accessor, p, v);
-        memcpy(&data[(z * size[1] * size[0] + y * size[0] + x) * 4], v, 4);
+void volume_read(const volume_t *volume,
+                 const int pos[3], const int size[3],
+                 uint8_t *data)
+{
+    const int aabb[2][3] = {
+        {pos[0], pos[1], pos[2]},
+        {pos[0] + size[0], pos[1] + size[1], pos[2] + size[2]}};
+    volume_read_region(volume, aabb, data, NULL);
+}
+
+void volume_compact_tiles(volume_t *volume, const int aabb[2][3])
+{
+    tile_t *tile;
+    uint64_t h;
+    int hpos[3];
+    for (tile = tiles_first(volume->tiles, &h, hpos); tile;
+         tile = tiles_next(volume->tiles, &h, hpos)) {
+        if (aabb && (
+                tile->pos[0] + N <= aabb[0][0] || tile->pos[0] >= aabb[1][0] ||
+                tile->pos[1] + N <= aabb[0][1] || tile->pos[1] >= aabb[1][1] ||
+                tile->pos[2] + N <= aabb[0][2] || tile->pos[2] >= aabb[1][2]))
+            continue;
+        volume_compact_tile(volume, tile);
     }
 }
 
 int volume_get_tiles_count(const volume_t *volume)
 {
-    return HASH_COUNT(volume->tiles);
+    return volume->tiles->count;
 }
 
 void volume_get_global_stats(volume_global_stats_t *stats)
 {
-    *stats = g_global_stats;
+    const thread_stats_t *t;
+    int64_t voxels_mem = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    for (t = __atomic_load_n(&g_threads_stats, __ATOMIC_ACQUIRE); t;
+         t = t->next) {
+        stats->nb_volumes += __atomic_load_n(&t->nb_volumes, __ATOMIC_RELAXED);
+        stats->nb_tiles += __atomic_load_n(&t->nb_tiles, __ATOMIC_RELAXED);
+        stats->nb_uniform_tiles +=
+            __atomic_load_n(&t->nb_uniform_tiles, __ATOMIC_RELAXED);
+        stats->nb_indexed_tiles +=
+            __atomic_load_n(&t->nb_indexed_tiles, __ATOMIC_RELAXED);
+        stats->mem += __atomic_load_n(&t->mem, __ATOMIC_RELAXED);
+        voxels_mem += __atomic_load_n(&t->voxels_mem, __ATOMIC_RELAXED);
+    }
+    stats->mem_saved = (int64_t)stats->nb_tiles * TILE_VOXELS_SIZE -
+                       voxels_mem;
 }
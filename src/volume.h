@@ -22,7 +22,16 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#define TILE_SIZE 16
+// Size of the tiles, can be set at compile time to 16 or 32.  Bigger tiles
+// mean less tiles to manage, at the cost of more memory per tile.
+#ifndef TILE_SIZE
+#   define TILE_SIZE 16
+#endif
+#if TILE_SIZE != 16 && TILE_SIZE != 32
+#   error "TILE_SIZE must be 16 or 32"
+#endif
+// Number of uint64_t needed for a bit mask of all the voxels of a tile.
+#define TILE_MASK_SIZE (TILE_SIZE * TILE_SIZE * TILE_SIZE / 64)
 
 /* Type: volume_t
  * Opaque type that represents a voxel volume.
@@ -38,8 +47,11 @@ typedef struct tile tile_t;
  * VOLUME_ITER_VOXELS - Iter on the voxels (default if zero).
  * VOLUME_ITER_TILES - Iter on the tiles: the iterator return successive
  *                    tiles positions.
- * VOLUME_ITER_INCLUDES_NEIGHBORS - Also yield one position for each
- *                                neighbor of the voxels.
+ * VOLUME_ITER_INCLUDES_NEIGHBORS - Also yield the positions of the missing
+ *                                tiles adjacent to the non empty tiles,
+ *                                after all the volume tiles.  The volume
+ *                                is not modified.  Not supported for union
+ *                                iterators.
  * VOLUME_ITER_SKIP_EMPTY - Don't yield empty voxels/tiles.
  */
 enum {
@@ -69,6 +81,10 @@ typedef struct {
     tile_t *tile;
     int tile_pos[3];
     uint64_t tile_id;
+    // Hash and position of the current tile in the volume tiles.
+    uint64_t tile_key;
+    int tile_key_pos[3];
+    int tile_dir; // Current direction when iterating the neighbor tiles.
 
     int pos[3];
     float box[4][4];
@@ -138,7 +154,21 @@ void volume_set_at(volume_t *volume, volume_iterator_t *it,
                  const int pos[3], const uint8_t v[4]);
 
 // XXX: we should remove this one I guess.
-void volume_remove_empty_tiles(volume_t *volume, bool fast);
+void volume_remove_empty_tiles(volume_t *volume);
+
+/*
+ * Function: volume_compact_tiles
+ * Store the tiles using the most compact representation.
+ *
+ * Tiles whose voxels all have the same value are stored as a single value,
+ * and tiles with few distinct colors are stored as a small palette plus
+ * 4, 8 or 16 bits indices.  This doesn't change the content of the volume.
+ *
+ * Inputs:
+ *   volume - The volume.
+ *   aabb   - If not NULL, only check the tiles intersecting this box.
+ */
+void volume_compact_tiles(volume_t *volume, const int aabb[2][3]);
 
 /*
  * Function: volume_clear_tile
@@ -217,13 +247,74 @@ int volume_iter(volume_iterator_t *it, int pos[3]);
  */
 uint64_t volume_get_key(const volume_t *volume);
 
-void *volume_get_tile_data(const volume_t *volume, volume_accessor_t *accessor,
-                           const int bpos[3], uint64_t *id);
+/*
+ * Function: volume_get_tile_id
+ * Return the id of the data of a tile, or zero if there is no tile.
+ *
+ * Two tiles with the same id are guarantied to have the same content.
+ */
+uint64_t volume_get_tile_id(const volume_t *volume, const int bpos[3]);
+
+/*
+ * Function: volume_get_tile_mask
+ * Get the occupancy mask of a tile.
+ *
+ * The bit (x + y * TILE_SIZE + z * TILE_SIZE * TILE_SIZE) of the mask is set
+ * if the voxel at this position in the tile has a non zero alpha.
+ *
+ * Inputs:
+ *   volume - The volume.
+ *   bpos   - Position of the tile.
+ *
+ * Outputs:
+ *   mask   - The occupancy mask, all zero if there is no tile.
+ *
+ * Returns:
+ *   The number of non empty voxels in the tile.
+ */
+int volume_get_tile_mask(const volume_t *volume, const int bpos[3],
+                         uint64_t mask[TILE_MASK_SIZE]);
 
 // Maybe replace this with a generic volume_copy_part function?
 void volume_copy_tile(const volume_t *src, const int src_pos[3],
                       volume_t *dst, const int dst_pos[3]);
 
+/*
+ * Function: volume_read_region
+ * Copy the voxels of a box of the volume into a buffer.
+ *
+ * Inputs:
+ *   volume  - The volume.
+ *   aabb    - The box to read, as min and max (excluded) corners.
+ *   strides - Offsets in bytes between two consecutive voxels along the
+ *             x, y and z axis of the buffer.  They can be negative, or zero
+ *             to repeat the same voxels.  If NULL, use a packed RGBA
+ *             buffer in xyz order.
+ *
+ * Outputs:
+ *   data    - Buffer that receives the voxels values.
+ */
+void volume_read_region(const volume_t *volume, const int aabb[2][3],
+                        uint8_t *data, const int strides[3]);
+
+/*
+ * Function: volume_write_region
+ * Copy voxels from a buffer into a box of the volume.
+ *
+ * The whole box is overwritten, including with transparent voxels.
+ * Tiles that end up without any visible voxel are removed.  The written
+ * tiles are not compacted, call <volume_compact_tiles> after if needed.
+ *
+ * Inputs:
+ *   volume  - The volume.
+ *   aabb    - The box to write, as min and max (excluded) corners.
+ *   data    - The voxels values.
+ *   strides - Same as for <volume_read_region>.
+ */
+void volume_write_region(volume_t *volume, const int aabb[2][3],
+                         const uint8_t *data, const int strides[3]);
+
+// Same as volume_read_region, with the box given as a position and size.
 void volume_read(const volume_t *volume,
                  const int pos[3], const int size[3],
                  uint8_t *data);
@@ -233,7 +324,10 @@ int volume_get_tiles_count(const volume_t *volume);
 typedef struct {
     int       nb_volumes;
     int       nb_tiles;
+    int       nb_uniform_tiles;   // Tiles stored as a single value.
+    int       nb_indexed_tiles;   // Tiles stored with a palette.
     uint64_t  mem;
+    uint64_t  mem_saved;  // Memory saved compared to all dense tiles.
 } volume_global_stats_t;
 
 void volume_get_global_stats(volume_global_stats_t *stats);
@@ -40,20 +40,10 @@ static int next_pow2(int x)
 
 // Implemented in marchingcube.c
 int volume_generate_vertices_mc(const volume_t *volume, const int block_pos[3],
-                              int effects, voxel_vertex_t *out,
+                              int effects, const volume_sdf_t *sdf,
+                              voxel_vertex_t *out,
                               int *size, int *pos_scale);
 
-static bool block_is_face_visible(uint32_t neighboors_mask, int f)
-{
-#define M(x, y, z) (1 << ((x + 1) + (y + 1) * 3 + (z + 1) * 9))
-    static const uint32_t MASKS[6] = {
-        M(0, -1, 0), M(0, +1, 0), M(0, 0, -1),
-        M(0, 0, +1), M(+1, 0, 0), M(-1, 0, 0),
-    };
-#undef M
-    return !(MASKS[f] & neighboors_mask);
-}
-
 static void block_get_normal(int f, int8_t normal[3], int8_t tangent[3])
 {
     normal[0] = FACES_NORMALS[f][0];
@@ -191,62 +181,198 @@ static uint8_t block_get_border_mask(uint32_t neighboors_mask, int f)
                 ((z) + 1) * (N + 2) * (N + 2)) * 4], 4); \
 } while (0)
 
+/*
+ * Bitmasks of the solid voxels (alpha >= 127) of the padded data, one per
+ * row along x: bit i is set if the voxel at x = i - 1 is solid.
+ */
+#define SOLID_ROW(rows, y, z) (rows)[((y) + 1) + ((z) + 1) * (N + 2)]
+
+static void get_solid_rows(const uint8_t *data,
+                           uint64_t rows[(TILE_SIZE + 2) * (TILE_SIZE + 2)])
+{
+    int i, x;
+    const uint8_t *alpha = data + 3;
+
+    for (i = 0; i < (N + 2) * (N + 2); i++) {
+        rows[i] = 0;
+        for (x = 0; x < N + 2; x++, alpha += 4) {
+            if (*alpha >= 127) rows[i] |= 1ULL << x;
+        }
+    }
+}
+
 static uint32_t get_neighboors(const uint8_t *data,
+                               const uint64_t *rows,
                                const int pos[3],
                                uint8_t neighboors[27])
 {
-    int xx, yy, zz, i = 0;
-    uint8_t v[4];
+    int yy, zz, i = 0;
+    const uint8_t *alpha;
     uint32_t ret = 0;
     for (zz = -1; zz <= 1; zz++)
-    for (yy = -1; yy <= 1; yy++)
-    for (xx = -1; xx <= 1; xx++) {
-        data_get_at(data, pos[0] + xx, pos[1] + yy, pos[2] + zz, v);
-        neighboors[i] = v[3];
-        if (neighboors[i] >= 127) ret |= 1 << i;
-        i++;
+    for (yy = -1; yy <= 1; yy++) {
+        ret |= ((SOLID_ROW(rows, pos[1] + yy, pos[2] + zz) >> pos[0]) & 7)
+                << i;
+        alpha = &data[(pos[0] + (pos[1] + yy + 1) * (N + 2) +
+                       (pos[2] + zz + 1) * (N + 2) * (N + 2)) * 4 + 3];
+        neighboors[i++] = alpha[0];
+        neighboors[i++] = alpha[4];
+        neighboors[i++] = alpha[8];
     }
     return ret;
 }
 
-/* Packing of block id, pos, and face:
- *
- *    x   :  4 bits
- *    y   :  4 bits
- *    z   :  4 bits
- *    pad :  1 bit
- *    face:  3 bits
- *    -------------
- *    tot : 16 bits
+// Pack the voxel position and face, see POS_DATA_ID_BITS.  The tile id
+// is added in the shader.
+static uint32_t get_pos_data(uint32_t x, uint32_t y, uint32_t z, uint32_t f)
+{
+    const int b = POS_DATA_POS_BITS;
+    return (x << (32 - b)) | (y << (32 - 2 * b)) | (z << (32 - 3 * b)) |
+           (f << POS_DATA_ID_BITS);
+}
+
+
+// Attributes of a visible voxel face.
+typedef struct {
+    uint8_t  color[4];
+    int8_t   gradient[3];
+    uint8_t  shadow_mask;
+    uint8_t  borders_mask;
+    bool     visible;
+} face_t;
+
+// The faces of a tile we can merge, indexed by direction and position.
+// All the faces are set back to not visible after each use.
+struct volume_faces {
+    face_t faces[6 * TILE_SIZE * TILE_SIZE * TILE_SIZE];
+};
+
+volume_faces_t *volume_faces_new(void)
+{
+    return calloc(1, sizeof(volume_faces_t));
+}
+
+void volume_faces_delete(volume_faces_t *faces)
+{
+    free(faces);
+}
+
+/*
+ * Generate the quad of a face, starting at a given voxel and covering
+ * size voxels along each axis (the size along the normal axis is 1).
  */
-static uint16_t get_pos_data(uint16_t x, uint16_t y, uint16_t z, uint16_t f)
+static void face_get_vertices(const face_t *face, int f, const int pos[3],
+                              const int size[3], voxel_vertex_t out[4])
+{
+    int i;
+    int8_t normal[3], tangent[3];
+    const int ts = VOXEL_TEXTURE_SIZE;
+    const int *vpos;
+
+    block_get_normal(f, normal, tangent);
+    for (i = 0; i < 4; i++) {
+        vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
+        out[i].pos[0] = pos[0] + vpos[0] * size[0];
+        out[i].pos[1] = pos[1] + vpos[1] * size[1];
+        out[i].pos[2] = pos[2] + vpos[2] * size[2];
+        memcpy(out[i].normal, normal, sizeof(normal));
+        memcpy(out[i].tangent, tangent, sizeof(tangent));
+        memcpy(out[i].gradient, face->gradient, sizeof(face->gradient));
+        memcpy(out[i].color, face->color, sizeof(face->color));
+        out[i].occlusion_uv[0] =
+            face->shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
+        out[i].occlusion_uv[1] =
+            face->shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
+        out[i].uv[0] = VERTICE_UV[i][0] * 255;
+        out[i].uv[1] = VERTICE_UV[i][1] * 255;
+        // For testing:
+        // This put a border bump on all the edges of the voxel.
+        out[i].bump_uv[0] = (face->borders_mask % 16) * 16;
+        out[i].bump_uv[1] = (face->borders_mask / 16) * 16;
+        out[i].pos_data = get_pos_data(pos[0], pos[1], pos[2], f);
+    }
+}
+
+static bool faces_can_merge(const face_t *a, const face_t *b)
 {
-    assert(BLOCK_SIZE == 16);
-    return (x << 12) | (y << 8) | (z << 4) | (f << 0);
+    return b->visible &&
+           memcmp(a->color, b->color, sizeof(a->color)) == 0 &&
+           memcmp(a->gradient, b->gradient, sizeof(a->gradient)) == 0;
 }
 
+/*
+ * Greedy meshing: in each slice of the tile, merge the adjacent faces with
+ * the same attributes into rectangles, first growing along the u axis,
+ * then along the v axis.
+ */
+static int merge_faces(face_t *faces, voxel_vertex_t *out)
+{
+    int f, n, u, v, a, b, w, h, k, nb = 0;
+    int p[3], size[3];
+    const int stride[3] = {1, N, N * N};
+    face_t face;
+
+#define AT(a, b) faces[f * N * N * N + p[n] * stride[n] + \
+                       (a) * stride[u] + (b) * stride[v]]
+
+    for (f = 0; f < 6; f++) {
+        n = FACES_NORMALS[f][0] ? 0 : FACES_NORMALS[f][1] ? 1 : 2;
+        u = (n + 1) % 3;
+        v = (n + 2) % 3;
+        for (p[n] = 0; p[n] < N; p[n]++)
+        for (b = 0; b < N; b++)
+        for (a = 0; a < N; a++) {
+            face = AT(a, b);
+            if (!face.visible) continue;
+            for (w = 1; a + w < N; w++) {
+                if (!faces_can_merge(&face, &AT(a + w, b))) break;
+            }
+            for (h = 1; b + h < N; h++) {
+                for (k = 0; k < w; k++) {
+                    if (!faces_can_merge(&face, &AT(a + k, b + h))) break;
+                }
+                if (k < w) break;
+            }
+            for (k = 0; k < w * h; k++) AT(a + k % w, b + k / w).visible = 0;
+            p[u] = a;
+            p[v] = b;
+            size[n] = 1;
+            size[u] = w;
+            size[v] = h;
+            face_get_vertices(&face, f, p, size, out + nb * 4);
+            nb++;
+        }
+    }
+#undef AT
+    return nb;
+}
 
 int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
-                           int effects, voxel_vertex_t *out,
-                           int *size, int *subdivide)
+                           int effects, const volume_sdf_t *sdf,
+                           volume_faces_t *faces_buf,
+                           voxel_vertex_t *out, int *size, int *subdivide)
 {
     int x, y, z, f;
-    int i, nb = 0;
+    int nb = 0;
+    uint64_t mask[TILE_MASK_SIZE], row, bits, visible[6];
+    uint64_t rows[(TILE_SIZE + 2) * (TILE_SIZE + 2)];
     uint32_t neighboors_mask;
-    uint8_t shadow_mask, borders_mask;
-    const int ts = VOXEL_TEXTURE_SIZE;
     uint8_t *data, neighboors[27], v[4];
-    int8_t normal[3], tangent[3], gradient[3];
     int pos[3];
-    const int *vpos;
+    face_t face, *faces = NULL;
+    volume_faces_t *own_faces = NULL;
+    const bool merge = effects & EFFECT_MERGE_FACES;
 
     if (effects & EFFECT_MARCHING_CUBES)
-        return volume_generate_vertices_mc(volume, block_pos, effects, out,
-                                         size, subdivide);
+        return volume_generate_vertices_mc(volume, block_pos, effects, sdf,
+                                           out, size, subdivide);
 
     *size = 4;      // Quad.
     *subdivide = 1; // Unit is one voxel.
 
+    // Only the non empty voxels of the tile can generate faces.
+    if (!volume_get_tile_mask(volume, block_pos, mask)) return 0;
+
     // To speed things up we first get the voxel cube around the block.
     // XXX: can we do this while still using volume iterators somehow?
 #define IVEC(...) ((int[]){__VA_ARGS__})
@@ -254,47 +380,57 @@ int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
     volume_read(volume,
               IVEC(block_pos[0] - 1, block_pos[1] - 1, block_pos[2] - 1),
               IVEC(N + 2, N + 2, N + 2), data);
+    if (merge) {
+        if (!faces_buf) faces_buf = own_faces = volume_faces_new();
+        faces = faces_buf->faces;
+    }
 
+    // Compute the visible faces of a whole row of voxels at once from the
+    // solid voxels bitmasks, so that we only look at the neighbors of the
+    // voxels that have visible faces.
+    get_solid_rows(data, rows);
     for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        pos[0] = x;
-        pos[1] = y;
-        pos[2] = z;
-        data_get_at(data, x, y, z, v);
-        if (v[3] < 127) continue;    // Non visible
-        neighboors_mask = get_neighboors(data, pos, neighboors);
-        for (f = 0; f < 6; f++) {
-            if (!block_is_face_visible(neighboors_mask, f)) continue;
-            block_get_normal(f, normal, tangent);
-            block_get_gradient(neighboors_mask, neighboors, f, gradient);
-            shadow_mask = block_get_shadow_mask(neighboors_mask, f);
-            borders_mask = block_get_border_mask(neighboors_mask, f);
-            for (i = 0; i < 4; i++) {
-                vpos = VERTICES_POSITIONS[FACES_VERTICES[f][i]];
-                out[nb * 4 + i].pos[0] = x + vpos[0];
-                out[nb * 4 + i].pos[1] = y + vpos[1];
-                out[nb * 4 + i].pos[2] = z + vpos[2];
-                memcpy(out[nb * 4 + i].normal, normal, sizeof(normal));
-                memcpy(out[nb * 4 + i].tangent, tangent, sizeof(tangent));
-                memcpy(out[nb * 4 + i].gradient, gradient, sizeof(gradient));
-                memcpy(out[nb * 4 + i].color, v, sizeof(v));
-                out[nb * 4 + i].color[3] = out[nb * 4 + i].color[3] ? 255 : 0;
-                out[nb * 4 + i].occlusion_uv[0] =
-                    shadow_mask % 16 * ts + VERTICE_UV[i][0] * (ts - 1);
-                out[nb * 4 + i].occlusion_uv[1] =
-                    shadow_mask / 16 * ts + VERTICE_UV[i][1] * (ts - 1);
-                out[nb * 4 + i].uv[0] = VERTICE_UV[i][0] * 255;
-                out[nb * 4 + i].uv[1] = VERTICE_UV[i][1] * 255;
-                // For testing:
-                // This put a border bump on all the edges of the voxel.
-                out[nb * 4 + i].bump_uv[0] = (borders_mask % 16) * 16;
-                out[nb * 4 + i].bump_uv[1] = (borders_mask / 16) * 16;
-                out[nb * 4 + i].pos_data = get_pos_data(x, y, z, f);
+    for (y = 0; y < N; y++) {
+        row = (SOLID_ROW(rows, y, z) >> 1) & ((1ULL << N) - 1);
+        if (!row) continue;
+        visible[0] = row & ~(SOLID_ROW(rows, y - 1, z) >> 1);
+        visible[1] = row & ~(SOLID_ROW(rows, y + 1, z) >> 1);
+        visible[2] = row & ~(SOLID_ROW(rows, y, z - 1) >> 1);
+        visible[3] = row & ~(SOLID_ROW(rows, y, z + 1) >> 1);
+        visible[4] = row & ~(SOLID_ROW(rows, y, z) >> 2);
+        visible[5] = row & ~SOLID_ROW(rows, y, z);
+        bits = visible[0] | visible[1] | visible[2] |
+               visible[3] | visible[4] | visible[5];
+        for (; bits; bits &= bits - 1) {
+            x = __builtin_ctzll(bits);
+            pos[0] = x;
+            pos[1] = y;
+            pos[2] = z;
+            data_get_at(data, x, y, z, v);
+            neighboors_mask = get_neighboors(data, rows, pos, neighboors);
+            for (f = 0; f < 6; f++) {
+                if (!(visible[f] >> x & 1)) continue;
+                memcpy(face.color, v, sizeof(v));
+                face.color[3] = face.color[3] ? 255 : 0;
+                block_get_gradient(neighboors_mask, neighboors, f,
+                                   face.gradient);
+                face.shadow_mask = block_get_shadow_mask(neighboors_mask, f);
+                face.borders_mask = block_get_border_mask(neighboors_mask, f);
+                face.visible = true;
+                // The faces with ambient occlusion use their own part of
+                // the occlusion texture, so we cannot merge them.
+                if (merge && face.shadow_mask == 0) {
+                    faces[f * N * N * N + x + y * N + z * N * N] = face;
+                    continue;
+                }
+                face_get_vertices(&face, f, pos, IVEC(1, 1, 1),
+                                  out + nb * 4);
+                nb++;
             }
-            nb++;
         }
     }
+    if (merge) nb += merge_faces(faces, out + nb * 4);
+    volume_faces_delete(own_faces);
     free(data);
     return nb;
 }
@@ -368,7 +504,13 @@ static void fill_mesh(volume_mesh_t *mesh,
     mesh->vertices_count += nb * size;
 }
 
-static void optimize_mesh(volume_mesh_t *mesh, float simplify)
+/*
+ * Merge the duplicated vertices of a mesh, and simplify it if required.
+ * If lock_border is set, the vertices on the border of the mesh are kept,
+ * so that the mesh still connects to the adjacent meshes.
+ */
+static void optimize_mesh(volume_mesh_t *mesh, float simplify,
+                          bool lock_border)
 {
     unsigned int *remap;
     unsigned int *tmp_indices;
@@ -378,6 +520,8 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
     int target_index_count;
 	float target_error = 1e-2f;
 
+    if (mesh->indices_count == 0) return;
+
     // Merge duplicated vertices.
     remap = calloc(mesh->vertices_count, sizeof(unsigned int));
     vertices_count = meshopt_generateVertexRemap(
@@ -406,7 +550,7 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
                 tmp_indices, mesh->indices, mesh->indices_count,
                 (const float*)mesh->vertices, mesh->vertices_count,
                 sizeof(*mesh->vertices), target_index_count, target_error,
-                0, NULL);
+                lock_border ? meshopt_SimplifyLockBorder : 0, NULL);
         vertices_count = meshopt_optimizeVertexFetch(
                 tmp_vertices, tmp_indices, indices_count,
                 mesh->vertices, mesh->vertices_count, sizeof(*mesh->vertices));
@@ -420,28 +564,256 @@ static void optimize_mesh(volume_mesh_t *mesh, float simplify)
     free(tmp_indices);
 }
 
-volume_mesh_t *volume_generate_mesh(
-        const volume_t *volume, int effects, const palette_t *palette,
-        float simplify)
+typedef struct {
+    const volume_t *volume;
+    int effects;
+    const volume_sdf_t *sdf;
+    int nb_batches;
+    int nb_tiles;
+    volume_tile_vertices_t *tiles;
+} tiles_vertices_ctx_t;
+
+// Generate the vertices of a range of tiles.
+static void tiles_vertices_batch_func(void *user, int i)
 {
-    volume_iterator_t iter;
-    int bpos[3];
+    tiles_vertices_ctx_t *ctx = user;
+    volume_tile_vertices_t *tile;
+    int t;
+    int start = (int64_t)ctx->nb_tiles * i / ctx->nb_batches;
+    int end = (int64_t)ctx->nb_tiles * (i + 1) / ctx->nb_batches;
     voxel_vertex_t *verts;
-    int i, nb, size, subdivide;
-    volume_mesh_t *mesh = calloc(1, sizeof(*mesh));
+    volume_faces_t *faces = NULL;
 
     verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    if (ctx->effects & EFFECT_MERGE_FACES) faces = volume_faces_new();
+    for (t = start; t < end; t++) {
+        tile = &ctx->tiles[t];
+        tile->nb = volume_generate_vertices(
+                ctx->volume, tile->pos, ctx->effects, ctx->sdf, faces, verts,
+                &tile->size, &tile->subdivide);
+        if (tile->nb == 0) continue;
+        tile->vertices = malloc(tile->nb * tile->size * sizeof(*verts));
+        memcpy(tile->vertices, verts, tile->nb * tile->size * sizeof(*verts));
+    }
+    volume_faces_delete(faces);
+    free(verts);
+}
+
+volume_tile_vertices_t *volume_generate_tiles_vertices(
+        const volume_t *volume, int effects, int *nb)
+{
+    volume_iterator_t iter;
+    int bpos[3], cap = 0;
+    volume_tile_vertices_t *tiles = NULL;
+    volume_sdf_t *sdf = NULL;
+    tiles_vertices_ctx_t ctx;
+
+    *nb = 0;
     iter = volume_get_iterator(volume,
             VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
     while (volume_iter(&iter, bpos)) {
-        nb = volume_generate_vertices(volume, bpos, effects, verts,
+        if (*nb == cap) {
+            cap = max(64, cap * 2);
+            tiles = realloc(tiles, cap * sizeof(*tiles));
+        }
+        memset(&tiles[*nb], 0, sizeof(tiles[*nb]));
+        memcpy(tiles[*nb].pos, bpos, sizeof(bpos));
+        (*nb)++;
+    }
+
+    // The distance field can only be computed from the main thread.
+    if ((effects & EFFECT_MARCHING_CUBES) && (effects & EFFECT_MC_SMOOTH))
+        sdf = volume_compute_mc_sdf(volume);
+    ctx = (tiles_vertices_ctx_t) {
+        .volume = volume,
+        .effects = effects,
+        .sdf = sdf,
+        .nb_batches = min(*nb, workers_get_count() * 4),
+        .nb_tiles = *nb,
+        .tiles = tiles,
+    };
+    workers_run(ctx.nb_batches, tiles_vertices_batch_func, &ctx);
+    volume_sdf_release(sdf);
+    return tiles;
+}
+
+void volume_tiles_vertices_free(volume_tile_vertices_t *tiles, int nb)
+{
+    int i;
+    for (i = 0; i < nb; i++) free(tiles[i].vertices);
+    free(tiles);
+}
+
+/*
+ * Concatenate a list of meshes into a single one, and release them.  We
+ * compute the total size first so that we only do a single allocation.
+ */
+static void stitch_meshes(volume_mesh_t *mesh, volume_mesh_t *parts, int n)
+{
+    int i, j, nb_vertices = 0, nb_indices = 0;
+    unsigned int *indices;
+
+    for (i = 0; i < n; i++) {
+        nb_vertices += parts[i].vertices_count;
+        nb_indices += parts[i].indices_count;
+    }
+    mesh->vertices = malloc(nb_vertices * sizeof(*mesh->vertices));
+    mesh->indices = malloc(nb_indices * sizeof(*mesh->indices));
+    mesh->vertices_count = 0;
+    mesh->indices_count = 0;
+    for (i = 0; i < n; i++) {
+        if (parts[i].vertices_count) {
+            memcpy(mesh->vertices + mesh->vertices_count, parts[i].vertices,
+                   parts[i].vertices_count * sizeof(*mesh->vertices));
+        }
+        indices = mesh->indices + mesh->indices_count;
+        for (j = 0; j < parts[i].indices_count; j++)
+            indices[j] = parts[i].indices[j] + mesh->vertices_count;
+        mesh->vertices_count += parts[i].vertices_count;
+        mesh->indices_count += parts[i].indices_count;
+        free(parts[i].vertices);
+        free(parts[i].indices);
+    }
+}
+
+typedef struct {
+    int chunk[3];   // Origin of the chunk of the tile.
+    int pos[3];
+    int order;      // Index in the volume iteration order.
+} mesh_tile_t;
+
+static int mesh_tile_cmp(const void *a_, const void *b_)
+{
+    const mesh_tile_t *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a->chunk[i] != b->chunk[i])
+            return a->chunk[i] < b->chunk[i] ? -1 : +1;
+    }
+    return a->order - b->order;
+}
+
+typedef struct {
+    const volume_t *volume;
+    int effects;
+    const volume_sdf_t *sdf;
+    const palette_t *palette;
+    float simplify;
+    bool chunked;
+    int nb_tiles;
+    int nb_batches;
+    const mesh_tile_t *tiles;
+    volume_mesh_t *tiles_meshes;
+    const int *chunks_start;
+    volume_mesh_t *chunks;
+} mesh_ctx_t;
+
+// Generate the meshes of a range of tiles.
+static void mesh_batch_func(void *user, int i)
+{
+    mesh_ctx_t *ctx = user;
+    int t, nb, size, subdivide;
+    int start = (int64_t)ctx->nb_tiles * i / ctx->nb_batches;
+    int end = (int64_t)ctx->nb_tiles * (i + 1) / ctx->nb_batches;
+    voxel_vertex_t *verts;
+    volume_faces_t *faces = NULL;
+
+    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
+    if (ctx->effects & EFFECT_MERGE_FACES) faces = volume_faces_new();
+    for (t = start; t < end; t++) {
+        nb = volume_generate_vertices(ctx->volume, ctx->tiles[t].pos,
+                                      ctx->effects, ctx->sdf, faces, verts,
                                       &size, &subdivide);
         if (nb == 0) continue;
-        fill_mesh(mesh, verts, nb, size, subdivide, bpos, palette);
+        fill_mesh(&ctx->tiles_meshes[t], verts, nb, size, subdivide,
+                  ctx->tiles[t].pos, ctx->palette);
     }
+    volume_faces_delete(faces);
     free(verts);
+}
+
+// Put together the tiles meshes of a chunk, and optimize the result.
+static void mesh_chunk_func(void *user, int i)
+{
+    mesh_ctx_t *ctx = user;
+    int start = ctx->chunks_start[i];
+    int end = ctx->chunks_start[i + 1];
+
+    stitch_meshes(&ctx->chunks[i], ctx->tiles_meshes + start, end - start);
+    optimize_mesh(&ctx->chunks[i], ctx->simplify, ctx->chunked);
+}
+
+volume_mesh_t *volume_generate_mesh(
+        const volume_t *volume, int effects, const palette_t *palette,
+        float simplify, int chunk_size)
+{
+    volume_iterator_t iter;
+    int bpos[3];
+    int i, nb = 0, cap = 0, nb_chunks = 0;
+    mesh_tile_t *tiles = NULL;
+    int *chunks_start;
+    mesh_ctx_t ctx;
+    volume_sdf_t *sdf = NULL;
+    volume_mesh_t *mesh = calloc(1, sizeof(*mesh));
+
+    if (chunk_size > 0) chunk_size = max(chunk_size / N, 1) * N;
 
-    optimize_mesh(mesh, simplify);
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_INCLUDES_NEIGHBORS);
+    while (volume_iter(&iter, bpos)) {
+        if (nb == cap) {
+            cap = max(64, cap * 2);
+            tiles = realloc(tiles, cap * sizeof(*tiles));
+        }
+        memset(&tiles[nb], 0, sizeof(tiles[nb]));
+        memcpy(tiles[nb].pos, bpos, sizeof(bpos));
+        tiles[nb].order = nb;
+        for (i = 0; chunk_size && i < 3; i++) {
+            tiles[nb].chunk[i] =
+                (int)floor((double)bpos[i] / chunk_size) * chunk_size;
+        }
+        nb++;
+    }
+    // Group the tiles of the same chunk together, keeping the volume order
+    // inside a chunk.
+    if (chunk_size && nb) qsort(tiles, nb, sizeof(*tiles), mesh_tile_cmp);
+
+    chunks_start = malloc((nb + 1) * sizeof(*chunks_start));
+    for (i = 0; i < nb; i++) {
+        if (i && memcmp(tiles[i].chunk, tiles[i - 1].chunk,
+                        sizeof(tiles[i].chunk)) == 0)
+            continue;
+        chunks_start[nb_chunks++] = i;
+    }
+    chunks_start[nb_chunks] = nb;
+
+    ctx = (mesh_ctx_t) {
+        .volume = volume,
+        .effects = effects,
+        .palette = palette,
+        .simplify = simplify,
+        .chunked = chunk_size > 0,
+        .nb_tiles = nb,
+        .nb_batches = min(nb, workers_get_count() * 4),
+        .tiles = tiles,
+        .tiles_meshes = calloc(nb, sizeof(volume_mesh_t)),
+        .chunks_start = chunks_start,
+        .chunks = calloc(nb_chunks, sizeof(volume_mesh_t)),
+    };
+    // The distance field can only be computed from the main thread.  We
+    // hold our own reference to it until all the jobs are done.
+    if ((effects & EFFECT_MARCHING_CUBES) && (effects & EFFECT_MC_SMOOTH))
+        ctx.sdf = sdf = volume_compute_mc_sdf(volume);
+
+    workers_run(ctx.nb_batches, mesh_batch_func, &ctx);
+    volume_sdf_release(sdf);
+    workers_run(nb_chunks, mesh_chunk_func, &ctx);
+    stitch_meshes(mesh, ctx.chunks, nb_chunks);
+
+    free(ctx.tiles_meshes);
+    free(ctx.chunks);
+    free(chunks_start);
+    free(tiles);
 
     mesh->pos_min[0] = +FLT_MAX;
     mesh->pos_min[1] = +FLT_MAX;
@@ -23,6 +23,9 @@
 
 #define N TILE_SIZE
 
+// Max number of tiles processed at once by volume_op (8MB of voxels).
+#define OP_BATCH_SIZE ((8 << 20) / (N * N * N * 4))
+
 // Used for the cache.
 static int volume_del(void *data_)
 {
@@ -31,6 +34,92 @@ static int volume_del(void *data_)
     return 0;
 }
 
+/*
+ * Cost of a volume in the caches.  The tiles are shared with the other
+ * volumes, so we only count the tiles created by the operation, plus the
+ * tiles index.
+ */
+static uint64_t volume_cache_cost(const volume_t *volume, int nb_new_tiles)
+{
+    return (uint64_t)nb_new_tiles * N * N * N * 4 +
+           (uint64_t)volume_get_tiles_count(volume) * 64;
+}
+
+// Selected voxels of a tile, used by volume_select.
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    uint64_t        mask[TILE_MASK_SIZE];
+    uint8_t         alpha[N * N * N];
+} select_tile_t;
+
+typedef struct {
+    select_tile_t   *tiles;
+    select_tile_t   *last;      // Last accessed tile.
+    int             (*queue)[3];
+    int             queue_size;
+    int             queue_cap;
+} select_t;
+
+// Return the selection tile containing a position.  Since most lookups
+// are in the same tile, we check the last accessed tile first.
+static select_tile_t *select_get_tile(select_t *sel, const int pos[3],
+                                      bool create)
+{
+    select_tile_t *tile;
+    int p[3] = {pos[0] & ~(int)(N - 1),
+                pos[1] & ~(int)(N - 1),
+                pos[2] & ~(int)(N - 1)};
+    if (sel->last && memcmp(sel->last->pos, p, sizeof(p)) == 0)
+        return sel->last;
+    HASH_FIND(hh, sel->tiles, p, sizeof(p), tile);
+    if (!tile && create) {
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, p, sizeof(p));
+        HASH_ADD(hh, sel->tiles, pos, sizeof(tile->pos), tile);
+    }
+    if (tile) sel->last = tile;
+    return tile;
+}
+
+static bool select_contains(select_t *sel, const int pos[3])
+{
+    select_tile_t *tile;
+    int i;
+    tile = select_get_tile(sel, pos, false);
+    if (!tile) return false;
+    i = (pos[0] - tile->pos[0]) +
+        (pos[1] - tile->pos[1]) * N +
+        (pos[2] - tile->pos[2]) * N * N;
+    return tile->mask[i / 64] & (1ULL << (i % 64));
+}
+
+// Add a voxel to the selection, and to the queue of voxels whose
+// neighbors need to be tested.
+static void select_add(select_t *sel, const int pos[3], int a)
+{
+    select_tile_t *tile;
+    int i;
+    tile = select_get_tile(sel, pos, true);
+    i = (pos[0] - tile->pos[0]) +
+        (pos[1] - tile->pos[1]) * N +
+        (pos[2] - tile->pos[2]) * N * N;
+    tile->mask[i / 64] |= 1ULL << (i % 64);
+    tile->alpha[i] = a;
+    if (sel->queue_size == sel->queue_cap) {
+        sel->queue_cap = max(256, sel->queue_cap * 2);
+        sel->queue = realloc(sel->queue,
+                             sel->queue_cap * sizeof(*sel->queue));
+    }
+    memcpy(sel->queue[sel->queue_size++], pos, sizeof(int[3]));
+}
+
+/*
+ * Flood fill from the start position.  Each selected voxel goes once
+ * through the queue, where we test its neighbors.  The selected voxels are
+ * kept per tile with a bit mask, and copied into the selection volume at
+ * the end.
+ */
 int volume_select(const volume_t *volume,
                 const int start_pos[3],
                 int (*cond)(void *user, const volume_t *volume,
@@ -39,99 +128,121 @@ int volume_select(const volume_t *volume,
                             volume_accessor_t *volume_accessor),
                 void *user, volume_t *selection)
 {
-    int i, a;
-    int pos[3], p[3];
-    bool keep = true;
-    volume_iterator_t iter;
-    volume_accessor_t volume_accessor, selection_accessor;
-    volume_clear(selection);
+    int i, a, head = 0;
+    int pos[3], p[3], aabb[2][3];
+    volume_accessor_t volume_accessor;
+    select_t sel = {0};
+    select_tile_t *tile, *tmp;
+    uint8_t (*buf)[4];
 
+    volume_clear(selection);
     volume_accessor = volume_get_accessor(volume);
-    selection_accessor = volume_get_accessor(selection);
 
     if (!volume_get_alpha_at(volume, &volume_accessor, start_pos))
         return 0;
-    volume_set_at(selection, &selection_accessor, start_pos,
-                (uint8_t[]){255, 255, 255, 255});
-
-    // XXX: Very inefficient algorithm!
-    // Iter and test all the neighbors of the selection until there is
-    // no more possible changes.
-    while (keep) {
-        keep = false;
-        iter = volume_get_iterator(selection, VOLUME_ITER_VOXELS);
-        while (volume_iter(&iter, pos)) {
-            // Shouldn't be needed if the iter function did filter the voxels.
-            if (!volume_get_alpha_at(selection, &selection_accessor, pos))
-                continue;
+    select_add(&sel, start_pos, 255);
 
-            for (i = 0; i < 6; i++) {
-                p[0] = pos[0] + FACES_NORMALS[i][0];
-                p[1] = pos[1] + FACES_NORMALS[i][1];
-                p[2] = pos[2] + FACES_NORMALS[i][2];
-                if (volume_get_alpha_at(selection, &selection_accessor, p))
-                    continue; // Already done.
-                if (!volume_get_alpha_at(volume, &volume_accessor, p))
-                    continue; // No voxel here.
-                a = cond(user, volume, pos, p, &volume_accessor);
-                if (a) {
-                    volume_set_at(selection, &selection_accessor, p,
-                                (uint8_t[]){255, 255, 255, a});
-                    keep = true;
-                }
+    while (head < sel.queue_size) {
+        memcpy(pos, sel.queue[head++], sizeof(pos));
+        for (i = 0; i < 6; i++) {
+            p[0] = pos[0] + FACES_NORMALS[i][0];
+            p[1] = pos[1] + FACES_NORMALS[i][1];
+            p[2] = pos[2] + FACES_NORMALS[i][2];
+            if (select_contains(&sel, p))
+                continue; // Already done.
+            if (!volume_get_alpha_at(volume, &volume_accessor, p))
+                continue; // No voxel here.
+            a = cond(user, volume, pos, p, &volume_accessor);
+            if (a) select_add(&sel, p, a);
+        }
+    }
+
+    // Copy the selected voxels into the selection volume.
+    buf = malloc(N * N * N * sizeof(*buf));
+    HASH_ITER(hh, sel.tiles, tile, tmp) {
+        for (i = 0; i < N * N * N; i++) {
+            if (tile->mask[i / 64] & (1ULL << (i % 64))) {
+                buf[i][0] = buf[i][1] = buf[i][2] = 255;
+                buf[i][3] = tile->alpha[i];
+            } else {
+                memset(buf[i], 0, 4);
             }
         }
+        volume_get_tile_aabb(tile->pos, aabb);
+        volume_write_region(selection, aabb, (uint8_t*)buf, NULL);
+        HASH_DEL(sel.tiles, tile);
+        free(tile);
     }
+    volume_compact_tiles(selection, NULL);
+    free(buf);
+    free(sel.queue);
     return 0;
 }
 
 
-// XXX: need to redo this function from scratch.  Even the API is a bit
-// stupid.
+/*
+ * Since the plane is axis aligned, we read the voxels of the plane slice
+ * once, and write them back into the box with a zero stride along the
+ * plane normal, so that the same slice is repeated along it.
+ */
 void volume_extrude(volume_t *volume,
                   const float plane[4][4],
                   const float box[4][4])
 {
-    float proj[4][4];
-    float n[3], pos[3], p[3];
     volume_iterator_t iter;
-    int vpos[3];
-    uint8_t value[4];
-
-    vec3_normalize(plane[2], n);
-    vec3_copy(plane[3], pos);
-
-    // Generate the projection into the plane.
-    // XXX: *very* ugly code, fix this!
-    mat4_set_identity(proj);
+    int i, pos[3], aabb[2][3], src_aabb[2][3], tiles[2][3], strides[3];
+    float b0, b1;
+    bool empty = false;
+    uint8_t *buf = NULL;
 
-    if (fabs(plane[2][0]) > 0.1) {
-        proj[0][0] = 0;
-        proj[3][0] = pos[0];
+    for (i = 0; i < 3; i++) {
+        // Voxels whose corner is inside the box.  We allow for some
+        // rounding errors, since the box faces should be on integer
+        // positions.
+        b0 = box[3][i] - box[i][i];
+        b1 = box[3][i] + box[i][i];
+        aabb[0][i] = ceil(b0 - 1e-3);
+        aabb[1][i] = ceil(b1 - 1e-3);
+        if (aabb[1][i] <= aabb[0][i]) empty = true;
+        // Tiles touched by the box.
+        tiles[0][i] = (int)floor(min(b0, b1)) & ~(int)(N - 1);
+        tiles[1][i] = ceil(max(b0, b1));
     }
-    if (fabs(plane[2][1]) > 0.1) {
-        proj[1][1] = 0;
-        proj[3][1] = pos[1];
-    }
-    if (fabs(plane[2][2]) > 0.1) {
-        proj[2][2] = 0;
-        proj[3][2] = pos[2];
+
+    // Read the plane slice before we clear the tiles.
+    if (!empty) {
+        for (i = 0; i < 3; i++) {
+            src_aabb[0][i] = aabb[0][i];
+            src_aabb[1][i] = aabb[1][i];
+            if (fabs(plane[2][i]) > 0.1) {
+                src_aabb[0][i] = floor(plane[3][i]);
+                src_aabb[1][i] = src_aabb[0][i] + 1;
+            }
+        }
+        strides[0] = 4;
+        strides[1] = 4 * (src_aabb[1][0] - src_aabb[0][0]);
+        strides[2] = strides[1] * (src_aabb[1][1] - src_aabb[0][1]);
+        buf = malloc((size_t)strides[2] * (src_aabb[1][2] - src_aabb[0][2]));
+        volume_read_region(volume, src_aabb, buf, strides);
     }
 
-    // XXX: use an accessor to speed up access.
-    iter = volume_get_box_iterator(volume, box, 0);
-    while (volume_iter(&iter, vpos)) {
-        vec3_set(p, vpos[0], vpos[1], vpos[2]);
-        if (!bbox_contains_vec(box, p)) {
-            memset(value, 0, 4);
-        } else {
-            mat4_mul_vec3(proj, p, p);
-            int pi[3] = {floor(p[0]), floor(p[1]), floor(p[2])};
-            volume_get_at(volume, NULL, pi, value);
+    iter = volume_get_iterator(volume, VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        for (i = 0; i < 3; i++) {
+            if (pos[i] < tiles[0][i] || pos[i] > tiles[1][i]) break;
         }
-        volume_set_at(volume, NULL, vpos, value);
+        if (i == 3) volume_clear_tile(volume, &iter, pos);
     }
 
+    if (!empty) {
+        for (i = 0; i < 3; i++) {
+            if (src_aabb[1][i] - src_aabb[0][i] != aabb[1][i] - aabb[0][i])
+                strides[i] = 0;
+        }
+        volume_write_region(volume, aabb, buf, strides);
+        volume_compact_tiles(volume, aabb);
+        free(buf);
+    }
 }
 
 static void volume_fill(
@@ -164,36 +275,175 @@ static void volume_move_get_color(const int pos[3], uint8_t c[4], void *user)
     volume_get_at(volume, NULL, pi, c);
 }
 
+/*
+ * Check if a transformation only permutes and flips the axes, plus an
+ * integer translation, so that it maps voxels to voxels.  In that case a
+ * voxel at position q moves to p with:
+ *
+ *   p[perm[i]] = sign[i] * q[i] + t[perm[i]]
+ *
+ * We accept small errors in the matrix, since the rotations usually come
+ * from sin and cos computations.
+ */
+static bool mat_is_voxel_transform(const float mat[4][4], int perm[3],
+                                   int sign[3], int t[3])
+{
+    const float eps = 1e-5;
+    int i, j, used = 0;
+    float v;
+
+    for (j = 0; j < 3; j++) {
+        perm[j] = -1;
+        if (fabs(mat[j][3]) > eps) return false;
+        for (i = 0; i < 3; i++) {
+            v = mat[j][i];
+            if (fabs(v) <= eps) continue;
+            if (fabs(fabs(v) - 1) > eps || perm[j] != -1) return false;
+            perm[j] = i;
+            sign[j] = v > 0 ? +1 : -1;
+        }
+        if (perm[j] == -1 || (used & (1 << perm[j]))) return false;
+        used |= 1 << perm[j];
+    }
+    if (fabs(mat[3][3] - 1) > eps) return false;
+    for (i = 0; i < 3; i++) {
+        v = mat[3][i];
+        if (fabs(v) > (1 << 20) || fabs(v - roundf(v)) > 1e-3) return false;
+        t[i] = roundf(v);
+    }
+    return true;
+}
+
+static int tile_pos_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : +1;
+    }
+    return 0;
+}
+
+/*
+ * Fast version of volume_move for the transformations that map voxels to
+ * voxels (see mat_is_voxel_transform).  Translations by a multiple of the
+ * tile size only change the tiles positions.  Otherwise, for each
+ * destination tile we read the source region with strides set so that the
+ * buffer is already permuted and flipped.
+ */
+static void volume_move_voxels(volume_t *volume, const int perm[3],
+                               const int sign[3], const int t[3])
+{
+    const int buf_strides[3] = {4, 4 * N, 4 * N * N};
+    volume_t *dst = volume_new();
+    volume_iterator_t iter;
+    int i, j, k, nb = 0, cap = 0, pos[3], p[3];
+    int aabb[2][3], src_aabb[2][3], strides[3];
+    int (*tiles)[3] = NULL;
+    size_t offset;
+    bool aligned = true;
+    uint8_t *buf;
+
+    for (i = 0; i < 3; i++) {
+        if (perm[i] != i || sign[i] != 1 || (t[i] & (N - 1)))
+            aligned = false;
+    }
+
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        if (aligned) {
+            p[0] = pos[0] + t[0];
+            p[1] = pos[1] + t[1];
+            p[2] = pos[2] + t[2];
+            volume_copy_tile(volume, pos, dst, p);
+            continue;
+        }
+        // Add all the destination tiles touched by this tile.
+        volume_get_tile_aabb(pos, src_aabb);
+        for (j = 0; j < 3; j++) {
+            i = perm[j];
+            if (sign[j] > 0) {
+                aabb[0][i] = src_aabb[0][j] + t[i];
+                aabb[1][i] = src_aabb[1][j] + t[i];
+            } else {
+                aabb[0][i] = t[i] - src_aabb[1][j] + 1;
+                aabb[1][i] = t[i] - src_aabb[0][j] + 1;
+            }
+        }
+        for (k = 0; k < 8; k++) {
+            if (nb == cap) {
+                cap = max(256, cap * 2);
+                tiles = realloc(tiles, cap * sizeof(*tiles));
+            }
+            for (i = 0; i < 3; i++) {
+                p[i] = ((k >> i) & 1) ? aabb[1][i] - 1 : aabb[0][i];
+                tiles[nb][i] = p[i] & ~(int)(N - 1);
+            }
+            nb++;
+        }
+    }
+
+    if (nb) qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+    buf = malloc(N * N * N * 4);
+    for (k = 0; k < nb; k++) {
+        if (k && tile_pos_cmp(tiles[k], tiles[k - 1]) == 0) continue;
+        volume_get_tile_aabb(tiles[k], aabb);
+        offset = 0;
+        for (j = 0; j < 3; j++) {
+            i = perm[j];
+            if (sign[j] > 0) {
+                src_aabb[0][j] = aabb[0][i] - t[i];
+            } else {
+                src_aabb[0][j] = t[i] - aabb[1][i] + 1;
+                offset += (N - 1) * buf_strides[i];
+            }
+            src_aabb[1][j] = src_aabb[0][j] + N;
+            strides[j] = sign[j] * buf_strides[i];
+        }
+        volume_read_region(volume, src_aabb, buf + offset, strides);
+        volume_write_region(dst, aabb, buf, NULL);
+    }
+    free(buf);
+    free(tiles);
+
+    if (!aligned) volume_compact_tiles(dst, NULL);
+    volume_set(volume, dst);
+    volume_delete(dst);
+}
+
 void volume_move(volume_t *volume, const float mat[4][4])
 {
     float box[4][4];
-    volume_t *src_volume = volume_copy(volume);
+    volume_t *src_volume;
     float imat[4][4];
+    int perm[3], sign[3], t[3];
+
+    if (mat_is_voxel_transform(mat, perm, sign, t)) {
+        volume_move_voxels(volume, perm, sign, t);
+        return;
+    }
 
     mat4_invert(mat, imat);
     volume_get_box(volume, true, box);
     if (box_is_null(box)) return;
+    src_volume = volume_copy(volume);
     mat4_mul(mat, box, box);
     volume_fill(volume, box, volume_move_get_color,
                 USER_PASS(src_volume, &imat));
     volume_delete(src_volume);
-    volume_remove_empty_tiles(volume, false);
+    volume_remove_empty_tiles(volume);
+    // The volume only contains the voxels we just wrote.
+    volume_compact_tiles(volume, NULL);
 }
 
 void volume_blit(volume_t *volume, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
                volume_iterator_t *iter)
 {
-    volume_iterator_t default_iter = {0};
-    int pos[3];
-    if (!iter) iter = &default_iter;
-    for (pos[2] = z; pos[2] < z + d; pos[2]++)
-    for (pos[1] = y; pos[1] < y + h; pos[1]++)
-    for (pos[0] = x; pos[0] < x + w; pos[0]++) {
-        volume_set_at(volume, iter, pos, data);
-        data += 4;
-    }
-    volume_remove_empty_tiles(volume, false);
+    const int aabb[2][3] = {{x, y, z}, {x + w, y + h, z + d}};
+    volume_write_region(volume, aabb, data, NULL);
+    volume_compact_tiles(volume, aabb);
 }
 
 void volume_shift_alpha(volume_t *volume, int v)
@@ -275,27 +525,624 @@ static void combine(const uint8_t a[4], const uint8_t b[4], int mode,
 }
 
 
+// Classification of a tile relative to a shape.
+enum {
+    TILE_PARTIAL,
+    TILE_INSIDE,    // All the voxels get the full painter color.
+    TILE_OUTSIDE,   // All the voxels get a zero alpha painter color.
+};
+
+// Result of the operation on a tile.  The results are computed in parallel
+// and then applied to the volume from the calling thread.
+enum {
+    OP_TILE_KEEP,
+    OP_TILE_CLEAR,
+    OP_TILE_FILL,   // Fill the tile with the painter color.
+    OP_TILE_WRITE,  // Replace the tile with the computed voxels.
+};
+
+typedef struct {
+    int     pos[3];
+    int     sym_mask;   // Mirrors of the symmetry applied to this tile.
+    int     action;
+    uint8_t (*data)[4]; // The new voxels for OP_TILE_WRITE.
+    uint8_t (*tmp)[4];  // Buffer for the mirrored shape values.
+} op_tile_t;
+
+// State shared by all the tiles of a volume_op call.
+typedef struct {
+    const painter_t *painter;
+    const volume_t *volume;
+    float   mat[4][4];  // Transformation from world to shape space.
+    float   size[3];    // Size of the shape.
+    bool    use_box;
+    bool    skip_src_empty;
+    bool    skip_dst_empty;
+    op_tile_t *tiles;   // Current batch of tiles.
+    volume_t *fill;     // Volume with a single uniform tile of the color.
+
+    // For the single pass symmetry.
+    const volume_t *shape;  // Painter color with the alpha of the shape.
+    int     sym_order[8];   // Mirrors in order of application.
+    int     sym_nb;
+    int     sym_offset[3];  // Mirror of voxel x is at offset - x.
+} op_t;
+
+/*
+ * Check if an ellipse (or ellipsoid if dim is 3) of half axes a contains or
+ * misses all the points.  Since the shapes are convex, testing the corners
+ * of a tile is enough for the inside check.  For the outside check we use
+ * the bounding sphere of the points in the space where the ellipse is a
+ * unit sphere.
+ */
+static bool ellipse_contains(const float (*points)[3], int n, int dim,
+                             const float a[3])
+{
+    int i, j;
+    float d, x;
+    for (j = 0; j < dim; j++) if (a[j] <= 0) return false;
+    for (i = 0; i < n; i++) {
+        d = 0;
+        for (j = 0; j < dim; j++) {
+            x = points[i][j] / a[j];
+            d += x * x;
+        }
+        if (d > 1) return false;
+    }
+    return true;
+}
+
+static bool ellipse_misses(const float (*points)[3], int n, int dim,
+                           const float a[3])
+{
+    int i, j;
+    float c[3] = {0}, r = 0, d, x;
+    for (i = 0; i < n; i++)
+        for (j = 0; j < dim; j++) c[j] += points[i][j] / a[j] / n;
+    for (i = 0; i < n; i++) {
+        d = 0;
+        for (j = 0; j < dim; j++) {
+            x = points[i][j] / a[j] - c[j];
+            d += x * x;
+        }
+        r = max(r, d);
+    }
+    d = 0;
+    for (j = 0; j < dim; j++) d += c[j] * c[j];
+    return sqrt(d) - sqrt(r) > 1;
+}
+
+/*
+ * Conservative classification of a tile against the shape of an operation,
+ * so that we can skip the per voxel evaluation of the shape function.
+ * Only the sphere, cube and cylinder shapes are supported, for the others
+ * we always return TILE_PARTIAL.
+ */
+static int op_classify_tile(const op_t *op, const int pos[3])
+{
+    const shape_t *shape = op->painter->shape;
+    const float *s = op->size;
+    float sm = op->painter->smoothness;
+    float p[3], pts[8][3], lo[3], hi[3], a[3], eps, w = 0, min_s;
+    int i, j;
+
+    if (    shape != &shape_sphere && shape != &shape_cube &&
+            shape != &shape_cylinder)
+        return TILE_PARTIAL;
+
+    // Centers of the corner voxels in the shape space.
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+            p[j] = pos[j] + ((i >> j) & 1 ? N - 0.5 : 0.5);
+            w = max(w, fabs(p[j]));
+        }
+        if (op->use_box && !bbox_contains_vec(*op->painter->box, p))
+            return TILE_PARTIAL;
+        mat4_mul_vec3(op->mat, p, pts[i]);
+    }
+    // Margin to be safe against floating point rounding errors.
+    eps = 1e-4 * (1 + w + max(s[0], max(s[1], s[2])));
+
+    vec3_copy(pts[0], lo);
+    vec3_copy(pts[0], hi);
+    for (i = 1; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+            lo[j] = min(lo[j], pts[i][j]);
+            hi[j] = max(hi[j], pts[i][j]);
+        }
+    }
+    for (j = 0; j < 3; j++) {
+        if (lo[j] > s[j] + sm + eps || hi[j] < -s[j] - sm - eps)
+            return TILE_OUTSIDE;
+    }
+
+    if (shape == &shape_cube) {
+        for (j = 0; j < 3; j++) {
+            if (lo[j] < -s[j] + sm + eps || hi[j] > s[j] - sm - eps)
+                return TILE_PARTIAL;
+        }
+        return TILE_INSIDE;
+    }
+
+    // For the sphere and the cylinder, the points at a distance smoothness
+    // from the surface are all inside the ellipse scaled by
+    // (1 +/- smoothness / r), with r the smallest radius.
+    if (shape == &shape_sphere) {
+        min_s = min(s[0], min(s[1], s[2]));
+        for (j = 0; j < 3; j++) a[j] = s[j] * (1 + sm / min_s) + eps;
+        if (ellipse_misses(pts, 8, 3, a)) return TILE_OUTSIDE;
+        for (j = 0; j < 3; j++) a[j] = s[j] * (1 - sm / min_s) - eps;
+        if (ellipse_contains(pts, 8, 3, a)) return TILE_INSIDE;
+        return TILE_PARTIAL;
+    }
+
+    // Cylinder.
+    min_s = min(s[0], s[1]);
+    for (j = 0; j < 2; j++) a[j] = s[j] * (1 + sm / min_s) + eps;
+    if (ellipse_misses(pts, 8, 2, a)) return TILE_OUTSIDE;
+    if (lo[2] < -s[2] + sm + eps || hi[2] > s[2] - sm - eps)
+        return TILE_PARTIAL;
+    for (j = 0; j < 2; j++) a[j] = s[j] * (1 - sm / min_s) - eps;
+    if (ellipse_contains(pts, 8, 2, a)) return TILE_INSIDE;
+    return TILE_PARTIAL;
+}
+
+/*
+ * Apply the operation to the voxels of a tile, and put the result into
+ * data.  If c is NULL the color is computed from the shape at each voxel,
+ * otherwise the same color is used for all the voxels.
+ *
+ * Return false if the tile is not modified.
+ */
+static bool op_tile_voxels(const op_t *op, const int pos[3],
+                           const uint8_t const_c[4], uint8_t (*data)[4])
+{
+    const painter_t *painter = op->painter;
+    uint64_t mask[TILE_MASK_SIZE], bits;
+    int i, w, aabb[2][3];
+    uint8_t new_value[4], c[4];
+    float p[3], k, v;
+    bool changed = false;
+
+    if (op->skip_dst_empty) {
+        if (!volume_get_tile_mask(op->volume, pos, mask)) return false;
+    } else {
+        memset(mask, 0xff, sizeof(mask));
+    }
+    volume_get_tile_aabb(pos, aabb);
+    volume_read_region(op->volume, aabb, (uint8_t*)data, NULL);
+
+    for (w = 0; w < TILE_MASK_SIZE; w++) {
+        for (bits = mask[w]; bits; bits &= bits - 1) {
+            i = w * 64 + __builtin_ctzll(bits);
+            if (const_c) {
+                memcpy(c, const_c, 4);
+            } else {
+                vec3_set(p, pos[0] + i % N + 0.5,
+                            pos[1] + i / N % N + 0.5,
+                            pos[2] + i / (N * N) + 0.5);
+                if (op->use_box && !bbox_contains_vec(*painter->box, p))
+                    continue;
+                mat4_mul_vec3(op->mat, p, p);
+                k = painter->shape->func(p, op->size, painter->smoothness);
+                if (painter->smoothness) {
+                    v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f +
+                        0.5f;
+                } else {
+                    v = (k >= 0.f) ? 1.f : 0.f;
+                }
+                if (!v && op->skip_src_empty) continue;
+                memcpy(c, painter->color, 4);
+                c[3] *= v;
+            }
+            if (!c[3] && op->skip_src_empty) continue;
+            if (!data[i][3] && op->skip_dst_empty) continue;
+            combine(data[i], c, painter->mode, new_value);
+            if (!vec4_equal(data[i], new_value)) {
+                memcpy(data[i], new_value, 4);
+                changed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+// Compute the result of the operation on a tile.  This only reads the
+// volume, so it can be called from any thread.
+static void op_tile(void *user, int idx)
+{
+    const op_t *op = user;
+    op_tile_t *tile = &op->tiles[idx];
+    int mode = op->painter->mode;
+    int cls;
+    uint8_t c[4];
+
+    cls = op_classify_tile(op, tile->pos);
+    if (cls == TILE_PARTIAL) {
+        tile->action = op_tile_voxels(op, tile->pos, NULL, tile->data) ?
+                       OP_TILE_WRITE : OP_TILE_KEEP;
+        return;
+    }
+    memcpy(c, op->painter->color, 4);
+    if (cls == TILE_OUTSIDE) c[3] = 0;
+
+    // Check if the constant color gives a trivial result.
+    tile->action = OP_TILE_KEEP;
+    if (c[3] == 0 && (op->skip_src_empty ||
+                      mode == MODE_PAINT || mode == MODE_OVER))
+        return;
+    if (c[3] == 255 && mode == MODE_MULT_ALPHA)
+        return;
+    if (    (c[3] == 0 && (mode == MODE_INTERSECT ||
+                           mode == MODE_INTERSECT_FILL)) ||
+            (c[3] == 255 && (mode == MODE_SUB || mode == MODE_SUB_CLAMP))) {
+        tile->action = OP_TILE_CLEAR;
+        return;
+    }
+    if (    c[3] == 255 && !op->skip_dst_empty &&
+            (mode == MODE_OVER || mode == MODE_MAX)) {
+        tile->action = OP_TILE_FILL;
+        return;
+    }
+    if (op_tile_voxels(op, tile->pos, c, tile->data))
+        tile->action = OP_TILE_WRITE;
+}
+
+// Apply the computed result of a tile to the volume.
+static void op_tile_apply(op_t *op, volume_t *volume, const op_tile_t *tile)
+{
+    static const int origin[3] = {0, 0, 0};
+    uint8_t (*data)[4];
+    int i, aabb[2][3];
+
+    switch (tile->action) {
+    case OP_TILE_CLEAR:
+        volume_clear_tile(volume, NULL, tile->pos);
+        break;
+    case OP_TILE_FILL:
+        // All the filled tiles share the data of a single uniform tile.
+        if (!op->fill) {
+            data = malloc(N * N * N * 4);
+            for (i = 0; i < N * N * N; i++)
+                memcpy(data[i], op->painter->color, 4);
+            op->fill = volume_new();
+            volume_get_tile_aabb(origin, aabb);
+            volume_write_region(op->fill, aabb, (uint8_t*)data, NULL);
+            volume_compact_tiles(op->fill, NULL);
+            free(data);
+        }
+        volume_copy_tile(op->fill, origin, volume, tile->pos);
+        break;
+    case OP_TILE_WRITE:
+        volume_get_tile_aabb(tile->pos, aabb);
+        volume_write_region(volume, aabb, (uint8_t*)tile->data, NULL);
+        break;
+    }
+}
+
+/*
+ * Apply the operation to a list of tiles.  The tiles are processed by
+ * batches: the results of a batch are computed in parallel into private
+ * buffers, then applied to the volume.
+ */
+static void op_tiles(op_t *op, volume_t *volume, op_tile_t *tiles, int nb,
+                     void (*func)(void *user, int idx))
+{
+    int i, j, batch_size, nb_bufs = op->shape ? 2 : 1;
+    uint8_t (*buf)[4];
+
+    if (nb == 0) return;
+    batch_size = min(nb, OP_BATCH_SIZE);
+    buf = malloc((size_t)batch_size * nb_bufs * N * N * N * 4);
+    op->volume = volume;
+
+    for (i = 0; i < nb; i += batch_size) {
+        batch_size = min(batch_size, nb - i);
+        op->tiles = tiles + i;
+        for (j = 0; j < batch_size; j++) {
+            op->tiles[j].data = buf + (size_t)j * nb_bufs * N * N * N;
+            op->tiles[j].tmp = op->shape ? op->tiles[j].data + N * N * N :
+                                           NULL;
+        }
+        workers_run(batch_size, func, op);
+        for (j = 0; j < batch_size; j++)
+            op_tile_apply(op, volume, &op->tiles[j]);
+    }
+
+    free(buf);
+    op->tiles = NULL;
+}
+
+static void op_init(op_t *op, const painter_t *painter, const float box[4][4])
+{
+    int mode = painter->mode;
+    memset(op, 0, sizeof(*op));
+    op->painter = painter;
+    box_get_size(box, op->size);
+    mat4_copy(box, op->mat);
+    mat4_iscale(op->mat, 1 / op->size[0], 1 / op->size[1], 1 / op->size[2]);
+    mat4_invert(op->mat, op->mat);
+    op->use_box = painter->box && !box_is_null(*painter->box);
+    op->skip_src_empty = mode == MODE_SUB ||
+                         mode == MODE_SUB_CLAMP ||
+                         mode == MODE_MULT_ALPHA;
+    op->skip_dst_empty = mode == MODE_SUB ||
+                         mode == MODE_SUB_CLAMP ||
+                         mode == MODE_MULT_ALPHA ||
+                         mode == MODE_INTERSECT ||
+                         mode == MODE_INTERSECT_FILL;
+}
+
+// Append the tiles of a box iteration to a list.
+static void op_collect_tiles(const volume_t *volume, const float box[4][4],
+                             int flags, int sym_mask, op_tile_t **tiles,
+                             int *nb, int *cap)
+{
+    volume_iterator_t iter;
+    int pos[3];
+
+    iter = volume_get_box_iterator(volume, box, flags | VOLUME_ITER_TILES);
+    while (volume_iter(&iter, pos)) {
+        if (*nb == *cap) {
+            *cap = max(64, *cap * 2);
+            *tiles = realloc(*tiles, *cap * sizeof(**tiles));
+        }
+        memset(&(*tiles)[*nb], 0, sizeof(**tiles));
+        memcpy((*tiles)[*nb].pos, pos, sizeof(pos));
+        (*tiles)[*nb].sym_mask = sym_mask;
+        (*nb)++;
+    }
+}
+
+static int op_tile_cmp(const void *a_, const void *b_)
+{
+    const op_tile_t *a = a_, *b = b_;
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (a->pos[i] != b->pos[i]) return a->pos[i] < b->pos[i] ? -1 : +1;
+    }
+    return 0;
+}
+
+// Sort a list of tiles and merge the duplicated positions.
+static int op_tiles_merge(op_tile_t *tiles, int nb)
+{
+    int i, n = 0;
+    if (nb == 0) return 0;
+    qsort(tiles, nb, sizeof(*tiles), op_tile_cmp);
+    for (i = 1; i < nb; i++) {
+        if (op_tile_cmp(&tiles[n], &tiles[i]) == 0)
+            tiles[n].sym_mask |= tiles[i].sym_mask;
+        else
+            tiles[++n] = tiles[i];
+    }
+    return n + 1;
+}
+
+// Compute the aabb of the mirror of a tile.
+static void op_mirror_tile_aabb(const op_t *op, const int pos[3], int mirror,
+                                int aabb[2][3])
+{
+    int i;
+    volume_get_tile_aabb(pos, aabb);
+    for (i = 0; i < 3; i++) {
+        if (!(mirror & (1 << i))) continue;
+        aabb[0][i] = op->sym_offset[i] - (pos[i] + N - 1);
+        aabb[1][i] = aabb[0][i] + N;
+    }
+}
+
+// Apply all the mirrors of the symmetry to a tile, reading the shape values
+// from the shape volume.
+static void op_sym_tile(void *user, int idx)
+{
+    const op_t *op = user;
+    const painter_t *painter = op->painter;
+    op_tile_t *tile = &op->tiles[idx];
+    uint8_t (*data)[4] = tile->data;
+    uint8_t new_value[4], c[4];
+    int i, j, k, mirror, aabb[2][3], strides[3];
+    float p[3];
+    size_t offset;
+    bool changed = false;
+
+    volume_get_tile_aabb(tile->pos, aabb);
+    volume_read_region(op->volume, aabb, (uint8_t*)data, NULL);
+
+    for (k = 0; k < op->sym_nb; k++) {
+        if (!(tile->sym_mask & (1 << k))) continue;
+        mirror = op->sym_order[k];
+        // Read the shape values with negative strides along the mirrored
+        // axis, so that they are aligned with the tile voxels.
+        op_mirror_tile_aabb(op, tile->pos, mirror, aabb);
+        offset = 0;
+        for (j = 0; j < 3; j++) {
+            strides[j] = 4 * (j == 0 ? 1 : j == 1 ? N : N * N);
+            if (!(mirror & (1 << j))) continue;
+            offset += (N - 1) * strides[j];
+            strides[j] = -strides[j];
+        }
+        volume_read_region(op->shape, aabb, (uint8_t*)tile->tmp + offset,
+                           strides);
+
+        for (i = 0; i < N * N * N; i++) {
+            if (op->use_box) {
+                vec3_set(p, tile->pos[0] + i % N + 0.5,
+                            tile->pos[1] + i / N % N + 0.5,
+                            tile->pos[2] + i / (N * N) + 0.5);
+                if (!bbox_contains_vec(*painter->box, p)) continue;
+            }
+            memcpy(c, painter->color, 4);
+            c[3] = tile->tmp[i][3];
+            if (!c[3] && op->skip_src_empty) continue;
+            if (!data[i][3] && op->skip_dst_empty) continue;
+            combine(data[i], c, painter->mode, new_value);
+            if (!vec4_equal(data[i], new_value)) {
+                memcpy(data[i], new_value, 4);
+                changed = true;
+            }
+        }
+    }
+    tile->action = changed ? OP_TILE_WRITE : OP_TILE_KEEP;
+}
+
+// Order in which the recursive symmetry applies the mirrors.
+static int op_symmetry_order(int sym, int mirror, int out[8], int n)
+{
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (!(sym & (1 << i))) continue;
+        sym &= ~(1 << i);
+        n = op_symmetry_order(sym, mirror | (1 << i), out, n);
+    }
+    out[n++] = mirror;
+    return n;
+}
+
+// Mirror a box around the symmetry origin.
+static void op_mirror_box(const painter_t *painter, const float box[4][4],
+                          int mirror, float out[4][4])
+{
+    const float *o = painter->symmetry_origin;
+    float m[4][4];
+    int i;
+    mat4_copy(box, out);
+    for (i = 0; i < 3; i++) {
+        if (!(mirror & (1 << i))) continue;
+        mat4_set_identity(m);
+        mat4_itranslate(m, +o[0], +o[1], +o[2]);
+        if (i == 0) mat4_iscale(m, -1,  1,  1);
+        if (i == 1) mat4_iscale(m,  1, -1,  1);
+        if (i == 2) mat4_iscale(m,  1,  1, -1);
+        mat4_itranslate(m, -o[0], -o[1], -o[2]);
+        mat4_imul(m, out);
+        mat4_copy(m, out);
+    }
+}
+
+// Check if we can use the single pass symmetry: the mirrors have to map
+// voxels to voxels.
+static bool op_can_use_single_pass_symmetry(const painter_t *painter)
+{
+    int i;
+    float o;
+    if (    painter->mode == MODE_INTERSECT ||
+            painter->mode == MODE_INTERSECT_FILL)
+        return false;
+    for (i = 0; i < 3; i++) {
+        if (!(painter->symmetry & (1 << i))) continue;
+        o = painter->symmetry_origin[i] * 2;
+        if (o != floorf(o) || fabs(o) > (1 << 24)) return false;
+    }
+    return true;
+}
+
+/*
+ * Apply an operation with all its symmetry mirrors in a single pass.
+ *
+ * This gives the same result as applying the operation once per mirror,
+ * but we only evaluate the shape once: we first render the shape alpha
+ * into a temporary volume, then for each tile we apply all the mirrors in
+ * a row, reading the shape values at the mirrored positions.
+ *
+ * Set the aabb of all the modified tiles and return the number of tiles
+ * written.
+ */
+static int op_apply_symmetry(op_t *op, volume_t *volume,
+                              const float box[4][4], int aabb[2][3])
+{
+    const painter_t *painter = op->painter;
+    painter_t shape_painter;
+    op_t shape_op;
+    op_tile_t *tiles = NULL, *src_tiles = NULL;
+    int i, j, k, nb = 0, cap = 0, src_nb = 0, src_cap = 0, flags;
+    int src_aabb[2][3], box_aabb[2][3], p[3];
+    float mbox[4][4];
+    volume_t *shape;
+
+    op->sym_nb = op_symmetry_order(painter->symmetry, 0, op->sym_order, 0);
+    for (i = 0; i < 3; i++)
+        op->sym_offset[i] = painter->symmetry_origin[i] * 2 - 1;
+
+    // List all the tiles touched by each mirror.
+    flags = op->skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0;
+    for (k = 0; k < op->sym_nb; k++) {
+        op_mirror_box(painter, box, op->sym_order[k], mbox);
+        op_collect_tiles(volume, mbox, flags, 1 << k, &tiles, &nb, &cap);
+        box_get_aabb(mbox, box_aabb);
+        if (k == 0) memcpy(aabb, box_aabb, sizeof(box_aabb));
+        for (i = 0; i < 3; i++) {
+            aabb[0][i] = min(aabb[0][i], box_aabb[0][i]);
+            aabb[1][i] = max(aabb[1][i], box_aabb[1][i]);
+        }
+    }
+    nb = op_tiles_merge(tiles, nb);
+
+    // List all the tiles of the shape we need to read.
+    for (i = 0; i < nb; i++) {
+        for (k = 0; k < op->sym_nb; k++) {
+            if (!(tiles[i].sym_mask & (1 << k))) continue;
+            op_mirror_tile_aabb(op, tiles[i].pos, op->sym_order[k],
+                                src_aabb);
+            for (j = 0; j < 8; j++) {
+                p[0] = src_aabb[(j >> 0) & 1][0] - ((j >> 0) & 1);
+                p[1] = src_aabb[(j >> 1) & 1][1] - ((j >> 1) & 1);
+                p[2] = src_aabb[(j >> 2) & 1][2] - ((j >> 2) & 1);
+                if (src_nb == src_cap) {
+                    src_cap = max(64, src_cap * 2);
+                    src_tiles = realloc(src_tiles,
+                                        src_cap * sizeof(*src_tiles));
+                }
+                memset(&src_tiles[src_nb], 0, sizeof(*src_tiles));
+                src_tiles[src_nb].pos[0] = p[0] & ~(int)(N - 1);
+                src_tiles[src_nb].pos[1] = p[1] & ~(int)(N - 1);
+                src_tiles[src_nb].pos[2] = p[2] & ~(int)(N - 1);
+                src_nb++;
+            }
+        }
+    }
+    src_nb = op_tiles_merge(src_tiles, src_nb);
+
+    // Render the shape.
+    shape_painter = (painter_t) {
+        .mode = MODE_OVER,
+        .shape = painter->shape,
+        .smoothness = painter->smoothness,
+    };
+    memcpy(shape_painter.color, painter->color, 4);
+    op_init(&shape_op, &shape_painter, box);
+    shape = volume_new();
+    op_tiles(&shape_op, shape, src_tiles, src_nb, op_tile);
+    if (shape_op.fill) volume_delete(shape_op.fill);
+
+    op->shape = shape;
+    op_tiles(op, volume, tiles, nb, op_sym_tile);
+    op->shape = NULL;
+
+    volume_delete(shape);
+    free(src_tiles);
+    free(tiles);
+    return nb;
+}
+
 void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4])
 {
     int i, vp[3];
-    uint8_t value[4], new_value[4], c[4];
     volume_iterator_t iter;
-    volume_accessor_t accessor;
-    float size[3], p[3];
-    float mat[4][4];
-    float (*shape_func)(const float[3], const float[3], float smoothness);
-    float k, v;
     int mode = painter->mode;
-    bool use_box, skip_src_empty, skip_dst_empty;
     painter_t painter2;
     float box2[4][4];
     int aabb[2][3];
     volume_t *cached;
     static cache_t *cache = NULL;
     const float *sym_o = painter->symmetry_origin;
+    op_t op;
+    int flags, nb_tiles = 0, tiles_cap = 0;
+    op_tile_t *tiles = NULL;
 
     // Check if the operation has been cached.
-    if (!cache) cache = cache_create("volume_op", 32);
+    if (!cache) cache = cache_create("volume_op", 64 * MB,
+                                    CACHE_SHARED_MEM);
     struct {
         uint64_t  id;
         float     box[4][4];
@@ -311,6 +1158,15 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
         return;
     }
 
+    op_init(&op, painter, box);
+
+    if (painter->symmetry && op_can_use_single_pass_symmetry(painter)) {
+        nb_tiles = op_apply_symmetry(&op, volume, box, aabb);
+        if (op.fill) volume_delete(op.fill);
+        volume_compact_tiles(volume, aabb);
+        goto end;
+    }
+
     if (painter->symmetry) {
         painter2 = *painter;
         for (i = 0; i < 3; i++) {
@@ -327,20 +1183,7 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
         }
     }
 
-    shape_func = painter->shape->func;
-    box_get_size(box, size);
-    mat4_copy(box, mat);
-    mat4_iscale(mat, 1 / size[0], 1 / size[1], 1 / size[2]);
-    mat4_invert(mat, mat);
-    use_box = painter->box && !box_is_null(*painter->box);
-    skip_src_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA;
-    skip_dst_empty = mode == MODE_SUB ||
-                     mode == MODE_SUB_CLAMP ||
-                     mode == MODE_MULT_ALPHA ||
-                     mode == MODE_INTERSECT ||
-                     mode == MODE_INTERSECT_FILL;
+    flags = op.skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0;
 
     // for intersection start by deleting all the tiles that are not in
     // the box and then iter all the rest.
@@ -351,38 +1194,34 @@ void volume_op(volume_t *volume, const painter_t *painter, const float box[4][4]
             if (box_intersect_aabb(box, aabb)) continue;
             volume_clear_tile(volume, &iter, vp);
         }
-        iter = volume_get_iterator(
-                volume, skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0);
+        iter = volume_get_iterator(volume, flags | VOLUME_ITER_TILES);
+        while (volume_iter(&iter, vp)) {
+            if (nb_tiles == tiles_cap) {
+                tiles_cap = max(64, tiles_cap * 2);
+                tiles = realloc(tiles, tiles_cap * sizeof(*tiles));
+            }
+            memset(&tiles[nb_tiles], 0, sizeof(*tiles));
+            memcpy(tiles[nb_tiles++].pos, vp, sizeof(vp));
+        }
     } else {
-        iter = volume_get_box_iterator(
-                volume, box, skip_dst_empty ? VOLUME_ITER_SKIP_EMPTY : 0);
+        op_collect_tiles(volume, box, flags, 0, &tiles, &nb_tiles,
+                         &tiles_cap);
     }
+    op_tiles(&op, volume, tiles, nb_tiles, op_tile);
+    free(tiles);
+    if (op.fill) volume_delete(op.fill);
 
-    // XXX: for the moment we cannot use the same accessor for both
-    // setting and getting!  Need to fix that!!
-    accessor = volume_get_accessor(volume);
-    while (volume_iter(&iter, vp)) {
-        vec3_set(p, vp[0] + 0.5, vp[1] + 0.5, vp[2] + 0.5);
-        if (use_box && !bbox_contains_vec(*painter->box, p)) continue;
-        mat4_mul_vec3(mat, p, p);
-        k = shape_func(p, size, painter->smoothness);
-        if (painter->smoothness) {
-            v = clamp(k / painter->smoothness, -1.0f, 1.0f) / 2.0f + 0.5f;
-        } else {
-            v = (k >= 0.f) ? 1.f : 0.f;
-        }
-        if (!v && skip_src_empty) continue;
-        memcpy(c, painter->color, 4);
-        c[3] *= v;
-        if (!c[3] && skip_src_empty) continue;
-        volume_get_at(volume, &accessor, vp, value);
-        if (!value[3] && skip_dst_empty) continue;
-        combine(value, c, mode, new_value);
-        if (!vec4_equal(value, new_value))
-            volume_set_at(volume, &accessor, vp, new_value);
-    }
-
-    cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
+    // Solid regions can be stored as uniform tiles.
+    if (mode == MODE_INTERSECT || mode == MODE_INTERSECT_FILL) {
+        volume_compact_tiles(volume, NULL);
+    } else {
+        box_get_aabb(box, aabb);
+        volume_compact_tiles(volume, aabb);
+    }
+
+end:
+    cache_add(cache, &key, sizeof(key), volume_copy(volume),
+              volume_cache_cost(volume, nb_tiles), volume_del);
 }
 
 // XXX: remove this function!
@@ -393,20 +1232,134 @@ void volume_get_box(const volume_t *volume, bool exact, float box[4][4])
     bbox_from_aabb(box, bbox);
 }
 
-static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3],
-                        int mode, const uint8_t color[4])
+/*
+ * Vectorized blending of voxels buffers, using the gcc vector extensions
+ * so that the compiler generates SSE2, AVX2 or NEON code depending on the
+ * target.  Each lane of a vector is one RGBA voxel, with the alpha in the
+ * upper byte.
+ */
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#   define COMBINE_SIMD 1
+typedef uint32_t v4u __attribute__((vector_size(16)));
+#else
+#   define COMBINE_SIMD 0
+#endif
+
+// Exact x * y / 255 for x and y in [0, 255].
+#define MUL255(x, y) ((((x) * (y) + 1) * 257) >> 16)
+
+#if COMBINE_SIMD
+
+static v4u v4u_min(v4u a, v4u b)
 {
-    int p[3];
-    int x, y, z;
-    uint64_t id1, id2;
-    volume_t *tile;
-    uint8_t v1[4], v2[4];
-    static cache_t *cache = NULL;
-    volume_accessor_t a1, a2, a3;
+    v4u m = (v4u)(a < b);
+    return (a & m) | (b & ~m);
+}
+
+static v4u v4u_mul255(v4u a, v4u b)
+{
+    v4u ret = {0};
+    int k;
+    for (k = 0; k < 32; k += 8)
+        ret |= MUL255((a >> k) & 0xff, (b >> k) & 0xff) << k;
+    return ret;
+}
+
+#endif
 
-    volume_get_tile_data(volume,  NULL, pos, &id1);
-    volume_get_tile_data(other, NULL, pos, &id2);
+/*
+ * Blend n voxels of b into a, with the same results as combine.  If color
+ * is set, the voxels of b are first multiplied by it.
+ *
+ * The OVER and PAINT modes need a division for semi transparent voxels of
+ * b, so those voxels fall back to combine.  In practice most voxels are
+ * either fully opaque or empty.
+ */
+static void combine_voxels(uint8_t (*a)[4], const uint8_t (*b)[4], int n,
+                           int mode, const uint8_t color[4])
+{
+    int i = 0, k;
+    uint8_t v[4];
+#if COMBINE_SIMD
+    const v4u rgb = (v4u){0} + 0xffffff;
+    v4u va, vb, vc = {0}, aa, ba, m, ret, slow;
+    uint32_t c;
 
+    if (color) {
+        memcpy(&c, color, 4);
+        vc = (v4u){0} + c;
+    }
+    for (i = 0; i + 4 <= n; i += 4) {
+        memcpy(&va, a[i], 16);
+        memcpy(&vb, b[i], 16);
+        if (color) vb = v4u_mul255(vb, vc);
+        aa = va >> 24;
+        ba = vb >> 24;
+        slow = (v4u){0};
+        switch (mode) {
+        case MODE_OVER:
+            m = (v4u)(ba == 255);
+            ret = (vb & m) | (va & ~m);
+            slow = (v4u)(ba != 255) & (v4u)(ba != 0);
+            break;
+        case MODE_PAINT:
+            m = (v4u)(ba == 255);
+            ret = (((vb & rgb) | (va & ~rgb)) & m) | (va & ~m);
+            slow = (v4u)(ba != 255) & (v4u)(ba != 0);
+            break;
+        case MODE_SUB:
+            m = (v4u)(aa > ba);
+            ret = (va & rgb) | (((aa - ba) & m) << 24);
+            break;
+        case MODE_MAX:
+            m = (v4u)(aa > ba);
+            ret = (vb & rgb) | (((aa & m) | (ba & ~m)) << 24);
+            break;
+        case MODE_SUB_CLAMP:
+            ret = (va & rgb) | (v4u_min(aa, 255 - ba) << 24);
+            break;
+        case MODE_MULT_ALPHA:
+            ret = v4u_mul255(va, ba * 0x01010101);
+            break;
+        case MODE_INTERSECT:
+            ret = (va & rgb) | (v4u_min(aa, ba) << 24);
+            break;
+        case MODE_INTERSECT_FILL:
+            aa = v4u_min(aa, ba);
+            m = (v4u)(aa != 0);
+            ret = (((vb & m) | (va & ~m)) & rgb) | (aa << 24);
+            break;
+        default:
+            assert(false);
+            ret = va;
+            break;
+        }
+        memcpy(a[i], &ret, 16);
+        for (k = 0; k < 4; k++) {
+            if (!slow[k]) continue;
+            c = va[k];
+            memcpy(a[i + k], &c, 4);
+            c = vb[k];
+            memcpy(v, &c, 4);
+            combine(a[i + k], v, mode, a[i + k]);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        memcpy(v, b[i], 4);
+        if (color) color_mul(v, color, v);
+        combine(a[i], v, mode, a[i]);
+    }
+}
+
+/*
+ * Handle the merge of the tiles that don't need any computation.
+ * Return true if the tile has been handled.
+ */
+static bool tile_merge_trivial(volume_t *volume, const volume_t *other,
+                               const int pos[3], uint64_t id1, uint64_t id2,
+                               int mode, const uint8_t color[4])
+{
     // XXX: cleanup this code!
 
     if (    (mode == MODE_OVER ||
@@ -414,65 +1367,127 @@ static void tile_merge(volume_t *volume, const volume_t *other, const int pos[3]
              mode == MODE_SUB ||
              mode == MODE_SUB_CLAMP) && id2 == 0)
     {
-        return;
+        return true;
     }
 
     if ((mode == MODE_OVER || mode == MODE_MAX) && id1 == 0 && !color) {
         volume_copy_tile(other, pos, volume, pos);
-        return;
+        return true;
     }
 
-    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return;
+    if ((mode == MODE_MULT_ALPHA) && id1 == 0) return true;
     if ((mode == MODE_MULT_ALPHA) && id2 == 0) {
         // XXX: could just delete the tile.
     }
+    return false;
+}
 
-    // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("tile_merge", 2048);
-    struct {
-        uint64_t id1;
-        uint64_t id2;
-        int      mode;
-        uint8_t  color[4];
-    } key = { id1, id2, mode };
-    if (color) memcpy(key.color, color, 4);
-    _Static_assert(sizeof(key) == 24, "");
-    tile = cache_get(cache, &key, sizeof(key));
-    if (tile) goto end;
+/*
+ * Compute the merge of a tile into a new volume with a single tile at the
+ * origin, using the given scratch buffer of 2 * N^3 voxels.  This only
+ * reads the volumes, so it can run from any thread.
+ */
+static volume_t *tile_merge_compute(const volume_t *volume,
+                                    const volume_t *other, const int pos[3],
+                                    int mode, const uint8_t color[4],
+                                    uint8_t (*buf)[4])
+{
+    static const int origin[3] = {0, 0, 0};
+    volume_t *tile;
+    int aabb[2][3];
+
+    volume_get_tile_aabb(pos, aabb);
+    volume_read_region(volume, aabb, (uint8_t*)buf, NULL);
+    volume_read_region(other, aabb, (uint8_t*)(buf + N * N * N), NULL);
+    combine_voxels(buf, buf + N * N * N, N * N * N, mode, color);
 
     tile = volume_new();
-    a1 = volume_get_accessor(volume);
-    a2 = volume_get_accessor(other);
-    a3 = volume_get_accessor(tile);
+    volume_get_tile_aabb(origin, aabb);
+    volume_write_region(tile, aabb, (uint8_t*)buf, NULL);
+    volume_compact_tiles(tile, NULL);
+    return tile;
+}
 
-    for (z = 0; z < N; z++)
-    for (y = 0; y < N; y++)
-    for (x = 0; x < N; x++) {
-        p[0] = pos[0] + x;
-        p[1] = pos[1] + y;
-        p[2] = pos[2] + z;
-        volume_get_at(volume, &a1, p, v1);
-        volume_get_at(other, &a2, p, v2);
-        if (color) color_mul(v2, color, v2);
-        combine(v1, v2, mode, v1);
-        volume_set_at(tile, &a3, (int[]){x, y, z}, v1);
-    }
-    cache_add(cache, &key, sizeof(key), tile, 1, volume_del);
+// Put the result of a tile merge into the volume.
+static void tile_merge_apply(volume_t *volume, const int pos[3],
+                             const volume_t *tile)
+{
+    static const int origin[3] = {0, 0, 0};
+    // The tile is removed by volume_write_region if the result is empty.
+    if (volume_get_tile_id(tile, origin))
+        volume_copy_tile(tile, origin, volume, pos);
+    else
+        volume_clear_tile(volume, NULL, pos);
+}
 
-end:
-    volume_copy_tile(tile, (int[]){0, 0, 0}, volume, pos);
-    return;
+typedef struct {
+    uint64_t id1;
+    uint64_t id2;
+    int      mode;
+    uint8_t  color[4];
+} tile_merge_key_t;
+
+// A tile merge that was not in the cache.  Several tiles with the same
+// key share the same job.
+typedef struct {
+    UT_hash_handle      hh;
+    tile_merge_key_t    key;
+    int                 pos[3];
+    volume_t            *tile;
+} merge_job_t;
+
+typedef struct {
+    volume_t        *volume;
+    const volume_t  *other;
+    int             mode;
+    const uint8_t   *color;
+    merge_job_t     *jobs;
+    int             nb_jobs;
+    int             nb_batches;
+} merge_t;
+
+// Compute a batch of tile merges.
+static void merge_batch_func(void *user, int i)
+{
+    merge_t *merge = user;
+    merge_job_t *job;
+    int j;
+    int start = (int64_t)merge->nb_jobs * i / merge->nb_batches;
+    int end = (int64_t)merge->nb_jobs * (i + 1) / merge->nb_batches;
+    uint8_t (*buf)[4];
+
+    buf = malloc(2 * N * N * N * 4);
+    for (j = start; j < end; j++) {
+        job = &merge->jobs[j];
+        job->tile = tile_merge_compute(merge->volume, merge->other, job->pos,
+                                       merge->mode, merge->color, buf);
+    }
+    free(buf);
 }
 
+/*
+ * The merge is done in three passes:
+ * - First we handle the tiles that are trivial or already in the cache,
+ *   and list the remaining merges, without duplicates.
+ * - Then we compute those merges in parallel.  This only reads the volumes.
+ * - Finally we put the results into the volume and the cache, in the
+ *   tiles order, so that the result doesn't depend on the threads.
+ */
 void volume_merge(volume_t *volume, const volume_t *other, int mode,
                 const uint8_t color[4])
 {
-    volume_t *cached;
+    volume_t *cached, *tile;
     assert(volume && other);
     static cache_t *cache = NULL;
+    static cache_t *tiles_cache = NULL;
     volume_iterator_t iter;
-    int bpos[3];
+    int i, bpos[3], nb_jobs = 0, jobs_cap = 0, nb = 0, cap = 0;
     uint64_t id1, id2;
+    tile_merge_key_t tile_key;
+    merge_job_t *jobs = NULL, *jobs_table = NULL, *job;
+    // Tiles waiting for a job result, and the index of their job.
+    struct { int pos[3]; int job; } *waiting = NULL;
+    merge_t merge;
 
     // Simple case for replace.
     if (mode == MODE_REPLACE) {
@@ -481,7 +1496,10 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
     }
 
     // Check if the merge op has been cached.
-    if (!cache) cache = cache_create("volume_merge", 512);
+    if (!cache) cache = cache_create("volume_merge", 128 * MB,
+                                    CACHE_SHARED_MEM);
+    if (!tiles_cache) tiles_cache = cache_create("tile_merge", 64 * MB,
+                                                CACHE_SHARED_MEM);
     id1 = volume_get_key(volume);
     id2 = volume_get_key(other);
     struct {
@@ -500,10 +1518,743 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
 
     iter = volume_get_union_iterator(volume, other, VOLUME_ITER_TILES);
     while (volume_iter(&iter, bpos)) {
-        tile_merge(volume, other, bpos, mode, color);
+        id1 = volume_get_tile_id(volume, bpos);
+        id2 = volume_get_tile_id(other, bpos);
+        if (tile_merge_trivial(volume, other, bpos, id1, id2, mode, color))
+            continue;
+        tile_key = (tile_merge_key_t){ id1, id2, mode };
+        if (color) memcpy(tile_key.color, color, 4);
+        _Static_assert(sizeof(tile_key) == 24, "");
+        tile = cache_get(tiles_cache, &tile_key, sizeof(tile_key));
+        if (tile) {
+            tile_merge_apply(volume, bpos, tile);
+            continue;
+        }
+        if (nb == cap) {
+            cap = max(64, cap * 2);
+            waiting = realloc(waiting, cap * sizeof(*waiting));
+        }
+        memcpy(waiting[nb].pos, bpos, sizeof(bpos));
+        HASH_FIND(hh, jobs_table, &tile_key, sizeof(tile_key), job);
+        if (job) {
+            waiting[nb++].job = job - jobs;
+            continue;
+        }
+        if (nb_jobs == jobs_cap) {
+            // Since the hash table points to the jobs array, we need to
+            // rebuild it when we grow the array.
+            HASH_CLEAR(hh, jobs_table);
+            jobs_cap = max(64, jobs_cap * 2);
+            jobs = realloc(jobs, jobs_cap * sizeof(*jobs));
+            for (i = 0; i < nb_jobs; i++)
+                HASH_ADD(hh, jobs_table, key, sizeof(tile_key), &jobs[i]);
+        }
+        job = &jobs[nb_jobs];
+        memset(job, 0, sizeof(*job));
+        job->key = tile_key;
+        memcpy(job->pos, bpos, sizeof(bpos));
+        HASH_ADD(hh, jobs_table, key, sizeof(tile_key), job);
+        waiting[nb++].job = nb_jobs++;
+    }
+    HASH_CLEAR(hh, jobs_table);
+
+    merge = (merge_t) {
+        .volume = volume,
+        .other = other,
+        .mode = mode,
+        .color = color,
+        .jobs = jobs,
+        .nb_jobs = nb_jobs,
+        .nb_batches = min(nb_jobs, workers_get_count() * 4),
+    };
+    workers_run(merge.nb_batches, merge_batch_func, &merge);
+
+    for (i = 0; i < nb; i++) {
+        job = &jobs[waiting[i].job];
+        tile_merge_apply(volume, waiting[i].pos, job->tile);
+    }
+    // Only add to the cache after we are done with the tiles, since adding
+    // an item can release old ones.
+    for (i = 0; i < nb_jobs; i++) {
+        cache_add(tiles_cache, &jobs[i].key, sizeof(jobs[i].key),
+                  jobs[i].tile, volume_cache_cost(jobs[i].tile, 1),
+                  volume_del);
+    }
+    free(waiting);
+    free(jobs);
+
+    cache_add(cache, &key, sizeof(key), volume_copy(volume),
+              volume_cache_cost(volume, nb_jobs), volume_del);
+}
+
+/*
+ * Morphology operations.
+ *
+ * We process the volume tile by tile.  For each tile we read the tile
+ * region grown by the radius of the structuring element, so that we also
+ * see the voxels of the neighbor tiles, and we convert it into occupancy
+ * bitmasks, with one 64 bits value per row of voxels along X.
+ *
+ * The structuring element is stored as a list of rows along X: for each
+ * (y, z) offset, all the x offsets in [-w, +w].  So we can dilate (or
+ * erode) each row once per distinct half width, and then combine the
+ * rows of the element with simple OR (or AND) operations.
+ */
+
+enum {
+    MORPH_DILATE,
+    MORPH_ERODE,
+    MORPH_SHELL,
+};
+
+// Size of the tile region we read, including the borders.
+#define MORPH_SIZE (N + 2 * MORPH_MAX_RADIUS)
+
+typedef struct {
+    int nb_rows;
+    struct { int y, z, w; } rows[(2 * MORPH_MAX_RADIUS + 1) *
+                                 (2 * MORPH_MAX_RADIUS + 1)];
+    // All the offsets of the element, sorted by distance.  Used to get the
+    // color of the voxels added by a dilation.
+    int nb_offsets;
+    int (*offsets)[3];
+} morph_element_t;
+
+typedef struct {
+    int         pos[3];
+    bool        changed;
+    uint8_t     (*data)[4];
+} morph_tile_t;
+
+typedef struct {
+    const volume_t          *volume;
+    int                     op;
+    int                     radius;
+    const morph_element_t   *element;
+    morph_tile_t            *tiles;
+    int                     nb_tiles;
+    int                     nb_batches;
+} morph_t;
+
+static int morph_offset_cmp(const void *a_, const void *b_)
+{
+    const int *a = a_, *b = b_;
+    int da = a[0] * a[0] + a[1] * a[1] + a[2] * a[2];
+    int db = b[0] * b[0] + b[1] * b[1] + b[2] * b[2];
+    if (da != db) return da < db ? -1 : +1;
+    return tile_pos_cmp(a, b);
+}
+
+static void morph_element_init(morph_element_t *element, int shape, int r)
+{
+    int x, y, z, w, d;
+
+    element->nb_rows = 0;
+    element->nb_offsets = 0;
+    element->offsets = malloc((2 * r + 1) * (2 * r + 1) * (2 * r + 1) *
+                              sizeof(*element->offsets));
+    for (z = -r; z <= r; z++)
+    for (y = -r; y <= r; y++) {
+        switch (shape) {
+        case MORPH_CROSS:
+            w = r - abs(y) - abs(z);
+            break;
+        case MORPH_SPHERE:
+            d = r * r - y * y - z * z;
+            for (w = -1; (w + 1) * (w + 1) <= d; w++) {}
+            break;
+        case MORPH_CUBE:
+        default:
+            w = r;
+            break;
+        }
+        if (w < 0) continue;
+        element->rows[element->nb_rows].y = y;
+        element->rows[element->nb_rows].z = z;
+        element->rows[element->nb_rows].w = w;
+        element->nb_rows++;
+        for (x = -w; x <= w; x++) {
+            element->offsets[element->nb_offsets][0] = x;
+            element->offsets[element->nb_offsets][1] = y;
+            element->offsets[element->nb_offsets][2] = z;
+            element->nb_offsets++;
+        }
+    }
+    qsort(element->offsets, element->nb_offsets, sizeof(*element->offsets),
+          morph_offset_cmp);
+}
+
+// Compute a single tile, using the given scratch buffers.
+static void morph_tile(const morph_t *morph, morph_tile_t *tile,
+                       uint8_t (*vox)[4],
+                       uint64_t (*rows)[MORPH_SIZE][MORPH_SIZE])
+{
+    const morph_element_t *element = morph->element;
+    const int r = morph->radius;
+    const int s = N + 2 * r;
+    const uint64_t mask = (1ULL << N) - 1;
+    const bool dilate = morph->op == MORPH_DILATE;
+    int i, x, y, z, w, aabb[2][3];
+    uint64_t m, res, v, orig, any, all, full;
+    const int *o;
+    const uint8_t *c;
+
+    volume_get_tile_aabb(tile->pos, aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] -= r;
+        aabb[1][i] += r;
+    }
+    volume_read_region(morph->volume, aabb, (uint8_t*)vox, NULL);
+
+    any = 0;
+    all = ~0ULL;
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++) {
+        m = 0;
+        for (x = 0; x < s; x++) {
+            if (vox[(z * s + y) * s + x][3]) m |= 1ULL << x;
+        }
+        rows[0][z][y] = m;
+        any |= m;
+        all &= m;
+    }
+
+    // Nothing changes if the region is empty, or full (except for the
+    // shell operation, that removes all the voxels).
+    tile->changed = false;
+    full = (s == 64) ? ~0ULL : (1ULL << s) - 1;
+    if (!any || (all == full && morph->op != MORPH_SHELL)) return;
+    if (all == full) {
+        memset(tile->data, 0, N * N * N * 4);
+        tile->changed = true;
+        return;
+    }
+
+    // rows[w] contains the rows dilated (or eroded) along X by w.
+    for (w = 1; w <= r; w++)
+    for (z = 0; z < s; z++)
+    for (y = 0; y < s; y++) {
+        m = rows[0][z][y];
+        rows[w][z][y] = dilate ?
+            rows[w - 1][z][y] | (m << w) | (m >> w) :
+            rows[w - 1][z][y] & (m << w) & (m >> w);
+    }
+
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++) {
+        res = dilate ? 0 : ~0ULL;
+        for (i = 0; i < element->nb_rows; i++) {
+            v = rows[element->rows[i].w][z + r + element->rows[i].z]
+                                        [y + r + element->rows[i].y];
+            res = dilate ? res | v : res & v;
+        }
+        res = (res >> r) & mask;
+        orig = (rows[0][z + r][y + r] >> r) & mask;
+        if (morph->op == MORPH_SHELL) res = orig & ~res;
+        if (res != orig) tile->changed = true;
+
+        for (x = 0; x < N; x++) {
+            c = vox[((z + r) * s + y + r) * s + x + r];
+            if (!((res >> x) & 1)) {
+                memset(tile->data[(z * N + y) * N + x], 0, 4);
+                continue;
+            }
+            if (!c[3]) {
+                // New voxel: use the color of the closest voxel.
+                for (i = 0; i < element->nb_offsets; i++) {
+                    o = element->offsets[i];
+                    c = vox[((z + r + o[2]) * s + y + r + o[1]) * s +
+                            x + r + o[0]];
+                    if (c[3]) break;
+                }
+            }
+            memcpy(tile->data[(z * N + y) * N + x], c, 4);
+        }
+    }
+}
+
+// Compute a batch of tiles.
+static void morph_batch_func(void *user, int i)
+{
+    morph_t *morph = user;
+    int t;
+    int start = (int64_t)morph->nb_tiles * i / morph->nb_batches;
+    int end = (int64_t)morph->nb_tiles * (i + 1) / morph->nb_batches;
+    uint8_t (*vox)[4];
+    uint64_t (*rows)[MORPH_SIZE][MORPH_SIZE];
+
+    vox = malloc(MORPH_SIZE * MORPH_SIZE * MORPH_SIZE * 4);
+    rows = malloc((morph->radius + 1) * sizeof(*rows));
+    for (t = start; t < end; t++)
+        morph_tile(morph, &morph->tiles[t], vox, rows);
+    free(vox);
+    free(rows);
+}
+
+static void volume_morph(volume_t *volume, int op, int shape, int radius)
+{
+    volume_iterator_t iter;
+    volume_t *dst;
+    morph_element_t element;
+    morph_t morph;
+    morph_tile_t *tiles = NULL;
+    int i, j, k, nb = 0, cap = 0, pos[3], aabb[2][3], batch_size;
+    uint8_t (*buf)[4];
+
+    radius = clamp(radius, 0, MORPH_MAX_RADIUS);
+    if (radius == 0) return;
+
+    // List the tiles to process.  A dilation can also add voxels in the
+    // neighbor tiles (the radius is never bigger than a tile).
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        for (k = 0; k < 27; k++) {
+            // k = 13 is the tile itself.
+            if (op != MORPH_DILATE && k != 13) continue;
+            if (nb == cap) {
+                cap = max(256, cap * 2);
+                tiles = realloc(tiles, cap * sizeof(*tiles));
+            }
+            tiles[nb].pos[0] = pos[0] + (k % 3 - 1) * N;
+            tiles[nb].pos[1] = pos[1] + (k / 3 % 3 - 1) * N;
+            tiles[nb].pos[2] = pos[2] + (k / 9 - 1) * N;
+            nb++;
+        }
+    }
+    if (nb == 0) return;
+    qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+    for (i = 0, j = 0; i < nb; i++) {
+        if (j && tile_pos_cmp(tiles[i].pos, tiles[j - 1].pos) == 0) continue;
+        tiles[j++] = tiles[i];
+    }
+    nb = j;
+
+    morph_element_init(&element, shape, radius);
+    morph = (morph_t) {
+        .volume = volume,
+        .op = op,
+        .radius = radius,
+        .element = &element,
+    };
+
+    // The tiles are processed by batches, we read from the original volume
+    // and write the changed tiles into a copy.
+    dst = volume_copy(volume);
+    batch_size = min(nb, OP_BATCH_SIZE);
+    buf = malloc((size_t)batch_size * N * N * N * 4);
+    for (i = 0; i < nb; i += batch_size) {
+        batch_size = min(batch_size, nb - i);
+        morph.tiles = tiles + i;
+        morph.nb_tiles = batch_size;
+        morph.nb_batches = min(batch_size, workers_get_count() * 4);
+        for (j = 0; j < batch_size; j++)
+            morph.tiles[j].data = buf + (size_t)j * N * N * N;
+        workers_run(morph.nb_batches, morph_batch_func, &morph);
+        for (j = 0; j < batch_size; j++) {
+            if (!morph.tiles[j].changed) continue;
+            volume_get_tile_aabb(morph.tiles[j].pos, aabb);
+            volume_write_region(dst, aabb, (uint8_t*)morph.tiles[j].data,
+                                NULL);
+        }
+    }
+    volume_compact_tiles(dst, NULL);
+    volume_set(volume, dst);
+
+    volume_delete(dst);
+    free(buf);
+    free(tiles);
+    free(element.offsets);
+}
+
+void volume_dilate(volume_t *volume, int shape, int radius)
+{
+    volume_morph(volume, MORPH_DILATE, shape, radius);
+}
+
+void volume_erode(volume_t *volume, int shape, int radius)
+{
+    volume_morph(volume, MORPH_ERODE, shape, radius);
+}
+
+void volume_shell(volume_t *volume, int shape, int thickness)
+{
+    volume_morph(volume, MORPH_SHELL, shape, thickness);
+}
+
+/*
+ * Signed distance field.
+ *
+ * The field is stored per tile, and the data of each tile only depends on
+ * the 27 tiles around it (since the max distance, plus the one voxel of
+ * padding we read around the tile, is never bigger than a tile).  So we
+ * cache the tiles data by the ids of those 27 tiles, and after a change of
+ * the volume we only recompute the tiles around the modified ones.
+ *
+ * The reference counters are not atomic: they are only updated from the
+ * main thread, like the caches.  The workers only set the initial
+ * reference of the data they create.
+ */
+
+// Value bigger than any squared distance we can get in a tile region.
+#define SDF_BIG (1 << 20)
+
+typedef struct {
+    int     ref;        // Main thread only.
+    bool    uniform;    // If set, all the values are equal to 'value'.
+    float   value;
+    float   dist[];
+} sdf_data_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             pos[3];
+    sdf_data_t      *data;
+} sdf_tile_t;
+
+struct volume_sdf {
+    int         ref;        // The cache and each user, main thread only.
+    int         max_dist;
+    sdf_tile_t  *tiles;
+};
+
+typedef struct {
+    int         max_dist;
+    uint64_t    ids[27];
+} sdf_key_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    sdf_key_t       key;
+    int             pos[3];
+    sdf_data_t      *data;
+} sdf_job_t;
+
+typedef struct {
+    const volume_t  *volume;
+    int             max_dist;
+    sdf_job_t       *jobs;
+} sdf_ctx_t;
+
+static int sdf_data_release(void *data_)
+{
+    sdf_data_t *data = data_;
+    if (--data->ref == 0) free(data);
+    return 0;
+}
+
+// Memory used by a tile data, for the caches.
+static uint64_t sdf_data_cost(const sdf_data_t *data)
+{
+    return data->uniform ? sizeof(*data) :
+                           sizeof(*data) + N * N * N * sizeof(float);
+}
+
+static int sdf_delete(void *sdf_)
+{
+    volume_sdf_t *sdf = sdf_;
+    sdf_tile_t *tile, *tmp;
+    if (--sdf->ref) return 0;
+    HASH_ITER(hh, sdf->tiles, tile, tmp) {
+        HASH_DEL(sdf->tiles, tile);
+        sdf_data_release(tile->data);
+        free(tile);
+    }
+    free(sdf);
+    return 0;
+}
+
+/*
+ * One dimension squared euclidean distance transform, from "Distance
+ * Transforms of Sampled Functions" by P. Felzenszwalb and D. Huttenlocher.
+ * f and d are accessed with a stride, v and z are work buffers of n and
+ * n + 1 elements.
+ */
+static void edt_1d(float *f, int n, int stride, int *v, float *z, float *d)
+{
+    int q, k = 0;
+    float s;
+    bool has_site = false, all_sites = true;
+
+    // Nothing to do if there is no site, or if all the values are sites.
+    for (q = 0; q < n; q++) {
+        if (f[q * stride] < SDF_BIG) has_site = true;
+        if (f[q * stride] != 0) all_sites = false;
+    }
+    if (!has_site || all_sites) return;
+
+    v[0] = 0;
+    z[0] = -FLT_MAX;
+    z[1] = +FLT_MAX;
+    for (q = 1; q < n; q++) {
+        while (true) {
+            s = ((f[q * stride] + q * q) -
+                 (f[v[k] * stride] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+            if (s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = +FLT_MAX;
+    }
+    k = 0;
+    for (q = 0; q < n; q++) {
+        while (z[k + 1] < q) k++;
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k] * stride];
+    }
+    for (q = 0; q < n; q++) f[q * stride] = d[q];
+}
+
+/*
+ * Squared distance transform of a s^3 grid, in place.  We only need the
+ * result in the center cube of size n, so the passes along Y and Z skip
+ * the lines outside of it.
+ */
+static void edt_3d(float *f, int s, int n, int *v, float *z, float *d)
+{
+    const int b = (s - n) / 2;
+    int i, j;
+    for (i = 0; i < s * s; i++)
+        edt_1d(f + i * s, s, 1, v, z, d);
+    for (i = 0; i < s; i++)
+    for (j = b; j < b + n; j++)
+        edt_1d(f + i * s * s + j, s, s, v, z, d);
+    for (i = b; i < b + n; i++)
+    for (j = b; j < b + n; j++)
+        edt_1d(f + i * s + j, s, s * s, v, z, d);
+}
+
+static void sdf_job_func(void *user, int idx)
+{
+    sdf_ctx_t *ctx = user;
+    sdf_job_t *job = &ctx->jobs[idx];
+    const int m = ctx->max_dist;
+    const int pad = m + 1;
+    const int s = N + 2 * pad;
+    int i, x, y, z, nb_solid = 0, aabb[2][3], *v;
+    uint8_t (*vox)[4];
+    float *out, *in, *zbuf, *dbuf, val;
+    bool solid;
+    sdf_data_t *data;
+
+    vox = malloc((size_t)s * s * s * 4);
+    volume_get_tile_aabb(job->pos, aabb);
+    for (i = 0; i < 3; i++) {
+        aabb[0][i] -= pad;
+        aabb[1][i] += pad;
+    }
+    volume_read_region(ctx->volume, aabb, (uint8_t*)vox, NULL);
+    for (i = 0; i < s * s * s; i++) nb_solid += vox[i][3] >= 127;
+
+    // Regions entirely empty or full.
+    if (nb_solid == 0 || nb_solid == s * s * s) {
+        data = calloc(1, sizeof(*data));
+        data->ref = 1; // Owned by the cache.
+        data->uniform = true;
+        data->value = nb_solid ? -m : +m;
+        job->data = data;
+        free(vox);
+        return;
+    }
+
+    // Distance to the solid voxels (out) and to the empty voxels (in).
+    out = malloc((size_t)s * s * s * sizeof(*out));
+    in = malloc((size_t)s * s * s * sizeof(*in));
+    v = malloc(s * sizeof(*v));
+    zbuf = malloc((s + 1) * sizeof(*zbuf));
+    dbuf = malloc(s * sizeof(*dbuf));
+    for (i = 0; i < s * s * s; i++) {
+        solid = vox[i][3] >= 127;
+        out[i] = solid ? 0 : SDF_BIG;
+        in[i] = solid ? SDF_BIG : 0;
+    }
+    edt_3d(out, s, N, v, zbuf, dbuf);
+    edt_3d(in, s, N, v, zbuf, dbuf);
+
+    // The surface is half way between the solid and empty voxels.
+    data = calloc(1, sizeof(*data) + N * N * N * sizeof(float));
+    data->ref = 1; // Owned by the cache.
+    for (z = 0; z < N; z++)
+    for (y = 0; y < N; y++)
+    for (x = 0; x < N; x++) {
+        i = ((z + pad) * s + y + pad) * s + x + pad;
+        if (vox[i][3] >= 127)
+            val = -(sqrtf(in[i]) - 0.5f);
+        else
+            val = sqrtf(out[i]) - 0.5f;
+        data->dist[(z * N + y) * N + x] = clamp(val, -m, +m);
+    }
+    data->uniform = true;
+    data->value = data->dist[0];
+    for (i = 1; i < N * N * N && data->uniform; i++)
+        data->uniform = data->dist[i] == data->value;
+    if (data->uniform) data = realloc(data, sizeof(*data));
+    job->data = data;
+
+    free(vox);
+    free(out);
+    free(in);
+    free(v);
+    free(zbuf);
+    free(dbuf);
+}
+
+volume_sdf_t *volume_compute_sdf(const volume_t *volume, int max_dist)
+{
+    static cache_t *cache = NULL;
+    static cache_t *tiles_cache = NULL;
+    volume_sdf_t *sdf;
+    volume_iterator_t iter;
+    sdf_key_t tile_key;
+    sdf_job_t *jobs = NULL, *jobs_table = NULL, *job;
+    sdf_tile_t *tile;
+    sdf_data_t *data;
+    sdf_ctx_t ctx;
+    int i, j, k, nb = 0, cap = 0, nb_jobs = 0, jobs_cap = 0, pos[3], p[3];
+    struct { int pos[3]; int job; sdf_data_t *data; } *tiles = NULL;
+    uint64_t cost = sizeof(*sdf);
+    struct {
+        uint64_t    key;
+        uint64_t    max_dist;
+    } key;
+
+    max_dist = clamp(max_dist, 1, N - 1);
+    key.key = volume_get_key(volume);
+    key.max_dist = max_dist;
+
+    if (!cache) cache = cache_create("volume_sdf", 256 * MB,
+                                    CACHE_SHARED_MEM);
+    if (!tiles_cache) tiles_cache = cache_create("sdf_tiles", 256 * MB, 0);
+    sdf = cache_get(cache, &key, sizeof(key));
+    if (sdf) {
+        sdf->ref++;
+        return sdf;
+    }
+
+    // List all the tiles close enough to a non empty tile.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
+    while (volume_iter(&iter, pos)) {
+        for (k = 0; k < 27; k++) {
+            if (nb == cap) {
+                cap = max(256, cap * 2);
+                tiles = realloc(tiles, cap * sizeof(*tiles));
+            }
+            tiles[nb].pos[0] = pos[0] + (k % 3 - 1) * N;
+            tiles[nb].pos[1] = pos[1] + (k / 3 % 3 - 1) * N;
+            tiles[nb].pos[2] = pos[2] + (k / 9 - 1) * N;
+            nb++;
+        }
+    }
+    if (nb) qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+    for (i = 0, j = 0; i < nb; i++) {
+        if (j && tile_pos_cmp(tiles[i].pos, tiles[j - 1].pos) == 0) continue;
+        tiles[j++] = tiles[i];
+    }
+    nb = j;
+
+    // Get the tiles data from the cache, or add a job to compute them.
+    for (i = 0; i < nb; i++) {
+        memset(&tile_key, 0, sizeof(tile_key));
+        tile_key.max_dist = max_dist;
+        for (k = 0; k < 27; k++) {
+            p[0] = tiles[i].pos[0] + (k % 3 - 1) * N;
+            p[1] = tiles[i].pos[1] + (k / 3 % 3 - 1) * N;
+            p[2] = tiles[i].pos[2] + (k / 9 - 1) * N;
+            tile_key.ids[k] = volume_get_tile_id(volume, p);
+        }
+        tiles[i].data = cache_get(tiles_cache, &tile_key, sizeof(tile_key));
+        tiles[i].job = -1;
+        if (tiles[i].data) {
+            tiles[i].data->ref++;
+            continue;
+        }
+        HASH_FIND(hh, jobs_table, &tile_key, sizeof(tile_key), job);
+        if (job) {
+            tiles[i].job = job - jobs;
+            continue;
+        }
+        if (nb_jobs == jobs_cap) {
+            // The hash table points to the jobs array, so we need to
+            // rebuild it when we grow the array.
+            HASH_CLEAR(hh, jobs_table);
+            jobs_cap = max(64, jobs_cap * 2);
+            jobs = realloc(jobs, jobs_cap * sizeof(*jobs));
+            for (j = 0; j < nb_jobs; j++)
+                HASH_ADD(hh, jobs_table, key, sizeof(tile_key), &jobs[j]);
+        }
+        job = &jobs[nb_jobs];
+        memset(job, 0, sizeof(*job));
+        memcpy(&job->key, &tile_key, sizeof(tile_key));
+        memcpy(job->pos, tiles[i].pos, sizeof(job->pos));
+        HASH_ADD(hh, jobs_table, key, sizeof(tile_key), job);
+        tiles[i].job = nb_jobs++;
+    }
+    HASH_CLEAR(hh, jobs_table);
+
+    ctx = (sdf_ctx_t) {
+        .volume = volume,
+        .max_dist = max_dist,
+        .jobs = jobs,
+    };
+    workers_run(nb_jobs, sdf_job_func, &ctx);
+
+    sdf = calloc(1, sizeof(*sdf));
+    sdf->ref = 2; // The cache and the caller.
+    sdf->max_dist = max_dist;
+    for (i = 0; i < nb; i++) {
+        data = tiles[i].data;
+        if (tiles[i].job != -1) {
+            data = jobs[tiles[i].job].data;
+            data->ref++;
+        }
+        // Don't store the tiles that are entirely outside.
+        if (data->uniform && data->value == max_dist) {
+            sdf_data_release(data);
+            continue;
+        }
+        tile = calloc(1, sizeof(*tile));
+        memcpy(tile->pos, tiles[i].pos, sizeof(tile->pos));
+        tile->data = data;
+        HASH_ADD(hh, sdf->tiles, pos, sizeof(tile->pos), tile);
+        cost += sizeof(*tile) + sdf_data_cost(data);
+    }
+
+    // Only add to the cache once all the tiles hold a reference to their
+    // data, since adding items can release old ones.
+    for (i = 0; i < nb_jobs; i++) {
+        data = jobs[i].data;
+        cache_add(tiles_cache, &jobs[i].key, sizeof(jobs[i].key), data,
+                  sdf_data_cost(data), sdf_data_release);
     }
+    // The sdf keeps its tiles data alive, even after they got removed from
+    // the tiles cache.  Since the caller holds its own reference, it stays
+    // valid even if the cache releases it right away because it is too big.
+    cache_add(cache, &key, sizeof(key), sdf, cost, sdf_delete);
+
+    free(tiles);
+    free(jobs);
+    return sdf;
+}
+
+void volume_sdf_release(volume_sdf_t *sdf)
+{
+    if (sdf) sdf_delete(sdf);
+}
+
+float volume_sdf_get(const volume_sdf_t *sdf, const int pos[3])
+{
+    sdf_tile_t *tile;
+    int p[3] = {pos[0] & ~(int)(N - 1),
+                pos[1] & ~(int)(N - 1),
+                pos[2] & ~(int)(N - 1)};
 
-    cache_add(cache, &key, sizeof(key), volume_copy(volume), 1, volume_del);
+    HASH_FIND(hh, sdf->tiles, p, sizeof(p), tile);
+    if (!tile) return sdf->max_dist;
+    if (tile->data->uniform) return tile->data->value;
+    return tile->data->dist[((pos[2] - p[2]) * N + pos[1] - p[1]) * N +
+                            pos[0] - p[0]];
 }
 
 void volume_crop(volume_t *volume, const float box[4][4])
@@ -525,15 +2276,37 @@ void volume_crop(volume_t *volume, const float box[4][4])
 uint32_t volume_crc32(const volume_t *volume)
 {
     volume_iterator_t iter;
-    int pos[3];
-    uint8_t v[4];
+    int i, t, nb = 0, cap = 0, pos[3], aabb[2][3];
+    int (*tiles)[3] = NULL;
+    uint8_t (*buf)[4];
     uint32_t ret = 0;
-    iter = volume_get_iterator(volume, VOLUME_ITER_VOXELS);
+
+    // Use the tiles position order, so that the result doesn't depend on
+    // the order of the tiles in the volume.
+    iter = volume_get_iterator(volume,
+            VOLUME_ITER_TILES | VOLUME_ITER_SKIP_EMPTY);
     while (volume_iter(&iter, pos)) {
-        volume_get_at(volume, &iter, pos, v);
-        if (!v[3]) continue;
-        ret = XXH32(pos, sizeof(pos), ret);
-        ret = XXH32(v, sizeof(v), ret);
+        if (nb == cap) {
+            cap = max(256, cap * 2);
+            tiles = realloc(tiles, cap * sizeof(*tiles));
+        }
+        memcpy(tiles[nb++], pos, sizeof(pos));
+    }
+    if (nb) qsort(tiles, nb, sizeof(*tiles), tile_pos_cmp);
+    buf = malloc(N * N * N * 4);
+    for (t = 0; t < nb; t++) {
+        volume_get_tile_aabb(tiles[t], aabb);
+        volume_read_region(volume, aabb, (uint8_t*)buf, NULL);
+        for (i = 0; i < N * N * N; i++) {
+            if (!buf[i][3]) continue;
+            pos[0] = tiles[t][0] + i % N;
+            pos[1] = tiles[t][1] + i / N % N;
+            pos[2] = tiles[t][2] + i / (N * N);
+            ret = XXH32(pos, sizeof(pos), ret);
+            ret = XXH32(buf[i], 4, ret);
+        }
     }
+    free(buf);
+    free(tiles);
     return ret;
 }
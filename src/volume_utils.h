@@ -66,7 +66,7 @@ typedef struct voxel_vertex
     int8_t   tangent[3]                 __attribute__((aligned(4)));
     int8_t   gradient[3]                __attribute__((aligned(4)));
     uint8_t  color[4]                   __attribute__((aligned(4)));
-    uint16_t pos_data                   __attribute__((aligned(4)));
+    uint32_t pos_data                   __attribute__((aligned(4)));
     uint8_t  uv[2]                      __attribute__((aligned(4)));
     uint8_t  occlusion_uv[2]            __attribute__((aligned(4)));
     uint8_t  bump_uv[2]                 __attribute__((aligned(4)));
@@ -90,6 +90,16 @@ typedef struct volume_mesh
     float pos_max[3];
 } volume_mesh_t;
 
+// Vertices of a single tile, as returned by volume_generate_vertices.
+typedef struct volume_tile_vertices
+{
+    int pos[3];
+    int nb;         // Number of faces.
+    int size;       // 4 for quads and 3 for triangles.
+    int subdivide;
+    voxel_vertex_t *vertices;
+} volume_tile_vertices_t;
+
 // Type: painter_t
 // The painting context, including the tool, brush, mode, radius,
 // color, etc...
@@ -129,7 +139,17 @@ void volume_get_box(const volume_t *volume, bool exact, float box[4][4]);
 void volume_op(volume_t *volume, const painter_t *painter,
                const float box[4][4]);
 
-// XXX: to cleanup.
+/*
+ * Function: volume_extrude
+ * Fill a box with the projection of the voxels of an axis aligned plane.
+ *
+ * All the other voxels of the tiles touched by the box are cleared.
+ *
+ * Parameters:
+ *   volume - The volume to modify.
+ *   plane  - The plane we project the voxels from.
+ *   box    - The axis aligned box to fill.
+ */
 void volume_extrude(volume_t *volume,
                   const float plane[4][4],
                   const float box[4][4]);
@@ -148,7 +168,7 @@ void volume_extrude(volume_t *volume,
  *   w    - Width of the data.
  *   h    - Height of the data.
  *   d    - Depth of the data.
- *   iter - Optional iterator for optimized access.
+ *   iter - Not used anymore.
  */
 void volume_blit(volume_t *volume, const uint8_t *data,
                int x, int y, int z, int w, int h, int d,
@@ -167,6 +187,95 @@ int volume_select(const volume_t *volume,
                             volume_accessor_t *volume_accessor),
                 void *user, volume_t *selection);
 
+/*
+ * Enum: MORPH_SHAPE
+ * Structuring elements of the morphology functions.
+ *
+ *   MORPH_CUBE   - The voxels with all coordinates within the radius.
+ *   MORPH_SPHERE - The voxels within the radius (euclidean distance).
+ *   MORPH_CROSS  - The voxels within the radius (manhattan distance).
+ */
+enum {
+    MORPH_CUBE,
+    MORPH_SPHERE,
+    MORPH_CROSS,
+};
+
+// Max radius of the morphology structuring elements.
+#define MORPH_MAX_RADIUS 16
+
+/*
+ * Function: volume_dilate
+ * Grow the volume by a structuring element.
+ *
+ * The added voxels take the color of the closest voxel.
+ *
+ * Parameters:
+ *   volume - The volume to modify.
+ *   shape  - One of the <MORPH_SHAPE> enum values.
+ *   radius - Radius of the element, up to MORPH_MAX_RADIUS.
+ */
+void volume_dilate(volume_t *volume, int shape, int radius);
+
+/*
+ * Function: volume_erode
+ * Shrink the volume by a structuring element.
+ *
+ * Only the voxels that have all the voxels of the element around them
+ * are kept.
+ */
+void volume_erode(volume_t *volume, int shape, int radius);
+
+/*
+ * Function: volume_shell
+ * Remove the inside of the volume, only keeping the voxels that would be
+ * removed by an erosion of the given thickness.
+ */
+void volume_shell(volume_t *volume, int shape, int thickness);
+
+typedef struct volume_sdf volume_sdf_t;
+
+/*
+ * Function: volume_compute_sdf
+ * Compute the signed distance field of a volume.
+ *
+ * The distance is computed from the center of the voxels to the surface
+ * of the solid voxels (alpha >= 127), negative inside, and clamped to
+ * max_dist.  The result is cached, and the caller gets its own reference
+ * to it, that should be released with <volume_sdf_release>.
+ *
+ * This uses the caches, so it should only be called from the main thread.
+ * The returned field can be read from any thread until it is released.
+ *
+ * Parameters:
+ *   volume   - Input volume.
+ *   max_dist - Max distance we compute, up to the tile size minus one.
+ */
+volume_sdf_t *volume_compute_sdf(const volume_t *volume, int max_dist);
+
+/*
+ * Function: volume_sdf_release
+ * Release a reference returned by <volume_compute_sdf>.
+ *
+ * Like <volume_compute_sdf>, this should only be called from the main
+ * thread.
+ */
+void volume_sdf_release(volume_sdf_t *sdf);
+
+/*
+ * Function: volume_compute_mc_sdf
+ * Compute the distance field used by the smooth marching cube normals.
+ *
+ * Same as <volume_compute_sdf>, with the distance the marching cube needs.
+ */
+volume_sdf_t *volume_compute_mc_sdf(const volume_t *volume);
+
+/*
+ * Function: volume_sdf_get
+ * Get the value of a signed distance field at a given position.
+ */
+float volume_sdf_get(const volume_sdf_t *sdf, const int pos[3]);
+
 /*
  * Function: volume_merge
  * Merge a volume into an other using a given blending function.
@@ -181,14 +290,44 @@ int volume_select(const volume_t *volume,
 void volume_merge(volume_t *volume, const volume_t *other, int mode,
                 const uint8_t color[4]);
 
+typedef struct volume_faces volume_faces_t;
+
+/*
+ * Function: volume_faces_new
+ * Create the buffer used by <volume_generate_vertices> to merge the faces.
+ *
+ * A single buffer can be reused for any number of tiles, but only by one
+ * thread at a time.
+ */
+volume_faces_t *volume_faces_new(void);
+
+/*
+ * Function: volume_faces_delete
+ * Delete a buffer created by <volume_faces_new>.
+ */
+void volume_faces_delete(volume_faces_t *faces);
+
 /*
  * Function: volume_generate_vertices
  * Generate a vertice array for rendering a volume block.
  *
+ * This only reads the volume, so it can run from any thread, except with
+ * the marching cube effect and no sdf, since computing the distance field
+ * uses the caches.
+ *
  * Parameters:
  *   volume       - Input volume.
  *   block_pos  - Position of the volume block to render.
- *   effects    - Effect flags.
+ *   effects    - Effect flags.  With EFFECT_MERGE_FACES the faces of
+ *                the tile with the same color are merged into bigger
+ *                quads, except the ones with ambient occlusion.
+ *   sdf        - Optional distance field returned by
+ *                <volume_compute_mc_sdf>, for the smooth marching cube
+ *                normals.  If NULL it is computed for each call, so the
+ *                callers rendering several tiles should pass it.
+ *   faces      - Optional buffer returned by <volume_faces_new>, used
+ *                with EFFECT_MERGE_FACES.  If NULL it is allocated for
+ *                each call.
  *   out        - Output array.
  *   size       - Output the size of a single face.
  *                4 for quads and 3 for triangles.  Normal volume uses quad
@@ -198,8 +337,27 @@ void volume_merge(volume_t *volume, const volume_t *other, int mode,
  *                can use more.
  */
 int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
-                           int effects, voxel_vertex_t *out,
-                           int *size, int *subdivide);
+                           int effects, const volume_sdf_t *sdf,
+                           volume_faces_t *faces,
+                           voxel_vertex_t *out, int *size, int *subdivide);
+
+/*
+ * Function: volume_generate_tiles_vertices
+ * Call volume_generate_vertices on all the tiles of a volume, in parallel.
+ *
+ * This is for the export functions that need the tiles faces.  The tiles
+ * are returned in the volume iteration order, including the ones without
+ * faces.  The result should be released with <volume_tiles_vertices_free>.
+ *
+ * Parameters:
+ *   volume   - Input volume.
+ *   effects  - Effect flags, as for volume_generate_vertices.
+ *   nb       - Output the number of tiles.
+ */
+volume_tile_vertices_t *volume_generate_tiles_vertices(
+        const volume_t *volume, int effects, int *nb);
+
+void volume_tiles_vertices_free(volume_tile_vertices_t *tiles, int nb);
 
 /*
  * volume_generate_mesh
@@ -207,14 +365,21 @@ int volume_generate_vertices(const volume_t *volume, const int block_pos[3],
  * the entire volume (instead of one mesh per tile).
  * Also we don't save the extra data.
  *
- * This is better suited for export function.
+ * This is better suited for export function.  The tiles are meshed in
+ * parallel.
  *
  * Parameters:
- *   simplify - 0 to 1.  0 for no simplification, 1 for most simplification.
+ *   simplify   - 0 to 1.  0 for no simplification, 1 for most
+ *                simplification.
+ *   chunk_size - If not 0, the mesh is optimized separately for each
+ *                cubic chunk of this size (rounded to the tile size), in
+ *                parallel.  This is faster for big volumes, but the
+ *                vertices on the borders of the chunks are not merged or
+ *                simplified.
  */
 volume_mesh_t *volume_generate_mesh(
         const volume_t *volume, int effects, const palette_t *palette,
-        float simplify);
+        float simplify, int chunk_size);
 
 void volume_mesh_free(volume_mesh_t *mesh);
 
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+
+# Goxel 3D voxels editor
+#
+# copyright (c) 2024 Guillaume Chereau <guillaume@noctua-software.com>
+#
+# Goxel is free software: you can redistribute it and/or modify it under the
+# terms of the GNU General Public License as published by the Free Software
+# Foundation, either version 3 of the License, or (at your option) any later
+# version.
+#
+# Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# goxel.  If not, see <http://www.gnu.org/licenses/>.
+
+# Build goxel in release mode with all the supported tile sizes, and run the
+# benchmarks (goxel --bench) of each build on the same scene.
+
+import os
+import subprocess
+import sys
+
+if os.path.basename(os.path.dirname(__file__)) != "tools":
+    print("Should be run from goxel root directory")
+    sys.exit(-1)
+
+TILE_SIZES = [16, 32]
+
+for size in TILE_SIZES:
+    build_dir = f'build/bench-{size}'
+    subprocess.check_call([
+        'cmake', '-S', '.', '-B', build_dir,
+        '-DCMAKE_BUILD_TYPE=Release', f'-DTILE_SIZE={size}'])
+    subprocess.check_call(['cmake', '--build', build_dir, '-j'])
+
+for size in TILE_SIZES:
+    subprocess.check_call([f'build/bench-{size}/goxel', '--bench'])
+    print()